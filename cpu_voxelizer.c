@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CPU_VOXELIZER_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#include "cpu_voxelizer.h"
+
+#ifdef _WIN32
+typedef HANDLE             thread_handle;
+typedef CRITICAL_SECTION   mutex;
+typedef CONDITION_VARIABLE condition;
+#define THREAD_RETURN      DWORD WINAPI
+#define mutex_init(m)      (InitializeCriticalSection(m), 0)
+#define mutex_destroy(m)   DeleteCriticalSection(m)
+#define mutex_lock(m)      EnterCriticalSection(m)
+#define mutex_unlock(m)    LeaveCriticalSection(m)
+#define condition_init(c)  (InitializeConditionVariable(c), 0)
+#define condition_destroy(c) ((void)(c))
+#define condition_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define condition_signal(c)  WakeConditionVariable(c)
+#define condition_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_t          thread_handle;
+typedef pthread_mutex_t    mutex;
+typedef pthread_cond_t     condition;
+#define THREAD_RETURN      void *
+#define mutex_init(m)      pthread_mutex_init(m, NULL)
+#define mutex_destroy(m)   pthread_mutex_destroy(m)
+#define mutex_lock(m)      pthread_mutex_lock(m)
+#define mutex_unlock(m)    pthread_mutex_unlock(m)
+#define condition_init(c)  pthread_cond_init(c, NULL)
+#define condition_destroy(c) pthread_cond_destroy(c)
+#define condition_wait(c, m) pthread_cond_wait(c, m)
+#define condition_signal(c)  pthread_cond_signal(c)
+#define condition_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/* Triangles a worker takes from its own range at a time */
+#define WORK_CHUNK 64
+
+/* The triangles a worker has left, owners take from the front and thieves
+ * from the back */
+typedef struct _work_range {
+    mutex   lock;
+    cl_long begin, end;
+} work_range;
+
+typedef struct _worker {
+    struct _cpu_voxelizer *voxelizer;
+    int                   index;
+} worker;
+
+typedef struct _voxelize_job {
+    float           inv_element_size;
+    float           corner[3];
+    cl_int          cell_length[3];
+    size_t          next_row_offset, next_slice_offset;
+    cl_int          mesh_data_count;
+    const mesh_data *mesh_data_list;
+    /* Index of the first triangle of each mesh over all meshes, with the
+     * total triangle count at the end */
+    cl_long         *first_triangle;
+    cl_uchar        *grid;
+} voxelize_job;
+
+struct _cpu_voxelizer {
+    int           num_threads;
+    /* Worker 0 is the calling thread, the others are in threads */
+    thread_handle *threads;
+    int           num_started;
+    worker        *workers;
+    work_range    *ranges;
+
+    /* Held for a whole job, so jobs from several threads take turns */
+    mutex         job_lock;
+    mutex         lock;
+    condition     start_cond;
+    condition     done_cond;
+    /* Bumped to start every job */
+    unsigned int  generation;
+    int           num_running;
+    int           shutdown;
+    const voxelize_job *job;
+};
+
+#define HALF_VOXEL 0.5f
+
+#ifdef CPU_VOXELIZER_SSE
+/* Per-lane mask of boxes not separated along an axis, with p* the
+ * projections of the triangle's vertices relative to the box centre and r
+ * the box's projected radius */
+static __m128 axis_overlap4(__m128 p0, __m128 p1, __m128 p2, __m128 r)
+{
+    __m128 lo = _mm_min_ps(_mm_min_ps(p0, p1), p2);
+    __m128 hi = _mm_max_ps(_mm_max_ps(p0, p1), p2);
+    __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+
+    return _mm_and_ps(_mm_cmple_ps(lo, r), _mm_cmpge_ps(hi, neg_r));
+}
+#endif
+
+static int axis_overlap(float p0, float p1, float p2, float r)
+{
+    float lo = p0 < p1 ? (p0 < p2 ? p0 : p2) : (p1 < p2 ? p1 : p2);
+    float hi = p0 > p1 ? (p0 > p2 ? p0 : p2) : (p1 > p2 ? p1 : p2);
+
+    return lo <= r && hi >= -r;
+}
+
+/* Separating axis test (Akenine-Moller) of a triangle against the unit
+ * voxel centred at c. The triangle / box AABB axes are implied by only
+ * visiting voxels within the triangle's bounds. */
+static int tri_box_overlap(const float v[3][3],
+                           const float e[3][3],
+                           const float n[3],
+                           float n_radius,
+                           const float c[3])
+{
+    float u[3][3];
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            u[i][j] = v[i][j] - c[j];
+    }
+
+    for (i = 0; i < 3; i++) {
+        const float *ei = e[i];
+        float rx = HALF_VOXEL * (fabsf(ei[1]) + fabsf(ei[2]));
+        float ry = HALF_VOXEL * (fabsf(ei[0]) + fabsf(ei[2]));
+        float rz = HALF_VOXEL * (fabsf(ei[0]) + fabsf(ei[1]));
+
+        if (!axis_overlap(ei[2] * u[0][1] - ei[1] * u[0][2],
+                          ei[2] * u[1][1] - ei[1] * u[1][2],
+                          ei[2] * u[2][1] - ei[1] * u[2][2], rx) ||
+            !axis_overlap(ei[0] * u[0][2] - ei[2] * u[0][0],
+                          ei[0] * u[1][2] - ei[2] * u[1][0],
+                          ei[0] * u[2][2] - ei[2] * u[2][0], ry) ||
+            !axis_overlap(ei[1] * u[0][0] - ei[0] * u[0][1],
+                          ei[1] * u[1][0] - ei[0] * u[1][1],
+                          ei[1] * u[2][0] - ei[0] * u[2][1], rz))
+            return 0;
+    }
+
+    return fabsf(n[0] * u[0][0] + n[1] * u[0][1] + n[2] * u[0][2]) <= n_radius;
+}
+
+static void voxelize_triangle(const voxelize_job *job, const float v[3][3])
+{
+    float e[3][3], n[3], n_radius;
+    cl_int lo[3], hi[3];
+    cl_int x, y, z;
+    int i, j;
+
+    for (j = 0; j < 3; j++) {
+        float vmin = v[0][j], vmax = v[0][j];
+        for (i = 1; i < 3; i++) {
+            vmin = v[i][j] < vmin ? v[i][j] : vmin;
+            vmax = v[i][j] > vmax ? v[i][j] : vmax;
+        }
+        /* Also rejects NaNs */
+        if (!(vmax >= 0 && vmin < (float)job->cell_length[j]))
+            return;
+        lo[j] = vmin > 0 ? (cl_int)vmin : 0;
+        hi[j] = vmax < (float)(job->cell_length[j] - 1) ?
+            (cl_int)vmax : job->cell_length[j] - 1;
+    }
+
+    for (j = 0; j < 3; j++) {
+        e[0][j] = v[1][j] - v[0][j];
+        e[1][j] = v[2][j] - v[1][j];
+        e[2][j] = v[0][j] - v[2][j];
+    }
+    n[0] = e[0][1] * e[1][2] - e[0][2] * e[1][1];
+    n[1] = e[0][2] * e[1][0] - e[0][0] * e[1][2];
+    n[2] = e[0][0] * e[1][1] - e[0][1] * e[1][0];
+    n_radius = HALF_VOXEL * (fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]));
+
+    for (z = lo[2]; z <= hi[2]; z++) {
+        for (y = lo[1]; y <= hi[1]; y++) {
+            cl_uchar *row = job->grid + (size_t)z * job->next_slice_offset +
+                (size_t)y * job->next_row_offset;
+            float c[3];
+
+            c[1] = y + HALF_VOXEL;
+            c[2] = z + HALF_VOXEL;
+            x = lo[0];
+
+#ifdef CPU_VOXELIZER_SSE
+            /* Four voxels along x at a time, only u.x differs per lane */
+            for (; x + 3 <= hi[0]; x += 4) {
+                __m128 cx = _mm_add_ps(_mm_set1_ps((float)x + HALF_VOXEL),
+                                       _mm_set_ps(3, 2, 1, 0));
+                __m128 ux[3], uy[3], uz[3];
+                __m128 sign_mask = _mm_set1_ps(-0.0f);
+                __m128 mask = _mm_cmpeq_ps(cx, cx);
+                __m128 s;
+                int bits;
+
+                for (i = 0; i < 3; i++) {
+                    ux[i] = _mm_sub_ps(_mm_set1_ps(v[i][0]), cx);
+                    uy[i] = _mm_set1_ps(v[i][1] - c[1]);
+                    uz[i] = _mm_set1_ps(v[i][2] - c[2]);
+                }
+
+                for (i = 0; i < 3; i++) {
+                    __m128 ex = _mm_set1_ps(e[i][0]);
+                    __m128 ey = _mm_set1_ps(e[i][1]);
+                    __m128 ez = _mm_set1_ps(e[i][2]);
+                    __m128 rx = _mm_set1_ps(HALF_VOXEL * (fabsf(e[i][1]) + fabsf(e[i][2])));
+                    __m128 ry = _mm_set1_ps(HALF_VOXEL * (fabsf(e[i][0]) + fabsf(e[i][2])));
+                    __m128 rz = _mm_set1_ps(HALF_VOXEL * (fabsf(e[i][0]) + fabsf(e[i][1])));
+
+                    mask = _mm_and_ps(mask, axis_overlap4(
+                        _mm_sub_ps(_mm_mul_ps(ez, uy[0]), _mm_mul_ps(ey, uz[0])),
+                        _mm_sub_ps(_mm_mul_ps(ez, uy[1]), _mm_mul_ps(ey, uz[1])),
+                        _mm_sub_ps(_mm_mul_ps(ez, uy[2]), _mm_mul_ps(ey, uz[2])),
+                        rx));
+                    mask = _mm_and_ps(mask, axis_overlap4(
+                        _mm_sub_ps(_mm_mul_ps(ex, uz[0]), _mm_mul_ps(ez, ux[0])),
+                        _mm_sub_ps(_mm_mul_ps(ex, uz[1]), _mm_mul_ps(ez, ux[1])),
+                        _mm_sub_ps(_mm_mul_ps(ex, uz[2]), _mm_mul_ps(ez, ux[2])),
+                        ry));
+                    mask = _mm_and_ps(mask, axis_overlap4(
+                        _mm_sub_ps(_mm_mul_ps(ey, ux[0]), _mm_mul_ps(ex, uy[0])),
+                        _mm_sub_ps(_mm_mul_ps(ey, ux[1]), _mm_mul_ps(ex, uy[1])),
+                        _mm_sub_ps(_mm_mul_ps(ey, ux[2]), _mm_mul_ps(ex, uy[2])),
+                        rz));
+                }
+
+                s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(n[0]), ux[0]),
+                                          _mm_mul_ps(_mm_set1_ps(n[1]), uy[0])),
+                               _mm_mul_ps(_mm_set1_ps(n[2]), uz[0]));
+                mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_andnot_ps(sign_mask, s),
+                                                     _mm_set1_ps(n_radius)));
+
+                /* Several threads may set the same voxel, always to 1 */
+                bits = _mm_movemask_ps(mask);
+                for (i = 0; i < 4; i++) {
+                    if (bits & (1 << i))
+                        row[x + i] = 1;
+                }
+            }
+#endif
+
+            for (; x <= hi[0]; x++) {
+                c[0] = x + HALF_VOXEL;
+                if (tri_box_overlap(v, e, n, n_radius, c))
+                    row[x] = 1;
+            }
+        }
+    }
+}
+
+static void voxelize_range(const voxelize_job *job, cl_long begin, cl_long end)
+{
+    cl_int lo = 0, hi = job->mesh_data_count - 1, mid;
+    cl_long t;
+
+    /* Mesh containing begin, skipping empty ones */
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (job->first_triangle[mid] <= begin)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    for (t = begin; t < end; t++) {
+        const mesh_data *mesh;
+        const cl_int *tri;
+        float v[3][3];
+        int i, j;
+
+        while (t >= job->first_triangle[lo + 1])
+            lo++;
+        mesh = &job->mesh_data_list[lo];
+        tri = mesh->triangles + 3 * (t - job->first_triangle[lo]);
+
+        for (i = 0; i < 3; i++) {
+            const float *p = mesh->vertices + 3 * (size_t)tri[i];
+            for (j = 0; j < 3; j++)
+                v[i][j] = (p[j] - job->corner[j]) * job->inv_element_size;
+        }
+
+        voxelize_triangle(job, v);
+    }
+}
+
+/* Next triangles for worker self, from its own range or stolen from
+ * another worker's. Returns 0 once there is nothing left anywhere. */
+static int take_work(cpu_voxelizer voxelizer,
+                     int self,
+                     cl_long *begin_out,
+                     cl_long *end_out)
+{
+    work_range *own = &voxelizer->ranges[self];
+    int k;
+
+    for (;;) {
+        mutex_lock(&own->lock);
+        if (own->begin < own->end) {
+            *begin_out = own->begin;
+            *end_out = own->end - own->begin > WORK_CHUNK ?
+                own->begin + WORK_CHUNK : own->end;
+            own->begin = *end_out;
+            mutex_unlock(&own->lock);
+            return 1;
+        }
+        mutex_unlock(&own->lock);
+
+        /* Steal the back half of the first non-empty range */
+        for (k = 1; k < voxelizer->num_threads; k++) {
+            work_range *victim =
+                &voxelizer->ranges[(self + k) % voxelizer->num_threads];
+            cl_long begin, end;
+
+            mutex_lock(&victim->lock);
+            end = victim->end;
+            begin = end - (victim->end - victim->begin + 1) / 2;
+            victim->end = begin;
+            mutex_unlock(&victim->lock);
+
+            if (begin < end) {
+                mutex_lock(&own->lock);
+                own->begin = begin;
+                own->end = end;
+                mutex_unlock(&own->lock);
+                break;
+            }
+        }
+        if (k == voxelizer->num_threads)
+            return 0;
+    }
+}
+
+static void run_worker(cpu_voxelizer voxelizer, int self)
+{
+    cl_long begin, end;
+
+    while (take_work(voxelizer, self, &begin, &end))
+        voxelize_range(voxelizer->job, begin, end);
+}
+
+static THREAD_RETURN worker_main(void *arg)
+{
+    worker *w = arg;
+    cpu_voxelizer voxelizer = w->voxelizer;
+    unsigned int seen = 0;
+
+    for (;;) {
+        mutex_lock(&voxelizer->lock);
+        while (voxelizer->generation == seen && !voxelizer->shutdown)
+            condition_wait(&voxelizer->start_cond, &voxelizer->lock);
+        if (voxelizer->shutdown) {
+            mutex_unlock(&voxelizer->lock);
+            break;
+        }
+        seen = voxelizer->generation;
+        mutex_unlock(&voxelizer->lock);
+
+        run_worker(voxelizer, w->index);
+
+        mutex_lock(&voxelizer->lock);
+        if (--voxelizer->num_running == 0)
+            condition_signal(&voxelizer->done_cond);
+        mutex_unlock(&voxelizer->lock);
+    }
+
+    return 0;
+}
+
+static int get_num_processors(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+int cpu_voxelizer_create(int num_threads, cpu_voxelizer *voxelizer_out)
+{
+    cpu_voxelizer voxelizer;
+    int i;
+
+    assert(num_threads >= 0);
+    assert(voxelizer_out != NULL);
+
+    if (num_threads == 0)
+        num_threads = get_num_processors();
+
+    voxelizer = calloc(1, sizeof(*voxelizer));
+    if (!voxelizer)
+        return -1;
+
+    voxelizer->num_threads = num_threads;
+    voxelizer->threads = calloc(num_threads, sizeof(*voxelizer->threads));
+    voxelizer->workers = calloc(num_threads, sizeof(*voxelizer->workers));
+    voxelizer->ranges = calloc(num_threads, sizeof(*voxelizer->ranges));
+    if (!voxelizer->threads || !voxelizer->workers || !voxelizer->ranges) {
+        free(voxelizer->threads);
+        free(voxelizer->workers);
+        free(voxelizer->ranges);
+        free(voxelizer);
+        return -1;
+    }
+
+    mutex_init(&voxelizer->job_lock);
+    mutex_init(&voxelizer->lock);
+    condition_init(&voxelizer->start_cond);
+    condition_init(&voxelizer->done_cond);
+    for (i = 0; i < num_threads; i++) {
+        mutex_init(&voxelizer->ranges[i].lock);
+        voxelizer->workers[i].voxelizer = voxelizer;
+        voxelizer->workers[i].index = i;
+    }
+
+    for (i = 1; i < num_threads; i++) {
+#ifdef _WIN32
+        voxelizer->threads[i] = CreateThread(NULL, 0, worker_main,
+                                             &voxelizer->workers[i], 0, NULL);
+        if (!voxelizer->threads[i])
+            goto error;
+#else
+        if (pthread_create(&voxelizer->threads[i], NULL, worker_main,
+                           &voxelizer->workers[i]))
+            goto error;
+#endif
+        voxelizer->num_started = i;
+    }
+
+    *voxelizer_out = voxelizer;
+    return 0;
+error:
+    cpu_voxelizer_destroy(voxelizer);
+    return -1;
+}
+
+void cpu_voxelizer_destroy(cpu_voxelizer voxelizer)
+{
+    int i;
+    if (!voxelizer) return;
+
+    mutex_lock(&voxelizer->lock);
+    voxelizer->shutdown = 1;
+    condition_broadcast(&voxelizer->start_cond);
+    mutex_unlock(&voxelizer->lock);
+
+    for (i = 1; i <= voxelizer->num_started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(voxelizer->threads[i], INFINITE);
+        CloseHandle(voxelizer->threads[i]);
+#else
+        pthread_join(voxelizer->threads[i], NULL);
+#endif
+    }
+
+    for (i = 0; i < voxelizer->num_threads; i++)
+        mutex_destroy(&voxelizer->ranges[i].lock);
+    condition_destroy(&voxelizer->done_cond);
+    condition_destroy(&voxelizer->start_cond);
+    mutex_destroy(&voxelizer->lock);
+    mutex_destroy(&voxelizer->job_lock);
+
+    free(voxelizer->threads);
+    free(voxelizer->workers);
+    free(voxelizer->ranges);
+    free(voxelizer);
+}
+
+int cpu_voxelizer_num_threads(cpu_voxelizer voxelizer)
+{
+    return voxelizer->num_threads;
+}
+
+int cpu_voxelizer_voxelize(cpu_voxelizer voxelizer,
+                           float inv_element_size,
+                           float corner_x,
+                           float corner_y,
+                           float corner_z,
+                           cl_int x_cell_length,
+                           cl_int y_cell_length,
+                           cl_int z_cell_length,
+                           cl_int mesh_data_count,
+                           const mesh_data *mesh_data_list,
+                           cl_uchar *voxel_grid_out)
+{
+    voxelize_job job;
+    cl_long total = 0;
+    cl_int i;
+
+    assert(voxelizer != NULL);
+    assert(x_cell_length >= 0);
+    assert(y_cell_length >= 0);
+    assert(z_cell_length >= 0);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL || mesh_data_count == 0);
+
+    memset(voxel_grid_out, 0, (size_t)x_cell_length * (size_t)y_cell_length *
+           (size_t)z_cell_length);
+
+    memset(&job, 0, sizeof(job));
+    job.inv_element_size = inv_element_size;
+    job.corner[0] = corner_x;
+    job.corner[1] = corner_y;
+    job.corner[2] = corner_z;
+    job.cell_length[0] = x_cell_length;
+    job.cell_length[1] = y_cell_length;
+    job.cell_length[2] = z_cell_length;
+    job.next_row_offset = (size_t)x_cell_length;
+    job.next_slice_offset = (size_t)x_cell_length * (size_t)y_cell_length;
+    job.mesh_data_count = mesh_data_count;
+    job.mesh_data_list = mesh_data_list;
+    job.grid = voxel_grid_out;
+
+    job.first_triangle = malloc(sizeof(*job.first_triangle) * (mesh_data_count + 1));
+    if (!job.first_triangle)
+        return -1;
+    for (i = 0; i < mesh_data_count; i++) {
+        job.first_triangle[i] = total;
+        total += mesh_data_list[i].num_triangles;
+    }
+    job.first_triangle[mesh_data_count] = total;
+
+    if (total == 0) {
+        free(job.first_triangle);
+        return 0;
+    }
+
+    mutex_lock(&voxelizer->job_lock);
+
+    /* Even split to start with, stealing evens out the rest */
+    for (i = 0; i < voxelizer->num_threads; i++) {
+        voxelizer->ranges[i].begin = total * i / voxelizer->num_threads;
+        voxelizer->ranges[i].end = total * (i + 1) / voxelizer->num_threads;
+    }
+
+    mutex_lock(&voxelizer->lock);
+    voxelizer->job = &job;
+    voxelizer->num_running = voxelizer->num_threads - 1;
+    voxelizer->generation++;
+    condition_broadcast(&voxelizer->start_cond);
+    mutex_unlock(&voxelizer->lock);
+
+    run_worker(voxelizer, 0);
+
+    mutex_lock(&voxelizer->lock);
+    while (voxelizer->num_running > 0)
+        condition_wait(&voxelizer->done_cond, &voxelizer->lock);
+    voxelizer->job = NULL;
+    mutex_unlock(&voxelizer->lock);
+
+    mutex_unlock(&voxelizer->job_lock);
+
+    free(job.first_triangle);
+    return 0;
+}
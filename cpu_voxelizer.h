@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Native multithreaded voxelizer, used by the plugin when there is no
+ * usable OpenCL device. Produces the same grid layout as the voxelize
+ * kernel: one cl_uchar per voxel, x fastest, 1 for every voxel a triangle
+ * overlaps.
+ */
+
+#ifndef CPU_VOXELIZER_H
+#define CPU_VOXELIZER_H
+
+#include "opencl_plugin.h"
+
+typedef struct _cpu_voxelizer *cpu_voxelizer;
+
+/* num_threads of 0 uses one thread per processor */
+int cpu_voxelizer_create(int num_threads, cpu_voxelizer *voxelizer_out);
+
+void cpu_voxelizer_destroy(cpu_voxelizer voxelizer);
+
+int cpu_voxelizer_num_threads(cpu_voxelizer voxelizer);
+
+/* Blocking, mesh indices are relative to the mesh's own vertices. Jobs
+ * from several threads on one voxelizer run one after the other. */
+int cpu_voxelizer_voxelize(cpu_voxelizer voxelizer,
+                           float inv_element_size,
+                           float corner_x,
+                           float corner_y,
+                           float corner_z,
+                           cl_int x_cell_length,
+                           cl_int y_cell_length,
+                           cl_int z_cell_length,
+                           cl_int mesh_data_count,
+                           const mesh_data *mesh_data_list,
+                           cl_uchar *voxel_grid_out);
+
+#endif /* CPU_VOXELIZER_H */
@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Auxiliary kernels operating on the voxel grid produced by the voxelize
+ * kernel in program.cl (one uchar per voxel, non-zero meaning occupied).
+ * Built with voxelize_common.cl prepended.
+ */
+
+/* Pack a grid into a bitfield of 32 voxels per uint, with the lowest voxel
+ * index in the least significant bit. One work-item per output word, any
+ * bits past num_voxels in the last word are zero. */
+__kernel void pack_bits(__global const uchar *grid,
+                        __global uint *bits,
+                        uint num_voxels)
+{
+    uint i = get_global_id(0);
+    uint base = i * 32;
+    uint word = 0;
+    uint j, n;
+
+    if (base >= num_voxels)
+        return;
+
+    n = min(32u, num_voxels - base);
+    if (n == 32) {
+        uchar16 lo = vload16(0, grid + base);
+        uchar16 hi = vload16(1, grid + base);
+        uint16 lo_bits = convert_uint16(lo != (uchar16)0) & (uint16)1;
+        uint16 hi_bits = convert_uint16(hi != (uchar16)0) & (uint16)1;
+        uint16 shift = (uint16)(0, 1, 2, 3, 4, 5, 6, 7,
+                                8, 9, 10, 11, 12, 13, 14, 15);
+        uint16 w = (lo_bits << shift) | (hi_bits << (shift + (uint16)16));
+        uint8 w8 = w.lo | w.hi;
+        uint4 w4 = w8.lo | w8.hi;
+        uint2 w2 = w4.lo | w4.hi;
+        word = w2.x | w2.y;
+    } else {
+        for (j = 0; j < n; j++)
+            word |= (grid[base + j] != 0 ? 1u : 0u) << j;
+    }
+
+    bits[i] = word;
+}
+
+/* Must match BRICK_SIZE in plugin.c */
+#define BRICK_SIZE 8
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+/* One work-item per BRICK_SIZE^3 brick of the grid. Every brick with at
+ * least one occupied voxel takes the next slot from *num_bricks and, if
+ * that is below max_bricks, writes its brick coordinates to brick_coords
+ * (3 ints per brick) and its voxels to brick_data (x fastest, voxels
+ * outside the grid are zero). *num_bricks ends up as the total number of
+ * occupied bricks, even if that didn't fit. */
+__kernel void compact_bricks(__global const uchar *grid,
+                             int x_cell_length,
+                             int y_cell_length,
+                             int z_cell_length,
+                             int x_bricks,
+                             int y_bricks,
+                             int z_bricks,
+                             __global int *num_bricks,
+                             __global int *brick_coords,
+                             __global uchar *brick_data,
+                             int max_bricks)
+{
+    int brick_idx = get_global_id(0);
+    int bx, by, bz, x0, y0, z0, x1, y1, z1, x, y, z;
+    int next_row_offset = x_cell_length;
+    int next_slice_offset = x_cell_length * y_cell_length;
+    int slot;
+    uchar occupied = 0;
+    __global uchar *dst;
+
+    if (brick_idx >= x_bricks * y_bricks * z_bricks)
+        return;
+
+    bx = brick_idx % x_bricks;
+    by = (brick_idx / x_bricks) % y_bricks;
+    bz = brick_idx / (x_bricks * y_bricks);
+
+    x0 = bx * BRICK_SIZE;
+    y0 = by * BRICK_SIZE;
+    z0 = bz * BRICK_SIZE;
+    x1 = min(x0 + BRICK_SIZE, x_cell_length);
+    y1 = min(y0 + BRICK_SIZE, y_cell_length);
+    z1 = min(z0 + BRICK_SIZE, z_cell_length);
+
+    for (z = z0; z < z1 && !occupied; z++) {
+        for (y = y0; y < y1 && !occupied; y++) {
+            __global const uchar *row = grid + z * next_slice_offset + y * next_row_offset;
+            for (x = x0; x < x1; x++)
+                occupied |= row[x];
+        }
+    }
+
+    if (!occupied)
+        return;
+
+    slot = atomic_inc(num_bricks);
+    if (slot >= max_bricks)
+        return;
+
+    brick_coords[3 * slot + 0] = bx;
+    brick_coords[3 * slot + 1] = by;
+    brick_coords[3 * slot + 2] = bz;
+
+    dst = brick_data + (size_t)slot * BRICK_VOXELS;
+    for (z = 0; z < BRICK_SIZE; z++) {
+        for (y = 0; y < BRICK_SIZE; y++) {
+            for (x = 0; x < BRICK_SIZE; x++) {
+                int gx = x0 + x, gy = y0 + y, gz = z0 + z;
+                uchar v = 0;
+                if (gx < x_cell_length && gy < y_cell_length && gz < z_cell_length)
+                    v = grid[gz * next_slice_offset + gy * next_row_offset + gx];
+                dst[(z * BRICK_SIZE + y) * BRICK_SIZE + x] = v;
+            }
+        }
+    }
+}
+
+/* Cull the triangles of one mesh against the grid and split the rest by
+ * size. vertex_offset / triangle_offset locate the mesh in the shared
+ * buffers (in vertices / triangles). Triangles whose voxel space bounds are
+ * entirely outside the grid (allowing a one voxel margin) are dropped, the
+ * others are appended to small_triangles, or large_triangles if their
+ * largest extent exceeds large_extent voxels, counted by bin_counts[0] and
+ * bin_counts[1]. Output indices are absolute (vertex_offset added), so the
+ * lists can be voxelized with a vertex base of 0. */
+__kernel void bin_triangles(__global const float *vertices,
+                            __global const int *triangles,
+                            int num_triangles,
+                            uint vertex_offset,
+                            uint triangle_offset,
+                            float inv_element_size,
+                            float corner_x,
+                            float corner_y,
+                            float corner_z,
+                            int x_cell_length,
+                            int y_cell_length,
+                            int z_cell_length,
+                            float large_extent,
+                            __global int *bin_counts,
+                            __global int *small_triangles,
+                            __global int *large_triangles)
+{
+    int i = get_global_id(0);
+    int3 tri;
+    float3 v0, v1, v2, lo, hi, extent;
+    float3 corner = (float3)(corner_x, corner_y, corner_z);
+    float3 grid_size = convert_float3((int3)(x_cell_length, y_cell_length,
+                                             z_cell_length));
+    int slot;
+
+    if (i >= num_triangles)
+        return;
+
+    tri = vload3((size_t)triangle_offset + i, triangles) + (int3)(vertex_offset);
+    v0 = vload3(tri.x, vertices);
+    v1 = vload3(tri.y, vertices);
+    v2 = vload3(tri.z, vertices);
+
+    lo = (fmin(fmin(v0, v1), v2) - corner) * inv_element_size;
+    hi = (fmax(fmax(v0, v1), v2) - corner) * inv_element_size;
+
+    if (any(hi < -1.0f) || any(lo > grid_size + 1.0f))
+        return;
+
+    extent = hi - lo;
+    if (fmax(fmax(extent.x, extent.y), extent.z) > large_extent) {
+        slot = atomic_inc(&bin_counts[1]);
+        vstore3(tri, slot, large_triangles);
+    } else {
+        slot = atomic_inc(&bin_counts[0]);
+        vstore3(tri, slot, small_triangles);
+    }
+}
+
+/* Gather the triangles of several meshes into one list of absolute
+ * indices, so they can be voxelized by a single launch with a vertex base
+ * of 0. mesh_table holds 3 ints per mesh: the index of its first triangle
+ * in the batch (ascending, an exclusive prefix sum of the triangle counts),
+ * its base vertex and its base triangle in the shared buffers. One
+ * work-item per batched triangle, which finds its mesh by binary search. */
+__kernel void batch_triangles(__global const int *triangles,
+                              __global const int *mesh_table,
+                              int num_meshes,
+                              int num_triangles,
+                              __global int *batched_triangles)
+{
+    int i = get_global_id(0);
+    int lo = 0, hi = num_meshes - 1, mid;
+    int3 tri;
+
+    if (i >= num_triangles)
+        return;
+
+    /* Last mesh starting at or before i, which skips empty meshes */
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (mesh_table[3 * mid] <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    tri = vload3(mesh_table[3 * lo + 2] + (i - mesh_table[3 * lo]), triangles);
+    vstore3(tri + (int3)(mesh_table[3 * lo + 1]), i, batched_triangles);
+}
+
+/*
+ * Solid fill of a voxelized surface, see opencl_plugin_set_solid_fill().
+ * The fills walk the grid in lines along one axis, one work-item per
+ * line: voxel t of line (u, v) is at u * u_stride + v * v_stride +
+ * t * line_stride.
+ */
+
+/* p with its components reordered to (u, v, t) for lines along axis */
+float3 line_space(float3 p, int axis)
+{
+    return axis == 0 ? p.yzx : axis == 1 ? p.zxy : p;
+}
+
+int3 line_space_int(int3 p, int axis)
+{
+    return axis == 0 ? p.yzx : axis == 1 ? p.zxy : p;
+}
+
+/* First pass of the parity fill, the solid voxelize kernel of
+ * voxelize_modes.cl along lines of axis: for every line a triangle
+ * crosses, toggle the first voxel of crossings whose centre lies past the
+ * crossing. Same arguments as the voxelize kernel, plus axis. */
+__kernel void mark_crossings(__global uchar *crossings,
+                             float inv_element_size,
+                             float corner_x,
+                             float corner_y,
+                             float corner_z,
+                             int next_row_offset,
+                             int next_slice_offset,
+                             int x_cell_length,
+                             int y_cell_length,
+                             int z_cell_length,
+                             __global const float *vertices,
+                             __global const int *triangles,
+                             int num_triangles,
+                             uint vertex_buffer_base_idx,
+                             uint triangle_buffer_base_idx,
+                             int axis)
+{
+    int i = get_global_id(0);
+    float3 v0, v1, v2, n;
+    int3 length, stride;
+
+    if (i >= num_triangles)
+        return;
+
+    load_triangle(vertices, triangles, vertex_buffer_base_idx,
+                  triangle_buffer_base_idx, i,
+                  (float3)(corner_x, corner_y, corner_z), inv_element_size,
+                  &v0, &v1, &v2);
+
+    /* A cyclic reordering, so the winding is kept */
+    v0 = line_space(v0, axis);
+    v1 = line_space(v1, axis);
+    v2 = line_space(v2, axis);
+    length = line_space_int((int3)(x_cell_length, y_cell_length,
+                                   z_cell_length), axis);
+    stride = line_space_int((int3)(1, next_row_offset, next_slice_offset),
+                            axis);
+
+    n = cross(v1 - v0, v2 - v0);
+    /* Parallel to the lines, none crosses it */
+    if (n.z == 0.0f)
+        return;
+
+    toggle_column_crossings(crossings, v0, v1, v2, n, length.x, length.y,
+                            length.z, (size_t)stride.x, (size_t)stride.y,
+                            (size_t)stride.z);
+}
+
+/* Second pass of the parity fill: a running parity of the crossings from
+ * mark_crossings along the line, setting every voxel inside. Counting the
+ * triangles rather than runs of surface voxels keeps lines that run along
+ * a wall or touch the surface right. Meshes must be closed, overlapping
+ * volumes cancel out. */
+__kernel void fill_shell_parity(__global uchar *grid,
+                                int line_length,
+                                int line_stride,
+                                int u_length,
+                                int u_stride,
+                                int v_length,
+                                int v_stride,
+                                __global const uchar *crossings)
+{
+    int u = get_global_id(0);
+    int v = get_global_id(1);
+    int t;
+    size_t idx;
+    uchar inside = 0;
+
+    if (u >= u_length || v >= v_length)
+        return;
+
+    idx = (size_t)u * u_stride + (size_t)v * v_stride;
+    for (t = 0; t < line_length; t++, idx += line_stride) {
+        inside ^= crossings[idx];
+        if (inside)
+            grid[idx] = 1;
+    }
+}
+
+/* Marks empty voxels reachable from outside the grid, surface voxels are
+ * assumed to be 1 */
+#define FLOOD_EXTERIOR 2
+
+/* Whether voxel t of line (u, v) is exterior, voxels outside the grid
+ * are */
+bool flood_is_exterior(__global const uchar *grid,
+                       int line_length,
+                       int line_stride,
+                       int u_length,
+                       int u_stride,
+                       int v_length,
+                       int v_stride,
+                       int t, int u, int v)
+{
+    if (t < 0 || t >= line_length || u < 0 || u >= u_length ||
+        v < 0 || v >= v_length)
+        return true;
+
+    return grid[(size_t)u * u_stride + (size_t)v * v_stride +
+                (size_t)t * line_stride] == FLOOD_EXTERIOR;
+}
+
+/* One sweep of the exterior flood fill: walk the line both ways, marking
+ * every empty voxel next to an exterior one (6-connected). A sweep carries
+ * the fill along the whole line, so sweeping each axis in turn converges in
+ * a few rounds for typical shapes. Neighbouring lines are read while other
+ * work-items mark them, which is harmless as voxels only ever go from empty
+ * to exterior. Sets *changed if anything was marked. */
+__kernel void flood_exterior(__global uchar *grid,
+                             int line_length,
+                             int line_stride,
+                             int u_length,
+                             int u_stride,
+                             int v_length,
+                             int v_stride,
+                             __global int *changed)
+{
+    int u = get_global_id(0);
+    int v = get_global_id(1);
+    int t, pass, step;
+    int marked = 0;
+    __global uchar *line;
+
+    if (u >= u_length || v >= v_length)
+        return;
+
+    line = grid + (size_t)u * u_stride + (size_t)v * v_stride;
+    for (pass = 0; pass < 2; pass++) {
+        step = pass == 0 ? 1 : -1;
+        for (t = pass == 0 ? 0 : line_length - 1;
+             t >= 0 && t < line_length; t += step) {
+            __global uchar *voxel = line + (size_t)t * line_stride;
+
+            if (*voxel != 0)
+                continue;
+
+            if (flood_is_exterior(grid, line_length, line_stride, u_length,
+                                  u_stride, v_length, v_stride, t - step, u, v) ||
+                flood_is_exterior(grid, line_length, line_stride, u_length,
+                                  u_stride, v_length, v_stride, t, u - 1, v) ||
+                flood_is_exterior(grid, line_length, line_stride, u_length,
+                                  u_stride, v_length, v_stride, t, u + 1, v) ||
+                flood_is_exterior(grid, line_length, line_stride, u_length,
+                                  u_stride, v_length, v_stride, t, u, v - 1) ||
+                flood_is_exterior(grid, line_length, line_stride, u_length,
+                                  u_stride, v_length, v_stride, t, u, v + 1)) {
+                *voxel = FLOOD_EXTERIOR;
+                marked = 1;
+            }
+        }
+    }
+
+    if (marked)
+        *changed = 1;
+}
+
+/* After the flood fill has converged everything that isn't exterior is
+ * solid. One work-item per voxel. */
+__kernel void finish_flood_fill(__global uchar *grid, uint num_voxels)
+{
+    uint i = get_global_id(0);
+
+    if (i >= num_voxels)
+        return;
+
+    grid[i] = grid[i] != FLOOD_EXTERIOR ? 1 : 0;
+}
+
+/* Copies of a mesh transformed by one row-major 3x4 matrix each, for
+ * instanced voxelization. Instance i (of num_instances, using matrix
+ * transform_base_idx + i) is written num_vertices vertices at
+ * out_base_idx + i * num_vertices. One work-item per vertex and
+ * instance. */
+__kernel void transform_vertices(__global const float *vertices,
+                                 int num_vertices,
+                                 __global const float *transforms,
+                                 uint transform_base_idx,
+                                 int num_instances,
+                                 __global float *out,
+                                 uint out_base_idx)
+{
+    int v = get_global_id(0);
+    int i = get_global_id(1);
+    __global const float *m;
+    float4 p;
+
+    if (v >= num_vertices || i >= num_instances)
+        return;
+
+    m = transforms + 12 * ((size_t)transform_base_idx + i);
+    p = (float4)(vload3(v, vertices), 1.0f);
+    vstore3((float3)(dot(vload4(0, m), p),
+                     dot(vload4(1, m), p),
+                     dot(vload4(2, m), p)),
+            (size_t)out_base_idx + (size_t)i * num_vertices + v, out);
+}
+
+/* Must match enum opencl_plugin_vertex_format in opencl_plugin.h */
+#define VERTEX_FIXED16 1
+#define VERTEX_HALF    2
+
+/* Expand num_vertices compact vertices starting at in[in_base_idx] into
+ * floats starting at vertex out_base_idx of out. Fixed point vertices
+ * decode to lo + q * scale. One work-item per vertex. */
+__kernel void decode_vertices(__global const ushort *in,
+                              uint in_base_idx,
+                              int format,
+                              float lo_x,
+                              float lo_y,
+                              float lo_z,
+                              float scale_x,
+                              float scale_y,
+                              float scale_z,
+                              int num_vertices,
+                              __global float *out,
+                              uint out_base_idx)
+{
+    int i = get_global_id(0);
+    float3 v;
+
+    if (i >= num_vertices)
+        return;
+
+    if (format == VERTEX_HALF) {
+        v = vload_half3(i, (__global const half *)(in + in_base_idx));
+    } else {
+        v = (float3)(lo_x, lo_y, lo_z) +
+            convert_float3(vload3(i, in + in_base_idx)) *
+            (float3)(scale_x, scale_y, scale_z);
+    }
+
+    vstore3(v, (size_t)out_base_idx + i, out);
+}
+
+/* Widen num_indices 16-bit indices starting at in[in_base_idx] to ints
+ * starting at out[out_base_idx], one work-item per index */
+__kernel void widen_indices(__global const ushort *in,
+                            uint in_base_idx,
+                            int num_indices,
+                            __global int *out,
+                            uint out_base_idx)
+{
+    int i = get_global_id(0);
+
+    if (i >= num_indices)
+        return;
+
+    out[(size_t)out_base_idx + i] = in[(size_t)in_base_idx + i];
+}
+
+/* Like the voxelize kernel in voxelize_modes.cl for
+ * VOXELIZE_CONSERVATIVE (same arguments and overlap test), but every voxel
+ * a triangle touches keeps the largest label key of those touching it. Key
+ * 0 is left for empty voxels. */
+__kernel void voxelize_labels(__global uint *keys,
+                              float inv_element_size,
+                              float corner_x,
+                              float corner_y,
+                              float corner_z,
+                              int next_row_offset,
+                              int next_slice_offset,
+                              int x_cell_length,
+                              int y_cell_length,
+                              int z_cell_length,
+                              __global const float *vertices,
+                              __global const int *triangles,
+                              int num_triangles,
+                              uint vertex_buffer_base_idx,
+                              uint triangle_buffer_base_idx,
+                              uint key)
+{
+    int i = get_global_id(0);
+    float3 v0, v1, v2;
+    triangle_sat sat;
+    int3 lo, hi;
+    int3 grid_max = (int3)(x_cell_length, y_cell_length, z_cell_length) - 1;
+    int x, y, z;
+
+    if (i >= num_triangles)
+        return;
+
+    load_triangle(vertices, triangles, vertex_buffer_base_idx,
+                  triangle_buffer_base_idx, i,
+                  (float3)(corner_x, corner_y, corner_z), inv_element_size,
+                  &v0, &v1, &v2);
+
+    if (!triangle_voxel_bounds(v0, v1, v2, grid_max, &lo, &hi))
+        return;
+    triangle_sat_init(&sat, v0, v1, v2);
+
+    for (z = lo.z; z <= hi.z; z++) {
+        for (y = lo.y; y <= hi.y; y++) {
+            __global uint *row = keys + (size_t)z * next_slice_offset +
+                (size_t)y * next_row_offset;
+            for (x = lo.x; x <= hi.x; x++) {
+                /* Skip the atomic if this key can't win anyway */
+                if (row[x] < key && triangle_sat_overlaps(&sat, x, y, z))
+                    atomic_max(&row[x], key);
+            }
+        }
+    }
+}
+
+/* Turn the keys of voxelize_labels into labels of label_bits (16 or 32)
+ * bits, all ones for empty voxels. With min_rule keys are
+ * UINT_MAX - label, otherwise label + 1. One work-item per voxel. */
+__kernel void finish_labels(__global const uint *keys,
+                            __global uchar *labels,
+                            uint num_voxels,
+                            int min_rule,
+                            int label_bits)
+{
+    uint i = get_global_id(0);
+    uint key, label;
+
+    if (i >= num_voxels)
+        return;
+
+    key = keys[i];
+    if (key == 0)
+        label = UINT_MAX;
+    else
+        label = min_rule ? UINT_MAX - key : key - 1;
+
+    if (label_bits == 16)
+        ((__global ushort *)labels)[i] = key == 0 ? USHRT_MAX : (ushort)label;
+    else
+        ((__global uint *)labels)[i] = label;
+}
+
+/* Must match enum opencl_plugin_lod_reduce in opencl_plugin.h */
+#define LOD_OR    0
+#define LOD_COUNT 1
+
+/* One level of a LOD pyramid: each voxel of dst combines the (up to)
+ * 2x2x2 voxels of src it covers, see enum opencl_plugin_lod_reduce. One
+ * work-item per dst voxel. */
+__kernel void reduce_grid(__global const uchar *src,
+                          int src_x_length,
+                          int src_y_length,
+                          int src_z_length,
+                          __global uchar *dst,
+                          int dst_x_length,
+                          int dst_y_length,
+                          int dst_z_length,
+                          int op)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z = get_global_id(2);
+    int dx, dy, dz;
+    uchar count = 0;
+
+    if (x >= dst_x_length || y >= dst_y_length || z >= dst_z_length)
+        return;
+
+    for (dz = 0; dz < 2; dz++) {
+        int sz = 2 * z + dz;
+        if (sz >= src_z_length)
+            break;
+        for (dy = 0; dy < 2; dy++) {
+            int sy = 2 * y + dy;
+            if (sy >= src_y_length)
+                break;
+            for (dx = 0; dx < 2; dx++) {
+                int sx = 2 * x + dx;
+                if (sx >= src_x_length)
+                    break;
+                count += src[((size_t)sz * src_y_length + sy) * src_x_length + sx] != 0;
+            }
+        }
+    }
+
+    dst[((size_t)z * dst_y_length + y) * dst_x_length + x] =
+        op == LOD_COUNT ? count : count != 0;
+}
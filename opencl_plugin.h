@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Public API of the opencl_experiments library, for C users such as
+ * voxelize_bench. Functions are documented at their definitions in
+ * plugin.c.
+ */
+
+#ifndef OPENCL_PLUGIN_H
+#define OPENCL_PLUGIN_H
+
+#include <CL/cl.h>
+
+#include <opencl_experiments_export.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _opencl_plugin *opencl_plugin;
+typedef struct _opencl_plugin_job *opencl_plugin_job;
+typedef struct _opencl_plugin_mesh *opencl_plugin_mesh;
+typedef struct _opencl_plugin_staging *opencl_plugin_staging;
+typedef struct _opencl_plugin_multi *opencl_plugin_multi;
+typedef struct _opencl_plugin_stream *opencl_plugin_stream;
+
+enum logging_msg_type {
+    LOGGING_MSG_TRACE,
+    LOGGING_MSG_WARNING,
+    LOGGING_MSG_ERROR,
+    /* Only for opencl_plugin_set_log_level(), turns all messages off */
+    LOGGING_MSG_NONE
+};
+
+typedef void (*debug_print_handler)(const char *, cl_int, cl_int, const char *);
+
+/* A completed device command, see opencl_plugin_set_telemetry() */
+enum opencl_plugin_phase {
+    OPENCL_PLUGIN_PHASE_FILL,
+    OPENCL_PLUGIN_PHASE_UPLOAD,
+    OPENCL_PLUGIN_PHASE_KERNEL,
+    OPENCL_PLUGIN_PHASE_READBACK
+};
+
+typedef struct _opencl_plugin_telemetry_event {
+    /* One of enum opencl_plugin_phase */
+    cl_int   phase;
+    cl_ulong duration_ns;
+    /* Transferred by uploads and readbacks, 0 otherwise */
+    cl_ulong bytes;
+} opencl_plugin_telemetry_event;
+
+/* Device timings of the most recent job, see opencl_plugin_get_stats() */
+typedef struct _opencl_plugin_stats {
+    /* Summed device time per phase, overlapping commands are counted
+     * separately */
+    cl_ulong fill_ns;
+    cl_ulong upload_ns;
+    cl_ulong kernel_ns;
+    cl_ulong readback_ns;
+    /* From the first command starting to the last one finishing */
+    cl_ulong total_ns;
+    cl_ulong bytes_uploaded;
+    cl_ulong bytes_read;
+    cl_ulong num_triangles;
+    /* num_triangles over total_ns */
+    double   triangles_per_second;
+} opencl_plugin_stats;
+
+/* When opencl_plugin_create_ex() runs jobs on the native CPU voxelizer
+ * instead of an OpenCL device. Only the opencl_plugin_voxelize_meshes*()
+ * entry points with dense or packed output are supported on the CPU. */
+enum opencl_plugin_cpu_mode {
+    OPENCL_PLUGIN_CPU_NEVER,
+    /* If no OpenCL device matches */
+    OPENCL_PLUGIN_CPU_FALLBACK,
+    OPENCL_PLUGIN_CPU_ALWAYS
+};
+
+/* How triangles are turned into voxels, see
+ * opencl_plugin_set_voxelize_mode() */
+enum opencl_plugin_voxelize_mode {
+    /* The voxelize kernel in program.cl */
+    OPENCL_PLUGIN_VOXELIZE_DEFAULT,
+    /* Every voxel a triangle touches, a 6-separating surface */
+    OPENCL_PLUGIN_VOXELIZE_CONSERVATIVE,
+    /* Every voxel whose centre is inside a closed mesh, by parity along z.
+     * Crossings are counted over all meshes of a job together, so where
+     * closed meshes overlap (e.g. the parts of an assembly) the volumes
+     * cancel out rather than merge. */
+    OPENCL_PLUGIN_VOXELIZE_SOLID
+};
+
+/* Which part a voxel overlapped by several parts is labelled with, see
+ * opencl_plugin_voxelize_meshes_labels() */
+enum opencl_plugin_label_rule {
+    OPENCL_PLUGIN_LABEL_MIN,
+    OPENCL_PLUGIN_LABEL_MAX
+};
+
+/* How a coarser LOD level combines 2x2x2 voxels of the one below, see
+ * opencl_plugin_voxelize_meshes_lod() */
+enum opencl_plugin_lod_reduce {
+    /* 1 if any of them is occupied */
+    OPENCL_PLUGIN_LOD_OR,
+    /* How many of them are occupied, 0 to 8 */
+    OPENCL_PLUGIN_LOD_COUNT
+};
+
+/* How meshes are uploaded, see opencl_plugin_set_mesh_compression() */
+enum opencl_plugin_vertex_format {
+    OPENCL_PLUGIN_VERTEX_FLOAT,
+    /* 16-bit fixed point within the mesh bounds */
+    OPENCL_PLUGIN_VERTEX_FIXED16,
+    /* Half floats, 11 significant bits */
+    OPENCL_PLUGIN_VERTEX_HALF
+};
+
+/* Device side fill of voxelized surfaces, see
+ * opencl_plugin_set_solid_fill() */
+enum opencl_plugin_solid_fill {
+    OPENCL_PLUGIN_SOLID_FILL_NONE,
+    /* Toggle inside / outside at every triangle crossing lines along one
+     * axis, like OPENCL_PLUGIN_VOXELIZE_SOLID: one pass, overlapping closed
+     * meshes cancel out */
+    OPENCL_PLUGIN_SOLID_FILL_PARITY,
+    /* Flood the exterior from the grid boundary, anything not reached is
+     * solid. Works for any closed shell, takes a few passes. */
+    OPENCL_PLUGIN_SOLID_FILL_FLOOD
+};
+
+/* Device selection and setup for opencl_plugin_create_ex(), start from
+ * opencl_plugin_config_init() */
+typedef struct _opencl_plugin_config {
+    /* Substring of the platform / device name to match, NULL or empty to
+     * match any */
+    const char *platform_filter;
+    const char *device_filter;
+    /* CL_DEVICE_TYPE_* bits a device must have one of */
+    cl_ulong   device_types;
+    /* Devices with one of these types rank above all others */
+    cl_ulong   preferred_device_types;
+    /* Non-zero to pick the best ranked matching device (compute units x
+     * clock, then global memory), otherwise the first match */
+    cl_int     auto_select;
+    /* Number of queues voxelize kernels are spread over */
+    cl_int     num_queues;
+    /* Passed on when building the programs, may be NULL */
+    const char *build_options;
+    /* Non-zero to collect device timings, see opencl_plugin_get_stats() */
+    cl_int     profiling;
+    /* One of enum opencl_plugin_cpu_mode */
+    cl_int     cpu_mode;
+} opencl_plugin_config;
+
+typedef struct _mesh_data {
+    float  *vertices;
+    cl_int num_vertices;
+    cl_int *triangles;
+    cl_int num_triangles;
+    cl_int triangle_buffer_base_idx;
+    cl_int vertex_buffer_base_idx;
+    cl_int part_idx;
+    /* Box containing all vertices, only used if enabled with
+     * opencl_plugin_set_mesh_bounds(). Set min > max if unknown. */
+    float  bounds_min_x, bounds_min_y, bounds_min_z;
+    float  bounds_max_x, bounds_max_y, bounds_max_z;
+} mesh_data;
+
+typedef void (*job_completion_handler)(cl_int, void *);
+
+typedef void (*voxel_slab_handler)(cl_long, cl_long, const cl_uchar *, void *);
+
+OPENCL_EXPERIMENTS_EXPORT
+void init_debug_print_handler(debug_print_handler func);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_log_level(cl_int level);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_telemetry(cl_int enable);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_drain_telemetry(opencl_plugin_telemetry_event *events_out,
+                                     cl_int max_events,
+                                     cl_long *dropped_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create(opencl_plugin *plugin_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_config_init(opencl_plugin_config *config);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create_ex(const opencl_plugin_config *config,
+                               opencl_plugin *plugin_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create_worker(opencl_plugin plugin,
+                                   cl_int num_queues,
+                                   opencl_plugin *worker_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes(opencl_plugin plugin,
+                                     float inv_element_size,
+                                     float corner_x,
+                                     float corner_y,
+                                     float corner_z,
+                                     cl_int x_cell_length,
+                                     cl_int y_cell_length,
+                                     cl_int z_cell_length,
+                                     cl_int mesh_data_count,
+                                     mesh_data *mesh_data_list,
+                                     cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_async(opencl_plugin plugin,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_int x_cell_length,
+                                           cl_int y_cell_length,
+                                           cl_int z_cell_length,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           cl_uchar *voxel_grid_out,
+                                           opencl_plugin_job *job_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_region(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int region_x,
+                                            cl_int region_y,
+                                            cl_int region_z,
+                                            cl_int region_x_length,
+                                            cl_int region_y_length,
+                                            cl_int region_z_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uchar *voxel_region_out,
+                                            cl_int row_pitch,
+                                            cl_int slice_pitch);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_labels(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_int label_bits,
+                                            cl_int rule,
+                                            void *labels_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_lod(opencl_plugin plugin,
+                                         float inv_element_size,
+                                         float corner_x,
+                                         float corner_y,
+                                         float corner_z,
+                                         cl_int x_cell_length,
+                                         cl_int y_cell_length,
+                                         cl_int z_cell_length,
+                                         cl_int mesh_data_count,
+                                         mesh_data *mesh_data_list,
+                                         cl_int num_levels,
+                                         cl_int op,
+                                         cl_uchar **levels_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_packed(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uint *voxel_bits_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_packed_async(opencl_plugin plugin,
+                                                  float inv_element_size,
+                                                  float corner_x,
+                                                  float corner_y,
+                                                  float corner_z,
+                                                  cl_int x_cell_length,
+                                                  cl_int y_cell_length,
+                                                  cl_int z_cell_length,
+                                                  cl_int mesh_data_count,
+                                                  mesh_data *mesh_data_list,
+                                                  cl_uint *voxel_bits_out,
+                                                  opencl_plugin_job *job_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_sparse(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_int max_bricks,
+                                            cl_int *brick_coords_out,
+                                            cl_uchar *brick_data_out,
+                                            cl_int *num_bricks_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes64(opencl_plugin plugin,
+                                       float inv_element_size,
+                                       float corner_x,
+                                       float corner_y,
+                                       float corner_z,
+                                       cl_long x_cell_length,
+                                       cl_long y_cell_length,
+                                       cl_long z_cell_length,
+                                       cl_int mesh_data_count,
+                                       mesh_data *mesh_data_list,
+                                       cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes64_async(opencl_plugin plugin,
+                                             float inv_element_size,
+                                             float corner_x,
+                                             float corner_y,
+                                             float corner_z,
+                                             cl_long x_cell_length,
+                                             cl_long y_cell_length,
+                                             cl_long z_cell_length,
+                                             cl_int mesh_data_count,
+                                             mesh_data *mesh_data_list,
+                                             cl_uchar *voxel_grid_out,
+                                             opencl_plugin_job *job_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_unpack_bits(const cl_uint *voxel_bits,
+                               cl_int num_voxels,
+                               cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_mesh_register(opencl_plugin plugin,
+                                   const mesh_data *data,
+                                   opencl_plugin_mesh *mesh_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_mesh_update(opencl_plugin_mesh mesh, const mesh_data *data);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_mesh_release(opencl_plugin_mesh mesh);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_registered_meshes(opencl_plugin plugin,
+                                                float inv_element_size,
+                                                float corner_x,
+                                                float corner_y,
+                                                float corner_z,
+                                                cl_int x_cell_length,
+                                                cl_int y_cell_length,
+                                                cl_int z_cell_length,
+                                                cl_int mesh_count,
+                                                opencl_plugin_mesh *meshes,
+                                                cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_registered_meshes_async(opencl_plugin plugin,
+                                                      float inv_element_size,
+                                                      float corner_x,
+                                                      float corner_y,
+                                                      float corner_z,
+                                                      cl_int x_cell_length,
+                                                      cl_int y_cell_length,
+                                                      cl_int z_cell_length,
+                                                      cl_int mesh_count,
+                                                      opencl_plugin_mesh *meshes,
+                                                      cl_uchar *voxel_grid_out,
+                                                      opencl_plugin_job *job_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_mesh_instances(opencl_plugin plugin,
+                                             float inv_element_size,
+                                             float corner_x,
+                                             float corner_y,
+                                             float corner_z,
+                                             cl_int x_cell_length,
+                                             cl_int y_cell_length,
+                                             cl_int z_cell_length,
+                                             cl_int mesh_count,
+                                             opencl_plugin_mesh *meshes,
+                                             const cl_int *instance_counts,
+                                             const float *transforms,
+                                             cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_poll(opencl_plugin_job job);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_wait(opencl_plugin_job job);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_set_callback(opencl_plugin_job job,
+                                      job_completion_handler func,
+                                      void *user_data);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_job_release(opencl_plugin_job job);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_map_staging(opencl_plugin plugin,
+                                 cl_long size,
+                                 opencl_plugin_staging *staging_out,
+                                 void **ptr_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_unmap_staging(opencl_plugin_staging staging);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_tiled(opencl_plugin plugin,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_long x_cell_length,
+                                           cl_long y_cell_length,
+                                           cl_long z_cell_length,
+                                           cl_long slab_depth,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           voxel_slab_handler func,
+                                           void *user_data);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_get_stats(opencl_plugin plugin,
+                               opencl_plugin_stats *stats_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_binning(opencl_plugin plugin,
+                               cl_int enable,
+                               float large_triangle_extent);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_batching(opencl_plugin plugin, cl_int enable);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_zero_copy(opencl_plugin plugin, cl_int enable);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_autotune(opencl_plugin plugin, cl_int enable);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_mesh_bounds(opencl_plugin plugin, cl_int enable);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_mesh_compression(opencl_plugin plugin,
+                                          cl_int vertex_format,
+                                          cl_int short_indices);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_solid_fill(opencl_plugin plugin,
+                                    cl_int fill,
+                                    cl_int axis);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_voxelize_mode(opencl_plugin plugin, cl_int mode);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_pool_high_water(opencl_plugin plugin, cl_long bytes);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_trim(opencl_plugin plugin);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_destroy(opencl_plugin plugin);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_multi_destroy(opencl_plugin_multi multi);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_create(const opencl_plugin_config *config,
+                                  const cl_int *device_indices,
+                                  cl_int num_device_indices,
+                                  opencl_plugin_multi *multi_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_get_device_count(opencl_plugin_multi multi);
+
+OPENCL_EXPERIMENTS_EXPORT
+opencl_plugin opencl_plugin_multi_get_plugin(opencl_plugin_multi multi,
+                                             cl_int device_idx);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_voxelize_meshes(opencl_plugin_multi multi,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_int x_cell_length,
+                                           cl_int y_cell_length,
+                                           cl_int z_cell_length,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           cl_uchar *voxel_grid_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_create(opencl_plugin plugin,
+                                   cl_int depth,
+                                   opencl_plugin_stream *stream_out);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_voxelize_meshes(opencl_plugin_stream stream,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uchar *voxel_grid_out,
+                                            job_completion_handler func,
+                                            void *user_data);
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_finish(opencl_plugin_stream stream);
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_stream_destroy(opencl_plugin_stream stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OPENCL_PLUGIN_H */
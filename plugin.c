@@ -9,6 +9,7 @@
 #define DEBUG 1
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -16,26 +17,42 @@
 #include <string.h>
 #include <time.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include <CL/cl.h>
 
 #include <opencl_experiments_export.h>
 
-enum logging_msg_type {
-    LOGGING_MSG_TRACE,
-    LOGGING_MSG_WARNING,
-    LOGGING_MSG_ERROR
-};
-
-typedef void (*debug_print_handler)(const char *, cl_int, cl_int, const char *);
+#include "cpu_voxelizer.h"
+#include "opencl_plugin.h"
 
 debug_print_handler g_debug_print_handler = NULL;
+/* Messages below this level aren't even formatted */
+static volatile cl_int g_log_level = LOGGING_MSG_TRACE;
 
+#define LOG_ENABLED(msg_type) \
+    (g_debug_print_handler && (msg_type) >= g_log_level)
+
+/* Set this before creating any plugins. func may be called from several
+ * threads at once if jobs run on workers, see opencl_plugin_create_worker(). */
 OPENCL_EXPERIMENTS_EXPORT
 void init_debug_print_handler(debug_print_handler func)
 {
     g_debug_print_handler = func;
 }
 
+/* Only pass messages of at least level (one of enum logging_msg_type) to
+ * the handler, LOGGING_MSG_NONE for none at all. Lower levels cost a
+ * single comparison. May be changed at any time, defaults to
+ * LOGGING_MSG_TRACE. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_log_level(cl_int level)
+{
+    g_log_level = level;
+}
+
 #define CL_ERROR_CASE(err) case err: return #err
 
 static const char *get_cl_error_string(cl_int err)
@@ -125,6 +142,9 @@ static void debug_printf(const char *fmt,
     size_t len;
     va_list ap;
 
+    if (!LOG_ENABLED(msg_type))
+        return;
+
     va_start (ap, msg_type);
     len = vsnprintf(buf, 4096, fmt, ap);
     va_end(ap);
@@ -174,56 +194,313 @@ static void debug_printf(const char *fmt,
         }                                                               \
     } while(0)
 
+/* The level is checked before the arguments are evaluated */
 #define TRACE(fmt, ...)                                                 \
     do {                                                                \
-        debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_TRACE,        \
-                     __VA_ARGS__);                                      \
+        if (LOG_ENABLED(LOGGING_MSG_TRACE))                             \
+            debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_TRACE,    \
+                         __VA_ARGS__);                                  \
     } while(0)
 
 #define WARNING(fmt, ...)                                               \
     do {                                                                \
-        debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_WARNING,      \
-                     __VA_ARGS__);                                      \
+        if (LOG_ENABLED(LOGGING_MSG_WARNING))                           \
+            debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_WARNING,  \
+                         __VA_ARGS__);                                  \
     } while(0)
 
 #define ERROR(fmt, ...)                                                 \
     do {                                                                \
-        debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_ERROR,        \
-                     __VA_ARGS__);                                      \
+        if (LOG_ENABLED(LOGGING_MSG_ERROR))                             \
+            debug_printf(fmt, __FILE__, __LINE__, LOGGING_MSG_ERROR,    \
+                         __VA_ARGS__);                                  \
     } while(0)
 
-typedef struct _opencl_plugin {
+/* A device buffer that is only ever grown, see device_buffer_reserve() */
+typedef struct _device_buffer {
+    cl_mem mem;
+    size_t capacity;
+    /* Bytes outside [dirty_begin, dirty_end) are zero, only kept up to date
+     * for voxel grids, see opencl_plugin_enqueue_clear_grid() */
+    size_t dirty_begin, dirty_end;
+} device_buffer;
+
+/* Bookkeeping shared by all of the plugin's device_buffers */
+typedef struct _device_memory_pool {
+    /* Total bytes currently allocated */
+    size_t allocated;
+    /* Geometric growth never takes the total past this, although a single
+     * request that needs more than this is still honoured exactly */
+    size_t high_water_cap;
+} device_memory_pool;
+
+/* Phases device time is accounted to, see opencl_plugin_get_stats() */
+enum profile_phase {
+    PROFILE_FILL,
+    PROFILE_UPLOAD,
+    PROFILE_KERNEL,
+    PROFILE_READBACK,
+    NUM_PROFILE_PHASES
+};
+
+/* A profiled command of the current job */
+typedef struct _profile_record {
+    enum profile_phase phase;
+    /* NULL if the command couldn't be enqueued */
+    cl_event           event;
+    cl_ulong           bytes;
+} profile_record;
+
+/* Triangle count buckets the autotuner picks a local size for, see
+ * tune_bucket() */
+#define NUM_TUNE_BUCKETS 4
+
+struct _opencl_plugin {
+    /* Set if there is no OpenCL device and jobs run on the CPU instead,
+     * none of the OpenCL objects below exist then */
+    cpu_voxelizer    cpu;
+    /* Set for workers, see opencl_plugin_create_worker() */
+    opencl_plugin    parent;
+
     cl_platform_id   selected_platform;
     cl_device_id     selected_device;
+    cl_ulong         max_mem_alloc_size;
+    /* Wrap caller memory rather than copying it on devices that share
+     * memory with the host, see opencl_plugin_set_zero_copy() */
+    cl_bool          host_unified_memory;
+    size_t           host_ptr_alignment;
+    cl_int           zero_copy;
     cl_context       context;
     cl_command_queue queue;
+    /* Device to host transfers that should overlap with work on queue */
+    cl_command_queue readback_queue;
     cl_int           num_queues;
     cl_command_queue *queues;
     cl_program       program;
+    cl_ulong         program_key;
     cl_kernel        voxelize_kernel;
+    /* Kept to build further programs with, may be NULL */
+    char             *build_options;
+
+    /* Specialised voxelize kernel from voxelize_modes.cl, built for
+     * voxelize_mode, see opencl_plugin_set_voxelize_mode(). NULL for the
+     * default mode, which uses voxelize_kernel. */
+    cl_int           voxelize_mode;
+    cl_program       mode_program;
+    cl_ulong         mode_program_key;
+    cl_kernel        mode_voxelize_kernel;
+    /* OPENCL_PLUGIN_VOXELIZE_SOLID only, run after the voxelize kernels */
+    cl_kernel        fill_parity_kernel;
+
+    /* Auxiliary grid kernels from grid_ops.cl, optional: features that need
+     * them fail if it couldn't be built */
+    cl_program       grid_ops_program;
+    cl_kernel        pack_bits_kernel;
+    cl_kernel        compact_bricks_kernel;
+    cl_kernel        bin_triangles_kernel;
+    cl_kernel        batch_triangles_kernel;
+    cl_kernel        mark_crossings_kernel;
+    cl_kernel        fill_shell_parity_kernel;
+    cl_kernel        flood_exterior_kernel;
+    cl_kernel        finish_flood_fill_kernel;
+    cl_kernel        transform_vertices_kernel;
+    cl_kernel        decode_vertices_kernel;
+    cl_kernel        widen_indices_kernel;
+    cl_kernel        voxelize_labels_kernel;
+    cl_kernel        finish_labels_kernel;
+    cl_kernel        reduce_grid_kernel;
+
+    /* Cull triangles outside the grid and voxelize large ones separately,
+     * see opencl_plugin_set_binning() */
+    cl_int           binning_enabled;
+    float            large_triangle_extent;
+    /* Voxelize all meshes of a job in one launch, see
+     * opencl_plugin_set_batching() */
+    cl_int           batching_enabled;
+    /* Local sizes of the current voxelize kernel per triangle count bucket,
+     * valid once tuned is set, see opencl_plugin_set_autotune() */
+    cl_int           autotune;
+    cl_int           tuned;
+    size_t           tuned_local_sizes[NUM_TUNE_BUCKETS];
+
+    /* Compact mesh uploads, see opencl_plugin_set_mesh_compression() */
+    cl_int           vertex_format;
+    cl_int           short_indices;
+
+    /* Whether mesh_data bounds are trusted, see
+     * opencl_plugin_set_mesh_bounds() */
+    cl_int           mesh_bounds;
+
+    /* Fill closed surfaces before readback, see
+     * opencl_plugin_set_solid_fill() */
+    cl_int           solid_fill;
+    cl_int           solid_fill_axis;
+
+    /* Mostly using cl_int as opposed to size_t in the API, as interop with
+     * .NET means we're limited to Int32 for indexing. Buffer capacities
+     * are in bytes though. */
+    device_memory_pool pool;
+    device_buffer    voxel_grid_buffer;
+    /* Second grid so tiled jobs can compute one slab while reading back the
+     * previous one */
+    device_buffer    tile_grid_buffer;
+    device_buffer    vertex_buffer;
+    device_buffer    triangle_buffer;
+    device_buffer    packed_grid_buffer;
+    device_buffer    brick_count_buffer;
+    device_buffer    brick_coords_buffer;
+    device_buffer    brick_data_buffer;
+    device_buffer    bin_count_buffer;
+    device_buffer    small_triangle_buffer;
+    device_buffer    large_triangle_buffer;
+    device_buffer    mesh_table_buffer;
+    device_buffer    batched_triangle_buffer;
+    device_buffer    flood_changed_buffer;
+    /* Line crossings of the parity fill, see opencl_plugin_set_solid_fill() */
+    device_buffer    crossings_buffer;
+    /* Per job transforms and transformed vertices of instanced meshes, see
+     * opencl_plugin_voxelize_mesh_instances() */
+    device_buffer    instance_transform_buffer;
+    device_buffer    instance_vertex_buffer;
+    /* Compact meshes as uploaded, decoded into vertex_buffer and
+     * triangle_buffer */
+    device_buffer    compact_mesh_buffer;
+    /* Label jobs, see opencl_plugin_voxelize_meshes_labels() */
+    device_buffer    label_key_buffer;
+    device_buffer    label_buffer;
+    /* Coarser levels of LOD jobs, alternately, see
+     * opencl_plugin_voxelize_meshes_lod() */
+    device_buffer    lod_buffers[2];
+
+    /* All registered meshes, see opencl_plugin_mesh_register() */
+    struct _opencl_plugin_mesh *meshes;
+    /* All mapped staging buffers, see opencl_plugin_map_staging() */
+    struct _opencl_plugin_staging *staging;
+
+    /* Queues were created with CL_QUEUE_PROFILING_ENABLE, the commands of
+     * the most recent job are recorded for opencl_plugin_get_stats() */
+    cl_int           profiling;
+    profile_record   *profile_records;
+    cl_int           num_profile_records;
+    cl_int           profile_records_capacity;
+    /* Records before this one have been handed to the telemetry ring */
+    cl_int           num_watched_profile_records;
+    cl_ulong         profile_num_triangles;
+};
+
+struct _opencl_plugin_job {
+    opencl_plugin plugin;
+    /* Readback into the caller's grid, completes last */
+    cl_event      done_event;
+};
+
+/* A mesh kept resident on the device between voxelizations */
+struct _opencl_plugin_mesh {
+    opencl_plugin plugin;
+    struct _opencl_plugin_mesh *prev, *next;
+    /* Pointers are caller owned, only used for the next upload */
+    mesh_data     data;
+    device_buffer vertex_buffer;
+    device_buffer triangle_buffer;
+    /* Bumped on every update, the mesh is dirty until uploaded_generation
+     * catches up */
+    cl_uint       generation;
+    cl_uint       uploaded_generation;
+};
+
+/* Persistently mapped pinned host memory, see opencl_plugin_map_staging() */
+struct _opencl_plugin_staging {
+    opencl_plugin plugin;
+    struct _opencl_plugin_staging *prev, *next;
+    cl_mem        buffer;
+    void          *ptr;
+};
+
+/* A set of plugins, one per device, sharing jobs between them, see
+ * opencl_plugin_multi_create() */
+struct _opencl_plugin_multi {
+    cl_int        num_plugins;
+    opencl_plugin *plugins;
+    /* Relative throughput of each device, sizes its share of a job */
+    cl_ulong      *weights;
+};
+
+/* A ring of workers that jobs are submitted to in turn, so consecutive jobs
+ * overlap, see opencl_plugin_stream_create() */
+struct _opencl_plugin_stream {
+    cl_int            depth;
+    opencl_plugin     *workers;
+    /* The job last submitted to each worker, NULL once it is done */
+    opencl_plugin_job *jobs;
+    cl_int            next;
+};
+
+/* Parameters describing the voxel grid of a single job */
+typedef struct _voxel_grid_params {
+    float  inv_element_size;
+    float  corner_x, corner_y, corner_z;
+    cl_int x_cell_length, y_cell_length, z_cell_length;
+} voxel_grid_params;
+
+enum voxel_output_format {
+    /* One cl_uchar per voxel, as produced by the voxelize kernel */
+    VOXEL_OUTPUT_DENSE,
+    /* One bit per voxel, 32 per cl_uint, lowest voxel index in the LSB */
+    VOXEL_OUTPUT_PACKED,
+    /* Occupied BRICK_SIZE^3 bricks only, compacted on the device. Only the
+     * brick count is read back by the job itself, see
+     * opencl_plugin_voxelize_meshes_sparse(). */
+    VOXEL_OUTPUT_SPARSE,
+    /* Nothing read back, the grid is left in plugin->voxel_grid_buffer for
+     * further device side processing */
+    VOXEL_OUTPUT_NONE
+};
 
-    cl_mem           voxel_grid_buffer;
-    /* Mostly using cl_int as opposed to size_t, as interop with .NET
-     * means we're limited to Int32 for indexing */
-    cl_int           voxel_grid_buffer_capacity;
-
-    cl_mem           vertex_buffer;
-    cl_mem           triangle_buffer;
-    cl_int           vertex_buffer_capacity;
-    cl_int           triangle_buffer_capacity;
-} *opencl_plugin;
-
-typedef struct _mesh_data {
-    float  *vertices;
-    cl_int num_vertices;
-    cl_int *triangles;
-    cl_int num_triangles;
-    cl_int triangle_buffer_base_idx;
-    cl_int vertex_buffer_base_idx;
-    cl_int part_idx;
-    float  bounds_min_x, bounds_min_y, bounds_min_z;
-    float  bounds_max_x, bounds_max_y, bounds_max_z;
-} mesh_data;
+/* Where and in what form a job's result goes */
+typedef struct _voxel_output {
+    enum voxel_output_format format;
+    /* The grid, or the brick count for VOXEL_OUTPUT_SPARSE */
+    void                     *dst;
+    /* VOXEL_OUTPUT_SPARSE only, capacity of the brick buffers */
+    cl_int                   max_bricks;
+    /* VOXEL_OUTPUT_DENSE only, pitches of dst in bytes if it isn't tightly
+     * packed (0 if it is), see opencl_plugin_voxelize_meshes_region() */
+    size_t                   row_pitch, slice_pitch;
+} voxel_output;
+
+/* Must match BRICK_SIZE in grid_ops.cl */
+#define BRICK_SIZE 8
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+/* Arguments for a single voxelize kernel launch */
+typedef struct _mesh_launch {
+    cl_mem  vertex_buffer;
+    cl_mem  triangle_buffer;
+    cl_int  num_triangles;
+    cl_uint vertex_buffer_base_idx;
+    cl_uint triangle_buffer_base_idx;
+    /* 0 for the tuned size for num_triangles if the plugin is tuned,
+     * otherwise the kernel's maximum work-group size */
+    size_t  local_work_size;
+    /* voxelize_labels only, see opencl_plugin_enqueue_voxelize_labels() */
+    cl_uint label_key;
+} mesh_launch;
+
+static void init_mesh_launch(mesh_launch *launch,
+                             cl_mem vertex_buffer,
+                             cl_mem triangle_buffer,
+                             cl_int num_triangles,
+                             cl_uint vertex_buffer_base_idx,
+                             cl_uint triangle_buffer_base_idx)
+{
+    launch->vertex_buffer = vertex_buffer;
+    launch->triangle_buffer = triangle_buffer;
+    launch->num_triangles = num_triangles;
+    launch->vertex_buffer_base_idx = vertex_buffer_base_idx;
+    launch->triangle_buffer_base_idx = triangle_buffer_base_idx;
+    launch->local_work_size = 0;
+    launch->label_key = 0;
+}
 
 static int get_desired_platform(const char *substr,
                                 cl_platform_id *platform_id_out,
@@ -262,8 +539,7 @@ static int get_desired_platform(const char *substr,
                                  platform_name_size, platform_name, NULL);
         CHECK_CL_ERROR(*err);
 
-        if (DEBUG)
-            printf("Platform %u: \"%s\"\n", i, platform_name);
+        TRACE("Platform %u: \"%s\"", i, platform_name);
 
         if (strstr(platform_name, substr))
             break;
@@ -294,7 +570,7 @@ static int get_gpu_device_id(cl_platform_id platform_id,
 
     if (!err) err = &_err;
 
-    /* TODO: multi-gpu / multi-device? */
+    /* For more than one device see find_devices() */
     *err = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, 1, device_out,
                           NULL);
     if (*err == CL_DEVICE_NOT_FOUND && !fallback) {
@@ -339,312 +615,4070 @@ error:
     return -1;
 }
 
-static int build_program_from_file(const char *filename,
-                                   const char *options,
-                                   cl_context context,
-                                   cl_device_id device,
-                                   cl_program *program_out,
-                                   cl_int *err)
+static int get_device_info_string(cl_device_id device,
+                                  cl_device_info param_name,
+                                  char **str_out,
+                                  cl_int *err)
 {
-    cl_int _err;
-    FILE *file;
-    char *program_source = NULL;
-    size_t program_source_size;
-    cl_program program = NULL;
-    char *build_log = NULL;
+    cl_int _err = CL_SUCCESS;
+    size_t str_size;
+    char *str = NULL;
 
-    assert(filename != NULL);
-    assert(program_out != NULL);
+    assert(str_out != NULL);
 
     if (!err) err = &_err;
 
-    file = fopen(filename, "r");
-    if (!file) {
-        ERROR("Couldn't open file \"%s\"", filename);
-        goto error;
-    }
-
-    if (fseek(file, 0L, SEEK_END)) {
-        ERROR("Cannot determine file size of \"%s\"", filename);
-        goto error;
-    }
-    program_source_size = ftell(file);
-    if (fseek(file, 0L, SEEK_SET)) {
-        ERROR("Cannot determine file size of \"%s\"", filename);
-        goto error;
-    }
-
-    program_source = malloc(sizeof(*program_source) * (program_source_size + 1));
-    CHECK_ALLOCATION(program_source);
-
-    if (fread(program_source, 1, program_source_size, file) != program_source_size) {
-        ERROR("Failed to read file \"%s\"", filename);
-        goto error;
-    }
-    program_source[program_source_size] = '\0';
-
-    fclose(file);
-
-    program = clCreateProgramWithSource(context, 1, (const char **)&program_source, NULL, err);
+    *err = clGetDeviceInfo(device, param_name, 0, NULL, &str_size);
     CHECK_CL_ERROR(*err);
 
-    *err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
-    if (*err == CL_BUILD_PROGRAM_FAILURE) {
-        size_t build_log_size;
-
-        *err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_size);
-        CHECK_CL_ERROR(*err);
-
-        build_log = malloc(sizeof(*build_log) * build_log_size);
-        CHECK_ALLOCATION(build_log);
-
-        *err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
-        CHECK_CL_ERROR(*err);
-
-        if (options)
-            ERROR("Failed to build program in file \"%s\" with options \"%s\"", filename, options);
-        else
-            ERROR("Failed to build program in file \"%s\"", filename);
+    str = malloc(sizeof(*str) * str_size);
+    CHECK_ALLOCATION(str);
 
-        debug_printf("================================== BUILD LOG ===================================\n"
-                     "%s", NULL, 0, LOGGING_MSG_ERROR, build_log);
-        goto error;
-    }
+    *err = clGetDeviceInfo(device, param_name, str_size, str, NULL);
     CHECK_CL_ERROR(*err);
 
-    *program_out = program;
+    *str_out = str;
     return 0;
 error:
-    free(build_log);
-    if (program)
-        clReleaseProgram(program);
-    *program_out = NULL;
-    free(program_source);
+    free(str);
+    *str_out = NULL;
     return -1;
 }
 
-static int enqueue_zero_buffer(cl_command_queue queue,
-                               cl_mem buffer,
-                               size_t size,
-                               cl_uint num_events_in_wait_list,
-                               const cl_event *event_wait_list,
-                               cl_event *event,
-                               cl_int *err)
+/* Ranking used by find_devices() */
+typedef struct _device_rank {
+    cl_int   preferred;
+    cl_ulong throughput;
+    cl_ulong global_mem_size;
+} device_rank;
+
+static int get_device_rank(cl_device_id device,
+                           cl_ulong preferred_device_types,
+                           device_rank *rank,
+                           cl_int *err)
 {
-    cl_int _err;
-    cl_uchar c = 0;
-
-    if (!err) err = &_err;
+    cl_device_type type;
+    cl_uint compute_units, clock_frequency;
 
-    *err = clEnqueueFillBuffer(queue, (cl_mem)buffer, &c, sizeof(c), 0,
-                               size, num_events_in_wait_list, event_wait_list,
-                               event);
+    *err = clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    CHECK_CL_ERROR(*err);
+    *err = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                           sizeof(compute_units), &compute_units, NULL);
+    CHECK_CL_ERROR(*err);
+    *err = clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY,
+                           sizeof(clock_frequency), &clock_frequency, NULL);
+    CHECK_CL_ERROR(*err);
+    *err = clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE,
+                           sizeof(rank->global_mem_size),
+                           &rank->global_mem_size, NULL);
     CHECK_CL_ERROR(*err);
 
+    rank->preferred = (type & preferred_device_types) != 0;
+    rank->throughput = (cl_ulong)compute_units * clock_frequency;
+
     return 0;
 error:
     return -1;
 }
 
-OPENCL_EXPERIMENTS_EXPORT
-cl_int opencl_plugin_create(opencl_plugin *plugin_out)
+static int device_rank_better(const device_rank *a, const device_rank *b)
 {
-    cl_int err = CL_SUCCESS;
-    opencl_plugin plugin;
-    cl_int i;
-    cl_int num_queues = 50;
+    if (a->preferred != b->preferred)
+        return a->preferred > b->preferred;
+    if (a->throughput != b->throughput)
+        return a->throughput > b->throughput;
+    return a->global_mem_size > b->global_mem_size;
+}
 
-    assert(plugin_out != NULL);
+/* A device matching a plugin config, see find_devices() */
+typedef struct _device_candidate {
+    cl_platform_id platform;
+    cl_device_id   device;
+    device_rank    rank;
+} device_candidate;
+
+/* Find all devices described by config across all platforms, best ranked
+ * first if config->auto_select, otherwise in platform / device order */
+static int find_devices(const opencl_plugin_config *config,
+                        device_candidate **candidates_out,
+                        cl_uint *num_candidates_out,
+                        cl_int *err)
+{
+    cl_int _err = CL_SUCCESS;
+    cl_uint i, j, k, num_platforms, num_devices;
+    cl_platform_id *platform_ids = NULL;
+    cl_device_id *device_ids = NULL;
+    char *platform_name = NULL;
+    char *device_name = NULL;
+    device_candidate *candidates = NULL, *new_candidates;
+    cl_uint num_candidates = 0;
+    device_rank rank;
 
-    plugin = calloc(1, sizeof(*plugin));
-    CHECK_ALLOCATION(plugin);
+    assert(config != NULL);
+    assert(candidates_out != NULL);
+    assert(num_candidates_out != NULL);
 
-    if (get_desired_platform("NVIDIA", &plugin->selected_platform, &err))
-        goto error;
+    if (!err) err = &_err;
 
-    if (get_gpu_device_id(plugin->selected_platform, &plugin->selected_device,
-                          CL_TRUE, &err))
-        goto error;
+    *err = clGetPlatformIDs(0, NULL, &num_platforms);
+    CHECK_CL_ERROR(*err);
 
-    if (create_context(plugin->selected_platform, plugin->selected_device,
-                       &plugin->context, &err))
-        goto error;
+    platform_ids = malloc(sizeof(*platform_ids) * (num_platforms > 0 ? num_platforms : 1));
+    CHECK_ALLOCATION(platform_ids);
 
-    if (build_program_from_file("program.cl", NULL, plugin->context,
-                                plugin->selected_device, &plugin->program, &err))
-        goto error;
+    *err = clGetPlatformIDs(num_platforms, platform_ids, NULL);
+    CHECK_CL_ERROR(*err);
 
-    plugin->queue = clCreateCommandQueue(plugin->context, plugin->selected_device, 0, &err);
-    CHECK_CL_ERROR(err);
+    for (i = 0; i < num_platforms; i++) {
+        size_t platform_name_size;
 
-    plugin->num_queues = num_queues;
-    plugin->queues = calloc(num_queues, sizeof(cl_command_queue));
-    CHECK_ALLOCATION(plugin->queues);
+        *err = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME, 0, NULL,
+                                 &platform_name_size);
+        CHECK_CL_ERROR(*err);
 
-    for (i = 0; i < num_queues; i++) {
-        plugin->queues[i] = clCreateCommandQueue(plugin->context, plugin->selected_device, 0, &err);
-        CHECK_CL_ERROR(err);
-    }
+        platform_name = realloc(platform_name,
+                                sizeof(*platform_name) * platform_name_size);
+        CHECK_ALLOCATION(platform_name);
 
-    plugin->voxelize_kernel = clCreateKernel(plugin->program, "voxelize", &err);
-    CHECK_CL_ERROR(err);
+        *err = clGetPlatformInfo(platform_ids[i], CL_PLATFORM_NAME,
+                                 platform_name_size, platform_name, NULL);
+        CHECK_CL_ERROR(*err);
 
-    *plugin_out = plugin;
-    return 0;
-error:
-    if (plugin) {
-        if (plugin->voxelize_kernel)
-            clReleaseKernel(plugin->voxelize_kernel);
-        if (plugin->queue)
-            clReleaseCommandQueue(plugin->queue);
-        if (plugin->queues) {
-            for (i = 0; i < num_queues; i++) {
-                if (plugin->queues[i])
-                    clReleaseCommandQueue(plugin->queues[i]);
+        if (config->platform_filter &&
+            !strstr(platform_name, config->platform_filter))
+            continue;
+
+        *err = clGetDeviceIDs(platform_ids[i], (cl_device_type)config->device_types,
+                              0, NULL, &num_devices);
+        if (*err == CL_DEVICE_NOT_FOUND)
+            continue;
+        CHECK_CL_ERROR(*err);
+
+        free(device_ids);
+        device_ids = malloc(sizeof(*device_ids) * (num_devices > 0 ? num_devices : 1));
+        CHECK_ALLOCATION(device_ids);
+
+        *err = clGetDeviceIDs(platform_ids[i], (cl_device_type)config->device_types,
+                              num_devices, device_ids, NULL);
+        CHECK_CL_ERROR(*err);
+
+        new_candidates = realloc(candidates, sizeof(*candidates) *
+                                 (num_candidates + num_devices));
+        CHECK_ALLOCATION(new_candidates);
+        candidates = new_candidates;
+
+        for (j = 0; j < num_devices; j++) {
+            free(device_name);
+            if (get_device_info_string(device_ids[j], CL_DEVICE_NAME,
+                                       &device_name, err))
+                goto error;
+
+            if (config->device_filter &&
+                !strstr(device_name, config->device_filter))
+                continue;
+
+            if (get_device_rank(device_ids[j], config->preferred_device_types,
+                                &rank, err))
+                goto error;
+
+            TRACE("Candidate device \"%s\" on \"%s\": %llu CU x MHz, %llu bytes",
+                  device_name, platform_name,
+                  (unsigned long long)rank.throughput,
+                  (unsigned long long)rank.global_mem_size);
+
+            /* Insert after all candidates ranked at least as well, so ties
+             * keep platform / device order */
+            k = num_candidates;
+            while (config->auto_select && k > 0 &&
+                   device_rank_better(&rank, &candidates[k - 1].rank)) {
+                candidates[k] = candidates[k - 1];
+                k--;
             }
-            free(plugin->queues);
+            candidates[k].platform = platform_ids[i];
+            candidates[k].device = device_ids[j];
+            candidates[k].rank = rank;
+            num_candidates++;
         }
-        if (plugin->context)
-            clReleaseContext(plugin->context);
-        free(plugin);
     }
+
+    if (num_candidates == 0) {
+        ERROR("No device matches the plugin config", 0);
+        goto error;
+    }
+
+    free(device_name);
+    free(device_ids);
+    free(platform_name);
+    free(platform_ids);
+    *candidates_out = candidates;
+    *num_candidates_out = num_candidates;
+    return 0;
+error:
+    free(candidates);
+    free(device_name);
+    free(device_ids);
+    free(platform_name);
+    free(platform_ids);
     return -1;
 }
 
-static cl_int opencl_plugin_init_voxel_buffer(opencl_plugin plugin,
-                                              cl_int num_voxels)
+/* Find the device described by config across all platforms */
+static int select_device(const opencl_plugin_config *config,
+                         cl_platform_id *platform_out,
+                         cl_device_id *device_out,
+                         cl_int *err)
 {
-    cl_int err;
-    cl_mem new_voxel_buffer = NULL;
+    device_candidate *candidates;
+    cl_uint num_candidates;
 
-    assert(plugin != NULL);
-    assert(num_voxels >= 0);
+    assert(platform_out != NULL);
+    assert(device_out != NULL);
 
-    if (num_voxels > plugin->voxel_grid_buffer_capacity) {
-        /* Current buffer not big enough, free old buffer first */
-        if (plugin->voxel_grid_buffer) {
-            clReleaseMemObject(plugin->voxel_grid_buffer);
-            plugin->voxel_grid_buffer = NULL;
-        }
+    if (find_devices(config, &candidates, &num_candidates, err))
+        return -1;
 
-        plugin->voxel_grid_buffer_capacity = 0;
+    *platform_out = candidates[0].platform;
+    *device_out = candidates[0].device;
+    free(candidates);
+    return 0;
+}
 
-        /* TODO: Maybe better dynamic resizing (factor = 1.5)? */
-        new_voxel_buffer =
-            clCreateBuffer(plugin->context, CL_MEM_WRITE_ONLY,
-                           (size_t)num_voxels, NULL, &err);
-        CHECK_CL_ERROR(err);
+/* Copy of src, or NULL if src is NULL */
+static int copy_string(const char *src, char **dst_out)
+{
+    size_t len;
 
-        plugin->voxel_grid_buffer_capacity = num_voxels;
-        plugin->voxel_grid_buffer = new_voxel_buffer;
-        new_voxel_buffer = NULL;
-    }
+    *dst_out = NULL;
+    if (!src)
+        return 0;
+
+    len = strlen(src);
+    *dst_out = malloc(len + 1);
+    CHECK_ALLOCATION(*dst_out);
+    memcpy(*dst_out, src, len + 1);
 
     return 0;
 error:
-    if (new_voxel_buffer)
-        clReleaseMemObject(new_voxel_buffer);
     return -1;
 }
 
-static cl_int opencl_plugin_init_mesh_buffers(opencl_plugin plugin,
-                                              cl_int mesh_data_count,
-                                              mesh_data *mesh_data_list)
+static int read_file(const char *filename,
+                     const char *mode,
+                     char **data_out,
+                     size_t *size_out)
 {
-    cl_int err;
-    cl_int i;
-    cl_mem new_vertex_buffer = NULL, new_triangle_buffer = NULL;
-    cl_int total_num_vertices = 0, total_num_triangles = 0;
-
-    assert(plugin != NULL);
-    assert(mesh_data_count >= 0);
-    assert(mesh_data_list != NULL);
+    FILE *file;
+    char *data = NULL;
+    long size;
 
-    for (i = 0; i < mesh_data_count; i++) {
-        total_num_vertices += mesh_data_list[i].num_vertices;
-        total_num_triangles += mesh_data_list[i].num_triangles;
-    }
+    assert(data_out != NULL);
+    assert(size_out != NULL);
 
-    if (total_num_vertices > plugin->vertex_buffer_capacity) {
-        /* Current buffer not big enough, free old buffer first */
-        if (plugin->vertex_buffer) {
-            clReleaseMemObject(plugin->vertex_buffer);
-            plugin->vertex_buffer = NULL;
-        }
+    file = fopen(filename, mode);
+    if (!file)
+        goto error;
 
-        plugin->vertex_buffer_capacity = 0;
+    if (fseek(file, 0L, SEEK_END)) {
+        ERROR("Cannot determine file size of \"%s\"", filename);
+        goto error;
+    }
+    size = ftell(file);
+    if (size < 0 || fseek(file, 0L, SEEK_SET)) {
+        ERROR("Cannot determine file size of \"%s\"", filename);
+        goto error;
+    }
 
-        /* TODO: Maybe better dynamic resizing (factor = 1.5)? */
-        new_vertex_buffer =
-            clCreateBuffer(plugin->context, CL_MEM_READ_ONLY,
-                           sizeof(float) * 3 * total_num_vertices, NULL, &err);
-        CHECK_CL_ERROR(err);
+    /* NUL terminate so callers can treat the data as a string */
+    data = malloc(sizeof(*data) * ((size_t)size + 1));
+    CHECK_ALLOCATION(data);
 
-        plugin->vertex_buffer_capacity = total_num_vertices;
-        plugin->vertex_buffer = new_vertex_buffer;
-        new_vertex_buffer = NULL;
+    if (fread(data, 1, (size_t)size, file) != (size_t)size) {
+        ERROR("Failed to read file \"%s\"", filename);
+        goto error;
     }
+    data[size] = '\0';
 
-    if (total_num_triangles > plugin->triangle_buffer_capacity) {
-        /* Current buffer not big enough, free old buffer first */
-        if (plugin->triangle_buffer) {
-            clReleaseMemObject(plugin->triangle_buffer);
-            plugin->triangle_buffer = NULL;
-        }
+    fclose(file);
+
+    *data_out = data;
+    *size_out = (size_t)size;
+    return 0;
+error:
+    if (file)
+        fclose(file);
+    free(data);
+    *data_out = NULL;
+    return -1;
+}
 
-        plugin->triangle_buffer_capacity = 0;
+/* 64-bit FNV-1a, used to key the program binary cache */
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
 
-        /* TODO: Maybe better dynamic resizing (factor = 1.5)? */
-        new_triangle_buffer =
-            clCreateBuffer(plugin->context, CL_MEM_READ_ONLY,
-                           sizeof(cl_int) * 3 * total_num_triangles, NULL, &err);
-        CHECK_CL_ERROR(err);
+static cl_ulong fnv1a_64(cl_ulong hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    size_t i;
 
-        plugin->triangle_buffer_capacity = total_num_triangles;
-        plugin->triangle_buffer = new_triangle_buffer;
-        new_triangle_buffer = NULL;
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
     }
 
-    total_num_vertices = 0;
-    total_num_triangles = 0;
-    for (i = 0; i < mesh_data_count; i++) {
-        mesh_data *mesh_data = &mesh_data_list[i];
+    return hash;
+}
 
-        err = clEnqueueWriteBuffer(
-            plugin->queue, plugin->vertex_buffer, CL_FALSE,
-            sizeof(float) * 3 * total_num_vertices,
-            sizeof(float) * 3 * mesh_data->num_vertices, mesh_data->vertices,
-            0, NULL, NULL);
-        CHECK_CL_ERROR(err);
+static cl_ulong fnv1a_64_str(cl_ulong hash, const char *str)
+{
+    /* Hash the terminator too, so ("ab", "c") and ("a", "bc") differ */
+    return fnv1a_64(hash, str, strlen(str) + 1);
+}
 
-        err = clEnqueueWriteBuffer(
-            plugin->queue, plugin->triangle_buffer, CL_FALSE,
-            sizeof(cl_int) * 3 * total_num_triangles,
-            sizeof(cl_int) * 3 * mesh_data->num_triangles, mesh_data->triangles,
-            0, NULL, NULL);
-        CHECK_CL_ERROR(err);
+/*
+ * Program binary cache file layout, all fields in native byte order (the
+ * binaries are device specific anyway):
+ *
+ *   char     magic[8]     "CLBINv1\0"
+ *   cl_ulong key          hash of source, options, device name and driver
+ *   cl_ulong binary_size
+ *   uchar    binary[binary_size]
+ */
+static const char program_cache_magic[8] = "CLBINv1";
+
+typedef struct _program_cache_header {
+    char     magic[8];
+    cl_ulong key;
+    cl_ulong binary_size;
+} program_cache_header;
+
+static int compute_program_cache_key(const char *program_source,
+                                     size_t program_source_size,
+                                     const char *options,
+                                     cl_device_id device,
+                                     cl_ulong *key_out,
+                                     cl_int *err)
+{
+    cl_int _err = CL_SUCCESS;
+    char *device_name = NULL;
+    char *driver_version = NULL;
+    cl_ulong key = FNV1A_64_INIT;
 
-        total_num_vertices += mesh_data_list[i].num_vertices;
-        total_num_triangles += mesh_data_list[i].num_triangles;
-    }
+    assert(key_out != NULL);
 
-    /* Wait for all buffer writes to finish, TODO: investigate this further */
-    err = clFinish(plugin->queue);
-    CHECK_CL_ERROR(err);
+    if (!err) err = &_err;
 
+    if (get_device_info_string(device, CL_DEVICE_NAME, &device_name, err))
+        goto error;
+    if (get_device_info_string(device, CL_DRIVER_VERSION, &driver_version, err))
+        goto error;
+
+    key = fnv1a_64(key, program_source, program_source_size);
+    key = fnv1a_64_str(key, options ? options : "");
+    key = fnv1a_64_str(key, device_name);
+    key = fnv1a_64_str(key, driver_version);
+
+    free(device_name);
+    free(driver_version);
+    *key_out = key;
     return 0;
 error:
-    if (new_vertex_buffer)
-        clReleaseMemObject(new_vertex_buffer);
-    if (new_triangle_buffer)
-        clReleaseMemObject(new_triangle_buffer);
+    free(device_name);
+    free(driver_version);
     return -1;
 }
 
-OPENCL_EXPERIMENTS_EXPORT
-cl_int opencl_plugin_voxelize_meshes(opencl_plugin plugin,
-                                     float inv_element_size,
-                                     float corner_x,
+static void get_program_cache_filename(const char *filename,
+                                       cl_ulong key,
+                                       char *buf,
+                                       size_t buf_size)
+{
+    /* The key is part of the name so that different devices / option sets
+     * sharing the same source file don't keep evicting each other */
+    snprintf(buf, buf_size, "%s.%016llx.bin", filename,
+             (unsigned long long)key);
+}
+
+/* Try to create a program from a previously cached binary, returns non-zero
+ * if there is no usable cache entry (in which case the caller should just
+ * build from source) */
+static int load_cached_program(const char *cache_filename,
+                               cl_ulong key,
+                               const char *options,
+                               cl_context context,
+                               cl_device_id device,
+                               cl_program *program_out)
+{
+    cl_int err, binary_status;
+    char *data = NULL;
+    size_t data_size;
+    program_cache_header header;
+    const unsigned char *binary;
+    size_t binary_size;
+    cl_program program = NULL;
+
+    if (read_file(cache_filename, "rb", &data, &data_size))
+        goto error;
+
+    if (data_size < sizeof(header))
+        goto error;
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, program_cache_magic, sizeof(header.magic)) ||
+        header.key != key ||
+        header.binary_size != data_size - sizeof(header)) {
+        WARNING("Ignoring stale or corrupt program cache \"%s\"",
+                cache_filename);
+        goto error;
+    }
+
+    binary = (const unsigned char *)data + sizeof(header);
+    binary_size = (size_t)header.binary_size;
+
+    program = clCreateProgramWithBinary(context, 1, &device, &binary_size,
+                                        &binary, &binary_status, &err);
+    if (err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+        WARNING("Rejected cached program binary \"%s\" (OpenCL returned %s)",
+                cache_filename,
+                get_cl_error_string(err != CL_SUCCESS ? err : binary_status));
+        goto error;
+    }
+
+    /* Still required for binaries, but is only a "link" step */
+    err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        WARNING("Failed to build cached program binary \"%s\" (OpenCL returned %s)",
+                cache_filename, get_cl_error_string(err));
+        goto error;
+    }
+
+    free(data);
+    *program_out = program;
+    return 0;
+error:
+    if (program)
+        clReleaseProgram(program);
+    free(data);
+    *program_out = NULL;
+    return -1;
+}
+
+/* Failing to write the cache isn't fatal, we'll just rebuild next time */
+static void save_cached_program(const char *cache_filename,
+                                cl_ulong key,
+                                cl_program program,
+                                cl_device_id device)
+{
+    cl_int err;
+    cl_uint i, num_devices = 0;
+    cl_device_id *devices = NULL;
+    size_t *binary_sizes = NULL;
+    unsigned char **binaries = NULL;
+    program_cache_header header;
+    FILE *file = NULL;
+
+    err = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES,
+                           sizeof(num_devices), &num_devices, NULL);
+    CHECK_CL_ERROR(err);
+
+    devices = malloc(sizeof(*devices) * num_devices);
+    CHECK_ALLOCATION(devices);
+    binary_sizes = malloc(sizeof(*binary_sizes) * num_devices);
+    CHECK_ALLOCATION(binary_sizes);
+    binaries = calloc(num_devices, sizeof(*binaries));
+    CHECK_ALLOCATION(binaries);
+
+    err = clGetProgramInfo(program, CL_PROGRAM_DEVICES,
+                           sizeof(*devices) * num_devices, devices, NULL);
+    CHECK_CL_ERROR(err);
+
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                           sizeof(*binary_sizes) * num_devices, binary_sizes,
+                           NULL);
+    CHECK_CL_ERROR(err);
+
+    for (i = 0; i < num_devices; i++) {
+        binaries[i] = malloc(binary_sizes[i]);
+        CHECK_ALLOCATION(binaries[i]);
+    }
+
+    /* CL_PROGRAM_BINARIES always returns binaries for every device */
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                           sizeof(*binaries) * num_devices, binaries, NULL);
+    CHECK_CL_ERROR(err);
+
+    for (i = 0; i < num_devices; i++) {
+        if (devices[i] == device)
+            break;
+    }
+    if (i == num_devices || binary_sizes[i] == 0)
+        goto error;
+
+    memcpy(header.magic, program_cache_magic, sizeof(header.magic));
+    header.key = key;
+    header.binary_size = binary_sizes[i];
+
+    file = fopen(cache_filename, "wb");
+    if (!file) {
+        WARNING("Couldn't open program cache \"%s\" for writing",
+                cache_filename);
+        goto error;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(binaries[i], 1, binary_sizes[i], file) != binary_sizes[i]) {
+        WARNING("Failed to write program cache \"%s\"", cache_filename);
+        fclose(file);
+        file = NULL;
+        /* Don't leave a truncated file lying around */
+        remove(cache_filename);
+        goto error;
+    }
+
+error:
+    if (file)
+        fclose(file);
+    if (binaries) {
+        for (i = 0; i < num_devices; i++)
+            free(binaries[i]);
+    }
+    free(binaries);
+    free(binary_sizes);
+    free(devices);
+}
+
+/* *cache_key_out (if not NULL) is set to the program cache key, which also
+ * identifies the build for the autotuner. prelude_filename (may be NULL) is
+ * the file of helpers shared between programs, prepended to the source. */
+static int build_program_from_file(const char *filename,
+                                   const char *prelude_filename,
+                                   const char *options,
+                                   cl_context context,
+                                   cl_device_id device,
+                                   cl_program *program_out,
+                                   cl_ulong *cache_key_out,
+                                   cl_int *err)
+{
+    cl_int _err;
+    char *program_source = NULL;
+    size_t program_source_size;
+    char *prelude_source = NULL;
+    size_t prelude_source_size;
+    char *source;
+    cl_program program = NULL;
+    char *build_log = NULL;
+    cl_ulong cache_key;
+    char cache_filename[4096];
+
+    assert(filename != NULL);
+    assert(program_out != NULL);
+
+    if (!err) err = &_err;
+
+    if (read_file(filename, "r", &program_source, &program_source_size)) {
+        ERROR("Couldn't open file \"%s\"", filename);
+        goto error;
+    }
+
+    if (prelude_filename) {
+        static const char line_directive[] = "\n#line 1\n";
+
+        if (read_file(prelude_filename, "r", &prelude_source,
+                      &prelude_source_size)) {
+            ERROR("Couldn't open file \"%s\"", prelude_filename);
+            goto error;
+        }
+
+        /* Build log line numbers stay those of filename */
+        source = malloc(prelude_source_size + sizeof(line_directive) - 1 +
+                        program_source_size + 1);
+        CHECK_ALLOCATION(source);
+        memcpy(source, prelude_source, prelude_source_size);
+        memcpy(source + prelude_source_size, line_directive,
+               sizeof(line_directive) - 1);
+        memcpy(source + prelude_source_size + sizeof(line_directive) - 1,
+               program_source, program_source_size);
+        program_source_size += prelude_source_size + sizeof(line_directive) - 1;
+        source[program_source_size] = '\0';
+
+        free(program_source);
+        program_source = source;
+    }
+
+    if (compute_program_cache_key(program_source, program_source_size,
+                                  options, device, &cache_key, err))
+        goto error;
+    get_program_cache_filename(filename, cache_key, cache_filename,
+                               sizeof(cache_filename));
+    if (cache_key_out)
+        *cache_key_out = cache_key;
+
+    if (!load_cached_program(cache_filename, cache_key, options, context,
+                             device, &program)) {
+        TRACE("Loaded program \"%s\" from cache \"%s\"", filename,
+              cache_filename);
+        free(prelude_source);
+        free(program_source);
+        *program_out = program;
+        return 0;
+    }
+
+    program = clCreateProgramWithSource(context, 1, (const char **)&program_source, NULL, err);
+    CHECK_CL_ERROR(*err);
+
+    *err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
+    if (*err == CL_BUILD_PROGRAM_FAILURE) {
+        size_t build_log_size;
+
+        *err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_size);
+        CHECK_CL_ERROR(*err);
+
+        build_log = malloc(sizeof(*build_log) * build_log_size);
+        CHECK_ALLOCATION(build_log);
+
+        *err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
+        CHECK_CL_ERROR(*err);
+
+        if (options)
+            ERROR("Failed to build program in file \"%s\" with options \"%s\"", filename, options);
+        else
+            ERROR("Failed to build program in file \"%s\"", filename);
+
+        debug_printf("================================== BUILD LOG ===================================\n"
+                     "%s", NULL, 0, LOGGING_MSG_ERROR, build_log);
+        goto error;
+    }
+    CHECK_CL_ERROR(*err);
+
+    save_cached_program(cache_filename, cache_key, program, device);
+
+    free(prelude_source);
+    free(program_source);
+    *program_out = program;
+    return 0;
+error:
+    free(build_log);
+    if (program)
+        clReleaseProgram(program);
+    *program_out = NULL;
+    free(prelude_source);
+    free(program_source);
+    return -1;
+}
+
+static int enqueue_zero_buffer(cl_command_queue queue,
+                               cl_mem buffer,
+                               size_t offset,
+                               size_t size,
+                               cl_uint num_events_in_wait_list,
+                               const cl_event *event_wait_list,
+                               cl_event *event,
+                               cl_int *err)
+{
+    cl_int _err;
+    cl_uchar c = 0;
+
+    if (!err) err = &_err;
+
+    *err = clEnqueueFillBuffer(queue, (cl_mem)buffer, &c, sizeof(c), offset,
+                               size, num_events_in_wait_list, event_wait_list,
+                               event);
+    CHECK_CL_ERROR(*err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Non-blocking read from the start of buffer, which unlike
+ * clEnqueueReadBuffer also accepts an empty read (and still produces an
+ * event) */
+static cl_int enqueue_read_buffer(cl_command_queue queue,
+                                  cl_mem buffer,
+                                  size_t size,
+                                  void *ptr,
+                                  cl_event *event)
+{
+    if (size == 0)
+        return clEnqueueMarkerWithWaitList(queue, 0, NULL, event);
+
+    return clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, size, ptr, 0, NULL,
+                               event);
+}
+
+#define DEFAULT_NUM_QUEUES 50
+
+static int opencl_plugin_create_mode_kernels(opencl_plugin plugin,
+                                             cl_int *err)
+{
+    plugin->mode_voxelize_kernel = clCreateKernel(plugin->mode_program,
+                                                  "voxelize", err);
+    CHECK_CL_ERROR(*err);
+
+    if (plugin->voxelize_mode == OPENCL_PLUGIN_VOXELIZE_SOLID) {
+        plugin->fill_parity_kernel = clCreateKernel(plugin->mode_program,
+                                                    "fill_parity", err);
+        CHECK_CL_ERROR(*err);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static void opencl_plugin_release_mode_kernels(opencl_plugin plugin)
+{
+    if (plugin->fill_parity_kernel)
+        clReleaseKernel(plugin->fill_parity_kernel);
+    if (plugin->mode_voxelize_kernel)
+        clReleaseKernel(plugin->mode_voxelize_kernel);
+    if (plugin->mode_program)
+        clReleaseProgram(plugin->mode_program);
+    plugin->fill_parity_kernel = NULL;
+    plugin->mode_voxelize_kernel = NULL;
+    plugin->mode_program = NULL;
+}
+
+/* The voxelize kernel for the plugin's current mode */
+static cl_kernel opencl_plugin_voxelize_kernel(opencl_plugin plugin)
+{
+    return plugin->mode_voxelize_kernel ? plugin->mode_voxelize_kernel
+        : plugin->voxelize_kernel;
+}
+
+/* Create everything a plugin needs of its own to run jobs: queues, kernel
+ * instances and device limits. Context and programs must already be set.
+ * On failure the caller cleans up with opencl_plugin_destroy(). */
+static int opencl_plugin_init_job_state(opencl_plugin plugin,
+                                        cl_int num_queues,
+                                        cl_int *err)
+{
+    cl_int _err;
+    cl_int i;
+    cl_uint align_bits;
+    cl_command_queue_properties queue_properties =
+        plugin->profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+    assert(num_queues > 0);
+
+    if (!err) err = &_err;
+
+    plugin->queue = clCreateCommandQueue(plugin->context, plugin->selected_device, queue_properties, err);
+    CHECK_CL_ERROR(*err);
+
+    plugin->readback_queue = clCreateCommandQueue(plugin->context, plugin->selected_device, queue_properties, err);
+    CHECK_CL_ERROR(*err);
+
+    plugin->queues = calloc(num_queues, sizeof(cl_command_queue));
+    CHECK_ALLOCATION(plugin->queues);
+    plugin->num_queues = num_queues;
+
+    for (i = 0; i < num_queues; i++) {
+        plugin->queues[i] = clCreateCommandQueue(plugin->context, plugin->selected_device, queue_properties, err);
+        CHECK_CL_ERROR(*err);
+    }
+
+    *err = clGetDeviceInfo(plugin->selected_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                           sizeof(plugin->max_mem_alloc_size),
+                           &plugin->max_mem_alloc_size, NULL);
+    CHECK_CL_ERROR(*err);
+
+    *err = clGetDeviceInfo(plugin->selected_device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                           sizeof(plugin->host_unified_memory),
+                           &plugin->host_unified_memory, NULL);
+    CHECK_CL_ERROR(*err);
+
+    /* In bits */
+    *err = clGetDeviceInfo(plugin->selected_device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                           sizeof(align_bits), &align_bits, NULL);
+    CHECK_CL_ERROR(*err);
+    plugin->host_ptr_alignment = align_bits >= 8 ? align_bits / 8 : 1;
+    plugin->zero_copy = plugin->host_unified_memory;
+
+    /* Kernel arguments are per kernel object, so every plugin creates its
+     * own instances even if it shares the program */
+    plugin->voxelize_kernel = clCreateKernel(plugin->program, "voxelize", err);
+    CHECK_CL_ERROR(*err);
+
+    if (plugin->grid_ops_program) {
+        plugin->pack_bits_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                  "pack_bits", err);
+        CHECK_CL_ERROR(*err);
+        plugin->compact_bricks_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                       "compact_bricks", err);
+        CHECK_CL_ERROR(*err);
+        plugin->bin_triangles_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                      "bin_triangles", err);
+        CHECK_CL_ERROR(*err);
+        plugin->batch_triangles_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                        "batch_triangles", err);
+        CHECK_CL_ERROR(*err);
+        plugin->mark_crossings_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                       "mark_crossings", err);
+        CHECK_CL_ERROR(*err);
+        plugin->fill_shell_parity_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                          "fill_shell_parity", err);
+        CHECK_CL_ERROR(*err);
+        plugin->flood_exterior_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                       "flood_exterior", err);
+        CHECK_CL_ERROR(*err);
+        plugin->finish_flood_fill_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                          "finish_flood_fill", err);
+        CHECK_CL_ERROR(*err);
+        plugin->transform_vertices_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                           "transform_vertices", err);
+        CHECK_CL_ERROR(*err);
+        plugin->decode_vertices_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                        "decode_vertices", err);
+        CHECK_CL_ERROR(*err);
+        plugin->widen_indices_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                      "widen_indices", err);
+        CHECK_CL_ERROR(*err);
+        plugin->voxelize_labels_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                        "voxelize_labels", err);
+        CHECK_CL_ERROR(*err);
+        plugin->finish_labels_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                      "finish_labels", err);
+        CHECK_CL_ERROR(*err);
+        plugin->reduce_grid_kernel = clCreateKernel(plugin->grid_ops_program,
+                                                    "reduce_grid", err);
+        CHECK_CL_ERROR(*err);
+    }
+
+    if (plugin->mode_program &&
+        opencl_plugin_create_mode_kernels(plugin, err))
+        goto error;
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Create a plugin with its own context and queues on the given device.
+ * build_options (may be NULL) is used for all programs. */
+static int opencl_plugin_create_on_device(cl_platform_id platform,
+                                          cl_device_id device,
+                                          cl_int num_queues,
+                                          const char *build_options,
+                                          cl_int profiling,
+                                          opencl_plugin *plugin_out)
+{
+    cl_int err = CL_SUCCESS;
+    opencl_plugin plugin;
+
+    assert(num_queues > 0);
+    assert(plugin_out != NULL);
+
+    plugin = calloc(1, sizeof(*plugin));
+    CHECK_ALLOCATION(plugin);
+
+    plugin->pool.high_water_cap = (size_t)-1;
+    plugin->selected_platform = platform;
+    plugin->selected_device = device;
+    plugin->profiling = profiling;
+
+    if (copy_string(build_options, &plugin->build_options))
+        goto error;
+
+    if (create_context(plugin->selected_platform, plugin->selected_device,
+                       &plugin->context, &err))
+        goto error;
+
+    if (build_program_from_file("program.cl", NULL, build_options, plugin->context,
+                                plugin->selected_device, &plugin->program,
+                                &plugin->program_key, &err))
+        goto error;
+
+    if (build_program_from_file("grid_ops.cl", "voxelize_common.cl",
+                                build_options, plugin->context,
+                                plugin->selected_device,
+                                &plugin->grid_ops_program, NULL, &err)) {
+        WARNING("grid_ops.cl unavailable, packed and sparse output, "
+                "binning and batching are disabled", 0);
+    }
+
+    if (opencl_plugin_init_job_state(plugin, num_queues, &err))
+        goto error;
+
+    *plugin_out = plugin;
+    return 0;
+error:
+    opencl_plugin_destroy(plugin);
+    return -1;
+}
+
+/* Create a plugin running jobs on the native CPU voxelizer */
+static int opencl_plugin_create_cpu(opencl_plugin *plugin_out)
+{
+    opencl_plugin plugin;
+
+    assert(plugin_out != NULL);
+
+    plugin = calloc(1, sizeof(*plugin));
+    CHECK_ALLOCATION(plugin);
+
+    plugin->pool.high_water_cap = (size_t)-1;
+
+    if (cpu_voxelizer_create(0, &plugin->cpu)) {
+        ERROR("Failed to start the CPU voxelizer", 0);
+        goto error;
+    }
+
+    TRACE("Using the CPU voxelizer with %d threads",
+          cpu_voxelizer_num_threads(plugin->cpu));
+
+    *plugin_out = plugin;
+    return 0;
+error:
+    free(plugin);
+    return -1;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create(opencl_plugin *plugin_out)
+{
+    cl_platform_id platform;
+    cl_device_id device;
+
+    assert(plugin_out != NULL);
+
+    if (get_desired_platform("NVIDIA", &platform, NULL) ||
+        get_gpu_device_id(platform, &device, CL_TRUE, NULL)) {
+        WARNING("No OpenCL device, falling back to the CPU voxelizer", 0);
+        return opencl_plugin_create_cpu(plugin_out);
+    }
+
+    return opencl_plugin_create_on_device(platform, device, DEFAULT_NUM_QUEUES,
+                                          NULL, 0, plugin_out);
+}
+
+/* Fill in the defaults for opencl_plugin_create_ex(): the fastest device
+ * of any type on any platform, GPUs first */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_config_init(opencl_plugin_config *config)
+{
+    assert(config != NULL);
+
+    memset(config, 0, sizeof(*config));
+    config->device_types = CL_DEVICE_TYPE_ALL;
+    config->preferred_device_types = CL_DEVICE_TYPE_GPU;
+    config->auto_select = 1;
+    config->num_queues = DEFAULT_NUM_QUEUES;
+    config->cpu_mode = OPENCL_PLUGIN_CPU_FALLBACK;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create_ex(const opencl_plugin_config *config,
+                               opencl_plugin *plugin_out)
+{
+    cl_platform_id platform;
+    cl_device_id device;
+
+    assert(config != NULL);
+    assert(plugin_out != NULL);
+
+    if (config->num_queues <= 0) {
+        ERROR("Invalid queue count %d", config->num_queues);
+        return -1;
+    }
+
+    if (config->cpu_mode == OPENCL_PLUGIN_CPU_ALWAYS)
+        return opencl_plugin_create_cpu(plugin_out);
+
+    if (select_device(config, &platform, &device, NULL)) {
+        if (config->cpu_mode != OPENCL_PLUGIN_CPU_FALLBACK)
+            return -1;
+        WARNING("No matching OpenCL device, falling back to the CPU voxelizer", 0);
+        return opencl_plugin_create_cpu(plugin_out);
+    }
+
+    return opencl_plugin_create_on_device(platform, device, config->num_queues,
+                                          config->build_options,
+                                          config->profiling, plugin_out);
+}
+
+/*
+ * Create a worker for running jobs concurrently with plugin from another
+ * thread. A worker is a plugin handle of its own, usable with all the
+ * opencl_plugin_* functions, that shares plugin's context and programs but
+ * has its own queues, kernel instances, buffers and registered meshes, so
+ * jobs on different handles don't need any locking. Each handle must only
+ * be used by one thread at a time. Settings (binning, batching, profiling)
+ * start out as plugin's. num_queues <= 0 uses plugin's queue count. plugin
+ * must outlive its workers, destroy them with opencl_plugin_destroy().
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_create_worker(opencl_plugin plugin,
+                                   cl_int num_queues,
+                                   opencl_plugin *worker_out)
+{
+    cl_int err = CL_SUCCESS;
+    opencl_plugin worker;
+
+    assert(plugin != NULL);
+    assert(worker_out != NULL);
+
+    *worker_out = NULL;
+
+    worker = calloc(1, sizeof(*worker));
+    CHECK_ALLOCATION(worker);
+
+    worker->parent = plugin;
+    worker->pool.high_water_cap = plugin->pool.high_water_cap;
+    worker->binning_enabled = plugin->binning_enabled;
+    worker->large_triangle_extent = plugin->large_triangle_extent;
+    worker->batching_enabled = plugin->batching_enabled;
+    worker->solid_fill = plugin->solid_fill;
+    worker->solid_fill_axis = plugin->solid_fill_axis;
+    worker->vertex_format = plugin->vertex_format;
+    worker->short_indices = plugin->short_indices;
+    worker->mesh_bounds = plugin->mesh_bounds;
+    worker->profiling = plugin->profiling;
+    worker->voxelize_mode = plugin->voxelize_mode;
+    worker->autotune = plugin->autotune;
+    worker->tuned = plugin->tuned;
+    memcpy(worker->tuned_local_sizes, plugin->tuned_local_sizes,
+           sizeof(worker->tuned_local_sizes));
+
+    /* The CPU voxelizer already uses every core, workers take turns on the
+     * parent's */
+    if (plugin->cpu) {
+        worker->cpu = plugin->cpu;
+        *worker_out = worker;
+        return 0;
+    }
+
+    worker->selected_platform = plugin->selected_platform;
+    worker->selected_device = plugin->selected_device;
+    worker->program_key = plugin->program_key;
+    worker->mode_program_key = plugin->mode_program_key;
+
+    err = clRetainContext(plugin->context);
+    CHECK_CL_ERROR(err);
+    worker->context = plugin->context;
+
+    err = clRetainProgram(plugin->program);
+    CHECK_CL_ERROR(err);
+    worker->program = plugin->program;
+
+    if (plugin->grid_ops_program) {
+        err = clRetainProgram(plugin->grid_ops_program);
+        CHECK_CL_ERROR(err);
+        worker->grid_ops_program = plugin->grid_ops_program;
+    }
+
+    if (plugin->mode_program) {
+        err = clRetainProgram(plugin->mode_program);
+        CHECK_CL_ERROR(err);
+        worker->mode_program = plugin->mode_program;
+    }
+
+    if (copy_string(plugin->build_options, &worker->build_options))
+        goto error;
+
+    if (opencl_plugin_init_job_state(worker, num_queues > 0 ? num_queues
+                                     : plugin->num_queues, &err))
+        goto error;
+    worker->zero_copy = plugin->zero_copy;
+
+    *worker_out = worker;
+    return 0;
+error:
+    opencl_plugin_destroy(worker);
+    return -1;
+}
+
+#define DEVICE_BUFFER_GROWTH_NUM 3
+#define DEVICE_BUFFER_GROWTH_DEN 2
+
+static void device_buffer_release(device_memory_pool *pool, device_buffer *buf)
+{
+    if (buf->mem) {
+        clReleaseMemObject(buf->mem);
+        pool->allocated -= buf->capacity;
+    }
+    buf->mem = NULL;
+    buf->capacity = 0;
+    buf->dirty_begin = 0;
+    buf->dirty_end = 0;
+}
+
+/* Make sure buf can hold at least size bytes. Contents are not preserved
+ * when the buffer has to grow. The old buffer may still be in use by
+ * commands already enqueued, OpenCL keeps it alive until they finish. */
+static cl_int device_buffer_reserve(device_memory_pool *pool,
+                                    device_buffer *buf,
+                                    cl_context context,
+                                    cl_mem_flags flags,
+                                    size_t size)
+{
+    cl_int err;
+    size_t new_capacity, others;
+    cl_mem new_mem = NULL;
+
+    assert(pool != NULL);
+    assert(buf != NULL);
+
+    if (size <= buf->capacity && buf->mem)
+        return 0;
+
+    /* clCreateBuffer doesn't allow zero sized buffers */
+    if (size == 0)
+        size = 1;
+
+    /* Grow by 1.5x, but don't let the slack take the pool over its cap */
+    others = pool->allocated - buf->capacity;
+    new_capacity = buf->capacity / DEVICE_BUFFER_GROWTH_DEN * DEVICE_BUFFER_GROWTH_NUM;
+    if (new_capacity < size)
+        new_capacity = size;
+    if (others + new_capacity > pool->high_water_cap) {
+        new_capacity = others < pool->high_water_cap ?
+            pool->high_water_cap - others : 0;
+        if (new_capacity < size)
+            new_capacity = size;
+    }
+
+    /* Free old buffer first, so both don't have to fit at once */
+    device_buffer_release(pool, buf);
+
+    new_mem = clCreateBuffer(context, flags, new_capacity, NULL, &err);
+    if (err != CL_SUCCESS && new_capacity > size) {
+        /* Might just be the slack that doesn't fit */
+        new_capacity = size;
+        new_mem = clCreateBuffer(context, flags, new_capacity, NULL, &err);
+    }
+    CHECK_CL_ERROR_MSG(err, "Failed to allocate %lu byte device buffer",
+                       (unsigned long)new_capacity);
+
+    buf->mem = new_mem;
+    buf->capacity = new_capacity;
+    buf->dirty_begin = 0;
+    buf->dirty_end = new_capacity;
+    pool->allocated += new_capacity;
+
+    return 0;
+error:
+    return -1;
+}
+
+static cl_ulong count_triangles(cl_int mesh_data_count,
+                                const mesh_data *mesh_data_list)
+{
+    cl_int i;
+    cl_ulong num_triangles = 0;
+
+    for (i = 0; i < mesh_data_count; i++)
+        num_triangles += mesh_data_list[i].num_triangles;
+
+    return num_triangles;
+}
+
+#ifdef _MSC_VER
+/* Interlocked operations are full barriers */
+static volatile __int64 g_fence;
+#define atomic_cas(p, old_value, new_value)                             \
+    (_InterlockedCompareExchange64((volatile __int64 *)(p), (new_value), \
+                                   (old_value)) == (old_value))
+#define atomic_increment(p) _InterlockedIncrement64((volatile __int64 *)(p))
+#define memory_barrier()    ((void)_InterlockedExchangeAdd64(&g_fence, 0))
+#else
+#define atomic_cas(p, old_value, new_value)                             \
+    __sync_bool_compare_and_swap(p, old_value, new_value)
+#define atomic_increment(p) __sync_add_and_fetch(p, 1)
+#define memory_barrier()    __sync_synchronize()
+#endif
+
+/* Must be a power of two */
+#define TELEMETRY_RING_SIZE 4096
+
+/* A slot of the telemetry ring. sequence is relative to the slot's index,
+ * so the zero-initialised ring starts out with every slot free. */
+typedef struct _telemetry_slot {
+    volatile cl_long               sequence;
+    opencl_plugin_telemetry_event event;
+} telemetry_slot;
+
+/*
+ * Process wide ring of completed commands, see opencl_plugin_set_telemetry().
+ * A bounded multi-producer queue after Vyukov: a producer claims the slot
+ * at head with a CAS once its sequence says the consumer is done with it,
+ * and publishes it by advancing the sequence. Events that don't fit are
+ * counted and dropped, producers never wait.
+ */
+static telemetry_slot g_telemetry_ring[TELEMETRY_RING_SIZE];
+static volatile cl_long g_telemetry_head;
+static volatile cl_long g_telemetry_tail;
+static volatile cl_long g_telemetry_dropped;
+static volatile cl_int g_telemetry_enabled;
+
+static void telemetry_push(cl_int phase, cl_ulong duration_ns, cl_ulong bytes)
+{
+    cl_long pos, idx, dif;
+    telemetry_slot *slot;
+
+    for (;;) {
+        pos = g_telemetry_head;
+        idx = pos & (TELEMETRY_RING_SIZE - 1);
+        slot = &g_telemetry_ring[idx];
+        memory_barrier();
+        dif = slot->sequence + idx - pos;
+
+        if (dif == 0) {
+            if (atomic_cas(&g_telemetry_head, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            /* Full */
+            atomic_increment(&g_telemetry_dropped);
+            return;
+        }
+        /* Otherwise another producer got there first */
+    }
+
+    slot->event.phase = phase;
+    slot->event.duration_ns = duration_ns;
+    slot->event.bytes = bytes;
+    memory_barrier();
+    slot->sequence = pos + 1 - idx;
+}
+
+/* What a telemetry_callback() reports once its command is done */
+typedef struct _telemetry_command {
+    cl_int   phase;
+    cl_ulong bytes;
+} telemetry_command;
+
+static void CL_CALLBACK telemetry_callback(cl_event event,
+                                           cl_int status,
+                                           void *user_data)
+{
+    telemetry_command *command = user_data;
+    cl_ulong start, end;
+
+    if (status == CL_COMPLETE &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                                sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                                sizeof(end), &end, NULL) == CL_SUCCESS)
+        telemetry_push(command->phase, end - start, command->bytes);
+
+    free(command);
+}
+
+/* Have a recorded command reported to the telemetry ring when it's done */
+static void telemetry_watch(const profile_record *record)
+{
+    telemetry_command *command = malloc(sizeof(*command));
+
+    /* Telemetry is best effort */
+    if (!command)
+        return;
+
+    command->phase = record->phase;
+    command->bytes = record->bytes;
+    if (clSetEventCallback(record->event, CL_COMPLETE, telemetry_callback,
+                           command) != CL_SUCCESS)
+        free(command);
+}
+
+/* Hand the records up to num_records (whose events must be final) to the
+ * telemetry ring if enabled */
+static void opencl_plugin_profile_watch(opencl_plugin plugin,
+                                        cl_int num_records)
+{
+    cl_int telemetry = g_telemetry_enabled;
+    cl_int i;
+
+    for (i = plugin->num_watched_profile_records; i < num_records; i++) {
+        if (telemetry && plugin->profile_records[i].event)
+            telemetry_watch(&plugin->profile_records[i]);
+    }
+    if (num_records > plugin->num_watched_profile_records)
+        plugin->num_watched_profile_records = num_records;
+}
+
+/* Start recording the commands of a new job of num_triangles triangles,
+ * dropping those of the previous one */
+static void opencl_plugin_profile_begin(opencl_plugin plugin,
+                                        cl_ulong num_triangles)
+{
+    cl_int i;
+
+    opencl_plugin_profile_watch(plugin, plugin->num_profile_records);
+    for (i = 0; i < plugin->num_profile_records; i++) {
+        if (plugin->profile_records[i].event)
+            clReleaseEvent(plugin->profile_records[i].event);
+    }
+    plugin->num_profile_records = 0;
+    plugin->num_watched_profile_records = 0;
+    plugin->profile_num_triangles = num_triangles;
+}
+
+/* Event pointer to pass to an enqueue call so the command is recorded, or
+ * NULL if not profiling. Only valid until the next call. */
+static cl_event *opencl_plugin_profile(opencl_plugin plugin,
+                                       enum profile_phase phase,
+                                       cl_ulong bytes)
+{
+    profile_record *record;
+
+    if (!plugin->profiling)
+        return NULL;
+
+    /* The enqueue calls for the earlier slots are done, so their commands
+     * get watched as they're recorded rather than when the job is dropped */
+    opencl_plugin_profile_watch(plugin, plugin->num_profile_records);
+
+    if (plugin->num_profile_records == plugin->profile_records_capacity) {
+        cl_int capacity = plugin->profile_records_capacity ?
+            plugin->profile_records_capacity * 2 : 64;
+        profile_record *records = realloc(plugin->profile_records,
+                                          sizeof(*records) * capacity);
+        /* Losing a record only makes the stats incomplete */
+        if (!records)
+            return NULL;
+        plugin->profile_records = records;
+        plugin->profile_records_capacity = capacity;
+    }
+
+    record = &plugin->profile_records[plugin->num_profile_records++];
+    record->phase = phase;
+    record->event = NULL;
+    record->bytes = bytes;
+    return &record->event;
+}
+
+/* Record a command whose event the caller keeps as well */
+static void opencl_plugin_profile_event(opencl_plugin plugin,
+                                        enum profile_phase phase,
+                                        cl_event event,
+                                        cl_ulong bytes)
+{
+    cl_event *slot = opencl_plugin_profile(plugin, phase, bytes);
+
+    if (slot && event) {
+        clRetainEvent(event);
+        *slot = event;
+        opencl_plugin_profile_watch(plugin, plugin->num_profile_records);
+    }
+}
+
+static cl_int opencl_plugin_init_voxel_buffer(opencl_plugin plugin,
+                                              device_buffer *grid_buffer,
+                                              cl_int num_voxels)
+{
+    assert(plugin != NULL);
+    assert(num_voxels >= 0);
+
+    /* Read by the grid_ops.cl kernels, so not CL_MEM_WRITE_ONLY. Rounded up
+     * to whole words, which the solid voxelize kernel toggles voxels in. */
+    return device_buffer_reserve(&plugin->pool, grid_buffer, plugin->context,
+                                 CL_MEM_READ_WRITE,
+                                 ((size_t)num_voxels + 3) & ~(size_t)3);
+}
+
+static void CL_CALLBACK free_event_data(cl_event event,
+                                        cl_int status,
+                                        void *user_data)
+{
+    (void)event;
+    (void)status;
+
+    free(user_data);
+}
+
+/* Nearest half float to f, which must be finite */
+static cl_ushort float_to_half(float f)
+{
+    union { float f; cl_uint u; } bits;
+    cl_uint sign, mant, rest, halfway, h;
+    cl_int exp, shift;
+
+    bits.f = f;
+    sign = (bits.u >> 16) & 0x8000;
+    exp = (cl_int)((bits.u >> 23) & 0xff) - 127 + 15;
+    mant = bits.u & 0x7fffff;
+
+    if (exp >= 31)
+        return (cl_ushort)(sign | 0x7c00);
+    if (exp < -10)
+        return (cl_ushort)sign;
+
+    if (exp > 0) {
+        shift = 13;
+        h = ((cl_uint)exp << 10) | (mant >> shift);
+    } else {
+        /* Subnormal, the implicit bit becomes explicit */
+        mant |= 0x800000;
+        shift = 14 - exp;
+        h = mant >> shift;
+    }
+
+    /* Round to nearest even, a carry into the exponent is still right */
+    rest = mant & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (h & 1)))
+        h++;
+
+    return (cl_ushort)(sign | h);
+}
+
+/* Largest finite half float */
+#define HALF_MAX 65504.0f
+
+/* Whether mesh's bounds may be relied on to contain its vertices: the
+ * caller promised so with opencl_plugin_set_mesh_bounds(), and they aren't
+ * inverted or NaN */
+static int mesh_has_bounds(opencl_plugin plugin, const mesh_data *mesh)
+{
+    return plugin->mesh_bounds &&
+        mesh->bounds_min_x <= mesh->bounds_max_x &&
+        mesh->bounds_min_y <= mesh->bounds_max_y &&
+        mesh->bounds_min_z <= mesh->bounds_max_z;
+}
+
+/* The format mesh's vertices are uploaded in, falling back to floats if
+ * the mesh doesn't fit the plugin's format */
+static cl_int mesh_vertex_format(opencl_plugin plugin, const mesh_data *mesh)
+{
+    int has_bounds = mesh_has_bounds(plugin, mesh);
+
+    switch (plugin->vertex_format) {
+    case OPENCL_PLUGIN_VERTEX_FIXED16:
+        if (has_bounds)
+            return OPENCL_PLUGIN_VERTEX_FIXED16;
+        break;
+    case OPENCL_PLUGIN_VERTEX_HALF:
+        if (has_bounds &&
+            mesh->bounds_min_x >= -HALF_MAX && mesh->bounds_max_x <= HALF_MAX &&
+            mesh->bounds_min_y >= -HALF_MAX && mesh->bounds_max_y <= HALF_MAX &&
+            mesh->bounds_min_z >= -HALF_MAX && mesh->bounds_max_z <= HALF_MAX)
+            return OPENCL_PLUGIN_VERTEX_HALF;
+        break;
+    }
+
+    return OPENCL_PLUGIN_VERTEX_FLOAT;
+}
+
+static int mesh_short_indices(opencl_plugin plugin, const mesh_data *mesh)
+{
+    return plugin->short_indices && mesh->num_vertices <= 65536;
+}
+
+/* 16-bit fixed point vertices of mesh decode to lo + q * scale */
+static void fixed16_params(const mesh_data *mesh,
+                           float lo_out[3],
+                           float scale_out[3])
+{
+    lo_out[0] = mesh->bounds_min_x;
+    lo_out[1] = mesh->bounds_min_y;
+    lo_out[2] = mesh->bounds_min_z;
+    scale_out[0] = (mesh->bounds_max_x - mesh->bounds_min_x) / 65535.0f;
+    scale_out[1] = (mesh->bounds_max_y - mesh->bounds_min_y) / 65535.0f;
+    scale_out[2] = (mesh->bounds_max_z - mesh->bounds_min_z) / 65535.0f;
+}
+
+/* Encode mesh's vertices into out (3 per vertex) in the given compact
+ * format */
+static void encode_vertices(const mesh_data *mesh,
+                            cl_int format,
+                            cl_ushort *out)
+{
+    float lo[3], scale[3], inv_scale[3];
+    size_t i, n = 3 * (size_t)mesh->num_vertices;
+    cl_int j;
+
+    if (format == OPENCL_PLUGIN_VERTEX_HALF) {
+        for (i = 0; i < n; i++)
+            out[i] = float_to_half(mesh->vertices[i]);
+        return;
+    }
+
+    fixed16_params(mesh, lo, scale);
+    for (j = 0; j < 3; j++)
+        inv_scale[j] = scale[j] > 0.0f ? 1.0f / scale[j] : 0.0f;
+
+    for (i = 0; i < n; i++) {
+        float q = (mesh->vertices[i] - lo[i % 3]) * inv_scale[i % 3] + 0.5f;
+
+        /* Clamped, in case the bounds are a little off */
+        out[i] = (cl_ushort)(q <= 0.0f ? 0 : q >= 65535.0f ? 65535 : (cl_uint)q);
+    }
+}
+
+/* Enqueue decoding num_vertices compact vertices at in_base_idx (in
+ * cl_ushorts) of plugin->compact_mesh_buffer into plugin->vertex_buffer at
+ * vertex out_base_idx */
+static cl_int opencl_plugin_enqueue_decode_vertices(opencl_plugin plugin,
+                                                    cl_uint in_base_idx,
+                                                    cl_int format,
+                                                    const float lo[3],
+                                                    const float scale[3],
+                                                    cl_int num_vertices,
+                                                    cl_uint out_base_idx)
+{
+    cl_int err = CL_SUCCESS;
+    cl_kernel kernel = plugin->decode_vertices_kernel;
+    size_t global_work_size = (size_t)num_vertices;
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &plugin->compact_mesh_buffer.mem);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &in_base_idx);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &format);
+    err |= clSetKernelArg(kernel, 3, sizeof(float), &lo[0]);
+    err |= clSetKernelArg(kernel, 4, sizeof(float), &lo[1]);
+    err |= clSetKernelArg(kernel, 5, sizeof(float), &lo[2]);
+    err |= clSetKernelArg(kernel, 6, sizeof(float), &scale[0]);
+    err |= clSetKernelArg(kernel, 7, sizeof(float), &scale[1]);
+    err |= clSetKernelArg(kernel, 8, sizeof(float), &scale[2]);
+    err |= clSetKernelArg(kernel, 9, sizeof(cl_int), &num_vertices);
+    err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &plugin->vertex_buffer.mem);
+    err |= clSetKernelArg(kernel, 11, sizeof(cl_uint), &out_base_idx);
+    CHECK_CL_ERROR(err);
+
+    err = clEnqueueNDRangeKernel(plugin->queue, kernel, 1, NULL,
+                                 &global_work_size, NULL, 0, NULL,
+                                 opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Like opencl_plugin_enqueue_decode_vertices(), for num_indices 16-bit
+ * indices into plugin->triangle_buffer at index out_base_idx */
+static cl_int opencl_plugin_enqueue_widen_indices(opencl_plugin plugin,
+                                                  cl_uint in_base_idx,
+                                                  cl_int num_indices,
+                                                  cl_uint out_base_idx)
+{
+    cl_int err = CL_SUCCESS;
+    cl_kernel kernel = plugin->widen_indices_kernel;
+    size_t global_work_size = (size_t)num_indices;
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &plugin->compact_mesh_buffer.mem);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &in_base_idx);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &num_indices);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &plugin->triangle_buffer.mem);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &out_base_idx);
+    CHECK_CL_ERROR(err);
+
+    err = clEnqueueNDRangeKernel(plugin->queue, kernel, 1, NULL,
+                                 &global_work_size, NULL, 0, NULL,
+                                 opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Upload the compact parts of the given meshes in one write, and enqueue
+ * decoding them into plugin->vertex_buffer and plugin->triangle_buffer at
+ * the places opencl_plugin_init_mesh_buffers() puts them */
+static cl_int opencl_plugin_upload_compact_meshes(opencl_plugin plugin,
+                                                  cl_int mesh_data_count,
+                                                  mesh_data *mesh_data_list,
+                                                  size_t compact_size)
+{
+    cl_int err;
+    cl_int i;
+    cl_int format;
+    cl_ushort *compact = NULL;
+    size_t offset;
+    size_t vertex_base = 0, triangle_base = 0;
+    float lo[3] = { 0.0f, 0.0f, 0.0f }, scale[3] = { 0.0f, 0.0f, 0.0f };
+    cl_event write_event = NULL;
+
+    if (compact_size > (size_t)UINT_MAX) {
+        ERROR("Too much compact mesh data (%lu values)",
+              (unsigned long)compact_size);
+        return -1;
+    }
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->compact_mesh_buffer,
+                              plugin->context, CL_MEM_READ_ONLY,
+                              sizeof(cl_ushort) * compact_size))
+        goto error;
+
+    compact = malloc(sizeof(*compact) * compact_size);
+    CHECK_ALLOCATION(compact);
+
+    offset = 0;
+    for (i = 0; i < mesh_data_count; i++) {
+        mesh_data *mesh = &mesh_data_list[i];
+        size_t j, num_indices = 3 * (size_t)mesh->num_triangles;
+
+        format = mesh_vertex_format(plugin, mesh);
+        if (format != OPENCL_PLUGIN_VERTEX_FLOAT) {
+            encode_vertices(mesh, format, compact + offset);
+            offset += 3 * (size_t)mesh->num_vertices;
+        }
+        if (mesh_short_indices(plugin, mesh)) {
+            for (j = 0; j < num_indices; j++)
+                compact[offset + j] = (cl_ushort)mesh->triangles[j];
+            offset += num_indices;
+        }
+    }
+
+    err = clEnqueueWriteBuffer(plugin->queue, plugin->compact_mesh_buffer.mem,
+                               CL_FALSE, 0, sizeof(*compact) * compact_size,
+                               compact, 0, NULL, &write_event);
+    CHECK_CL_ERROR(err);
+
+    /* Freed once the write is done with it */
+    err = clSetEventCallback(write_event, CL_COMPLETE, free_event_data,
+                             compact);
+    if (err != CL_SUCCESS) {
+        clWaitForEvents(1, &write_event);
+        CHECK_CL_ERROR(err);
+    }
+    compact = NULL;
+    opencl_plugin_profile_event(plugin, PROFILE_UPLOAD, write_event,
+                                sizeof(cl_ushort) * compact_size);
+    clReleaseEvent(write_event);
+    write_event = NULL;
+
+    /* Second pass in the same order, encoding has to stay in step */
+    offset = 0;
+    for (i = 0; i < mesh_data_count; i++) {
+        mesh_data *mesh = &mesh_data_list[i];
+
+        format = mesh_vertex_format(plugin, mesh);
+        if (format != OPENCL_PLUGIN_VERTEX_FLOAT) {
+            if (format == OPENCL_PLUGIN_VERTEX_FIXED16)
+                fixed16_params(mesh, lo, scale);
+            if (mesh->num_vertices > 0 &&
+                opencl_plugin_enqueue_decode_vertices(plugin, (cl_uint)offset,
+                                                      format, lo, scale,
+                                                      mesh->num_vertices,
+                                                      (cl_uint)vertex_base))
+                goto error;
+            offset += 3 * (size_t)mesh->num_vertices;
+        }
+        if (mesh_short_indices(plugin, mesh)) {
+            if (mesh->num_triangles > 0 &&
+                opencl_plugin_enqueue_widen_indices(plugin, (cl_uint)offset,
+                                                    3 * mesh->num_triangles,
+                                                    (cl_uint)(3 * triangle_base)))
+                goto error;
+            offset += 3 * (size_t)mesh->num_triangles;
+        }
+
+        vertex_base += mesh->num_vertices;
+        triangle_base += mesh->num_triangles;
+    }
+
+    return 0;
+error:
+    free(compact);
+    if (write_event)
+        clReleaseEvent(write_event);
+    return -1;
+}
+
+static cl_int opencl_plugin_init_mesh_buffers(opencl_plugin plugin,
+                                              cl_int mesh_data_count,
+                                              mesh_data *mesh_data_list)
+{
+    cl_int err;
+    cl_int i;
+    size_t total_num_vertices = 0, total_num_triangles = 0;
+    size_t compact_size = 0;
+
+    assert(plugin != NULL);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+
+    if ((plugin->vertex_format != OPENCL_PLUGIN_VERTEX_FLOAT ||
+         plugin->short_indices) && !plugin->decode_vertices_kernel) {
+        ERROR("Mesh compression requires grid_ops.cl", 0);
+        return -1;
+    }
+
+    for (i = 0; i < mesh_data_count; i++) {
+        total_num_vertices += mesh_data_list[i].num_vertices;
+        total_num_triangles += mesh_data_list[i].num_triangles;
+        if (mesh_vertex_format(plugin, &mesh_data_list[i]) != OPENCL_PLUGIN_VERTEX_FLOAT)
+            compact_size += 3 * (size_t)mesh_data_list[i].num_vertices;
+        if (mesh_short_indices(plugin, &mesh_data_list[i]))
+            compact_size += 3 * (size_t)mesh_data_list[i].num_triangles;
+    }
+
+    /* Written by the decode kernels when compression is enabled, which may
+     * happen after the buffers were allocated */
+    if (device_buffer_reserve(&plugin->pool, &plugin->vertex_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(float) * 3 * total_num_vertices))
+        goto error;
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->triangle_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int) * 3 * total_num_triangles))
+        goto error;
+
+    if (compact_size > 0 &&
+        opencl_plugin_upload_compact_meshes(plugin, mesh_data_count,
+                                            mesh_data_list, compact_size))
+        goto error;
+
+    total_num_vertices = 0;
+    total_num_triangles = 0;
+    for (i = 0; i < mesh_data_count; i++) {
+        mesh_data *mesh_data = &mesh_data_list[i];
+
+        /* Empty writes aren't allowed */
+        if (mesh_data->num_vertices > 0 &&
+            mesh_vertex_format(plugin, mesh_data) == OPENCL_PLUGIN_VERTEX_FLOAT) {
+            err = clEnqueueWriteBuffer(
+                plugin->queue, plugin->vertex_buffer.mem, CL_FALSE,
+                sizeof(float) * 3 * total_num_vertices,
+                sizeof(float) * 3 * mesh_data->num_vertices, mesh_data->vertices,
+                0, NULL,
+                opencl_plugin_profile(plugin, PROFILE_UPLOAD,
+                                      sizeof(float) * 3 * mesh_data->num_vertices));
+            CHECK_CL_ERROR(err);
+        }
+
+        if (mesh_data->num_triangles > 0 &&
+            !mesh_short_indices(plugin, mesh_data)) {
+            err = clEnqueueWriteBuffer(
+                plugin->queue, plugin->triangle_buffer.mem, CL_FALSE,
+                sizeof(cl_int) * 3 * total_num_triangles,
+                sizeof(cl_int) * 3 * mesh_data->num_triangles, mesh_data->triangles,
+                0, NULL,
+                opencl_plugin_profile(plugin, PROFILE_UPLOAD,
+                                      sizeof(cl_int) * 3 * mesh_data->num_triangles));
+            CHECK_CL_ERROR(err);
+        }
+
+        total_num_vertices += mesh_data_list[i].num_vertices;
+        total_num_triangles += mesh_data_list[i].num_triangles;
+    }
+
+    /* No need to wait for the writes, anything that uses the buffers is
+     * ordered after them on plugin->queue */
+    return 0;
+error:
+    return -1;
+}
+
+static void init_voxel_grid_params(voxel_grid_params *grid,
+                                   float inv_element_size,
+                                   float corner_x,
+                                   float corner_y,
+                                   float corner_z,
+                                   cl_int x_cell_length,
+                                   cl_int y_cell_length,
+                                   cl_int z_cell_length)
+{
+    grid->inv_element_size = inv_element_size;
+    grid->corner_x = corner_x;
+    grid->corner_y = corner_y;
+    grid->corner_z = corner_z;
+    grid->x_cell_length = x_cell_length;
+    grid->y_cell_length = y_cell_length;
+    grid->z_cell_length = z_cell_length;
+}
+
+static void init_voxel_output(voxel_output *output,
+                              enum voxel_output_format format,
+                              void *dst)
+{
+    memset(output, 0, sizeof(*output));
+    output->format = format;
+    output->dst = dst;
+}
+
+/* Wait for everything outstanding on all of the plugin's queues */
+static void opencl_plugin_drain(opencl_plugin plugin)
+{
+    cl_int i;
+
+    if (plugin->cpu)
+        return;
+
+    clFinish(plugin->queue);
+    clFinish(plugin->readback_queue);
+    for (i = 0; i < plugin->num_queues; i++)
+        clFinish(plugin->queues[i]);
+}
+
+/* Whether a mesh's bounds could touch the voxels of grid. Meshes are given a
+ * one voxel margin, the kernel may be conservative. Meshes without trusted
+ * bounds (see mesh_has_bounds()) are always included. */
+static int mesh_overlaps_grid(opencl_plugin plugin,
+                              const mesh_data *mesh,
+                              const voxel_grid_params *grid)
+{
+    float margin = 1.0f / grid->inv_element_size;
+    float max_x = grid->corner_x + grid->x_cell_length / grid->inv_element_size;
+    float max_y = grid->corner_y + grid->y_cell_length / grid->inv_element_size;
+    float max_z = grid->corner_z + grid->z_cell_length / grid->inv_element_size;
+
+    if (!mesh_has_bounds(plugin, mesh))
+        return 1;
+
+    return mesh->bounds_max_x + margin >= grid->corner_x &&
+           mesh->bounds_min_x - margin <= max_x &&
+           mesh->bounds_max_y + margin >= grid->corner_y &&
+           mesh->bounds_min_y - margin <= max_y &&
+           mesh->bounds_max_z + margin >= grid->corner_z &&
+           mesh->bounds_min_z - margin <= max_z;
+}
+
+/* Voxels of a grid that a job may set, inclusive. Empty if lo > hi on any
+ * axis. */
+typedef struct _voxel_box {
+    cl_int lo[3];
+    cl_int hi[3];
+} voxel_box;
+
+static void voxel_box_init(voxel_box *box)
+{
+    cl_int i;
+
+    for (i = 0; i < 3; i++) {
+        box->lo[i] = INT_MAX;
+        box->hi[i] = -1;
+    }
+}
+
+/* Cell of grid (along an axis of length cells) containing position v,
+ * clamped to the grid */
+static cl_int clamp_cell(float v, cl_int length)
+{
+    if (!(v >= 0.0f))
+        return 0;
+    if (v >= (float)(length - 1))
+        return length - 1;
+    return (cl_int)v;
+}
+
+/* Grow box to include the voxels mesh may set, with the same one voxel
+ * margin as mesh_overlaps_grid(). Meshes without trusted bounds cover the
+ * whole grid. */
+static void voxel_box_add_mesh(opencl_plugin plugin,
+                               voxel_box *box,
+                               const voxel_grid_params *grid,
+                               const mesh_data *mesh)
+{
+    float bounds_min[3], bounds_max[3], corner[3];
+    cl_int length[3];
+    cl_int has_bounds = mesh_has_bounds(plugin, mesh);
+    cl_int i;
+
+    if (!mesh_overlaps_grid(plugin, mesh, grid))
+        return;
+
+    bounds_min[0] = mesh->bounds_min_x;
+    bounds_min[1] = mesh->bounds_min_y;
+    bounds_min[2] = mesh->bounds_min_z;
+    bounds_max[0] = mesh->bounds_max_x;
+    bounds_max[1] = mesh->bounds_max_y;
+    bounds_max[2] = mesh->bounds_max_z;
+    corner[0] = grid->corner_x;
+    corner[1] = grid->corner_y;
+    corner[2] = grid->corner_z;
+    length[0] = grid->x_cell_length;
+    length[1] = grid->y_cell_length;
+    length[2] = grid->z_cell_length;
+
+    for (i = 0; i < 3; i++) {
+        cl_int lo = 0, hi = length[i] - 1;
+
+        if (has_bounds) {
+            lo = clamp_cell((bounds_min[i] - corner[i]) * grid->inv_element_size - 1.0f,
+                            length[i]);
+            hi = clamp_cell((bounds_max[i] - corner[i]) * grid->inv_element_size + 1.0f,
+                            length[i]);
+        }
+        if (lo < box->lo[i]) box->lo[i] = lo;
+        if (hi > box->hi[i]) box->hi[i] = hi;
+    }
+}
+
+static void voxel_box_add_meshes(opencl_plugin plugin,
+                                 voxel_box *box,
+                                 const voxel_grid_params *grid,
+                                 cl_int mesh_data_count,
+                                 const mesh_data *mesh_data_list)
+{
+    cl_int i;
+
+    for (i = 0; i < mesh_data_count; i++)
+        voxel_box_add_mesh(plugin, box, grid, &mesh_data_list[i]);
+}
+
+/* (Re-)allocate the voxel grid for a job and enqueue clearing it on
+ * plugin->queue. Only what earlier jobs left dirty is cleared, so the
+ * unused tail of the buffer and voxels far from the meshes cost nothing.
+ * box (NULL for the whole grid) is what this job may set, it's tracked as
+ * the range of bytes between its first and last voxel. */
+static cl_int opencl_plugin_enqueue_clear_grid(opencl_plugin plugin,
+                                               device_buffer *grid_buffer,
+                                               const voxel_grid_params *grid,
+                                               const voxel_box *box)
+{
+    cl_int err;
+    cl_int num_voxels;
+    voxel_box job_box;
+    size_t row, slice;
+    cl_int i;
+
+    assert(plugin != NULL);
+    assert(grid != NULL);
+    assert(grid->inv_element_size >= 0);
+    assert(grid->x_cell_length >= 0);
+    assert(grid->y_cell_length >= 0);
+    assert(grid->z_cell_length >= 0);
+
+    num_voxels = grid->x_cell_length * grid->y_cell_length * grid->z_cell_length;
+    if (opencl_plugin_init_voxel_buffer(plugin, grid_buffer, num_voxels))
+        goto error;
+
+    if (grid_buffer->dirty_end > grid_buffer->dirty_begin &&
+        enqueue_zero_buffer(plugin->queue, grid_buffer->mem,
+                            grid_buffer->dirty_begin,
+                            grid_buffer->dirty_end - grid_buffer->dirty_begin,
+                            0, NULL,
+                            opencl_plugin_profile(plugin, PROFILE_FILL, 0),
+                            &err))
+        goto error;
+
+    if (box) {
+        job_box = *box;
+    } else {
+        voxel_box_init(&job_box);
+        for (i = 0; i < 3; i++)
+            job_box.lo[i] = 0;
+        job_box.hi[0] = grid->x_cell_length - 1;
+        job_box.hi[1] = grid->y_cell_length - 1;
+        job_box.hi[2] = grid->z_cell_length - 1;
+    }
+
+    /* Parity fills run along whole lines, and in solid mode crossings below
+     * the grid are counted in its first layer */
+    if (plugin->voxelize_mode == OPENCL_PLUGIN_VOXELIZE_SOLID) {
+        job_box.lo[2] = 0;
+        job_box.hi[2] = grid->z_cell_length - 1;
+    } else if (plugin->solid_fill == OPENCL_PLUGIN_SOLID_FILL_PARITY) {
+        i = plugin->solid_fill_axis;
+        job_box.lo[i] = 0;
+        job_box.hi[i] = (i == 0 ? grid->x_cell_length :
+                         i == 1 ? grid->y_cell_length :
+                         grid->z_cell_length) - 1;
+    }
+
+    grid_buffer->dirty_begin = 0;
+    grid_buffer->dirty_end = 0;
+    if (num_voxels > 0 && job_box.lo[0] <= job_box.hi[0] &&
+        job_box.lo[1] <= job_box.hi[1] && job_box.lo[2] <= job_box.hi[2]) {
+        row = (size_t)grid->x_cell_length;
+        slice = row * grid->y_cell_length;
+        grid_buffer->dirty_begin = job_box.lo[0] + job_box.lo[1] * row +
+            job_box.lo[2] * slice;
+        grid_buffer->dirty_end = job_box.hi[0] + job_box.hi[1] * row +
+            job_box.hi[2] * slice + 1;
+    }
+
+    return 0;
+error:
+    /* The fill may not have happened */
+    grid_buffer->dirty_begin = 0;
+    grid_buffer->dirty_end = grid_buffer->capacity;
+    return -1;
+}
+
+/* Upper bounds of the autotuner's triangle count buckets, and the triangle
+ * count each is benchmarked with */
+static const cl_int tune_bucket_limits[NUM_TUNE_BUCKETS - 1] = {
+    1024, 16384, 262144
+};
+static const cl_int tune_bucket_sizes[NUM_TUNE_BUCKETS] = {
+    256, 4096, 65536, 524288
+};
+
+#define MAX_TUNE_CANDIDATES 16
+#define TUNE_GRID_SIZE 128
+#define TUNE_REPEATS 3
+
+static cl_int tune_bucket(cl_int num_triangles)
+{
+    cl_int i;
+
+    for (i = 0; i < NUM_TUNE_BUCKETS - 1; i++) {
+        if (num_triangles <= tune_bucket_limits[i])
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Autotuning results file layout, next to the program binary cache and
+ * keyed the same way, all fields in native byte order:
+ *
+ *   char     magic[8]     "CLTUNv1\0"
+ *   cl_ulong key          program cache key of the tuned kernel's program
+ *   cl_ulong local_sizes[NUM_TUNE_BUCKETS]
+ */
+static const char tuning_magic[8] = "CLTUNv1";
+
+typedef struct _tuning_file {
+    char     magic[8];
+    cl_ulong key;
+    cl_ulong local_sizes[NUM_TUNE_BUCKETS];
+} tuning_file;
+
+static void get_tuning_filename(const char *filename,
+                                cl_ulong key,
+                                char *buf,
+                                size_t buf_size)
+{
+    snprintf(buf, buf_size, "%s.%016llx.tune", filename,
+             (unsigned long long)key);
+}
+
+static int load_tuning(const char *tuning_filename,
+                       cl_ulong key,
+                       size_t local_sizes_out[NUM_TUNE_BUCKETS])
+{
+    char *data = NULL;
+    size_t data_size;
+    tuning_file tuning;
+    cl_int i;
+
+    if (read_file(tuning_filename, "rb", &data, &data_size))
+        goto error;
+
+    if (data_size != sizeof(tuning))
+        goto error;
+    memcpy(&tuning, data, sizeof(tuning));
+
+    if (memcmp(tuning.magic, tuning_magic, sizeof(tuning.magic)) ||
+        tuning.key != key) {
+        WARNING("Ignoring stale or corrupt tuning file \"%s\"",
+                tuning_filename);
+        goto error;
+    }
+
+    for (i = 0; i < NUM_TUNE_BUCKETS; i++) {
+        if (tuning.local_sizes[i] == 0)
+            goto error;
+        local_sizes_out[i] = (size_t)tuning.local_sizes[i];
+    }
+
+    free(data);
+    return 0;
+error:
+    free(data);
+    return -1;
+}
+
+/* Failing to write isn't fatal, we'll just tune again next time */
+static void save_tuning(const char *tuning_filename,
+                        cl_ulong key,
+                        const size_t local_sizes[NUM_TUNE_BUCKETS])
+{
+    tuning_file tuning;
+    FILE *file;
+    cl_int i;
+
+    memset(&tuning, 0, sizeof(tuning));
+    memcpy(tuning.magic, tuning_magic, sizeof(tuning.magic));
+    tuning.key = key;
+    for (i = 0; i < NUM_TUNE_BUCKETS; i++)
+        tuning.local_sizes[i] = local_sizes[i];
+
+    file = fopen(tuning_filename, "wb");
+    if (!file) {
+        WARNING("Couldn't open tuning file \"%s\" for writing",
+                tuning_filename);
+        return;
+    }
+
+    if (fwrite(&tuning, sizeof(tuning), 1, file) != 1) {
+        WARNING("Failed to write tuning file \"%s\"", tuning_filename);
+        fclose(file);
+        remove(tuning_filename);
+        return;
+    }
+
+    fclose(file);
+}
+
+/* Small random triangles filling a TUNE_GRID_SIZE^3 grid of unit voxels,
+ * each with its own vertices. Deterministic, so every run (and device)
+ * times the same work. */
+static void generate_tuning_mesh(cl_int num_triangles,
+                                 float *vertices,
+                                 cl_int *triangles)
+{
+    cl_uint state = 12345;
+    cl_int i, j, k;
+
+    for (i = 0; i < num_triangles; i++) {
+        float centre[3];
+
+        for (k = 0; k < 3; k++) {
+            state = state * 1664525u + 1013904223u;
+            centre[k] = (float)(state >> 8) / (float)(1 << 24) * TUNE_GRID_SIZE;
+        }
+        for (j = 0; j < 3; j++) {
+            for (k = 0; k < 3; k++) {
+                state = state * 1664525u + 1013904223u;
+                vertices[9 * i + 3 * j + k] = centre[k] +
+                    ((float)(state >> 8) / (float)(1 << 24) - 0.5f) * 2.0f;
+            }
+            triangles[3 * i + j] = 3 * i + j;
+        }
+    }
+}
+
+/* Benchmark the candidate local sizes of kernel on a synthetic mesh of each
+ * bucket's size, on a queue of its own with profiling */
+static int benchmark_local_sizes(opencl_plugin plugin,
+                                 cl_kernel kernel,
+                                 size_t local_sizes_out[NUM_TUNE_BUCKETS],
+                                 cl_int *err)
+{
+    cl_int _err;
+    cl_int b, c, r;
+    cl_int max_triangles = tune_bucket_sizes[NUM_TUNE_BUCKETS - 1];
+    size_t max_local_size, multiple;
+    size_t candidates[MAX_TUNE_CANDIDATES];
+    cl_int num_candidates = 0;
+    float *vertices = NULL;
+    cl_int *triangles = NULL;
+    cl_command_queue queue = NULL;
+    cl_mem vertex_buffer = NULL, triangle_buffer = NULL, grid_buffer = NULL;
+    cl_event event = NULL;
+    float inv_element_size = 1.0f, corner = 0.0f;
+    cl_int cell_length = TUNE_GRID_SIZE;
+    cl_int next_row_offset = TUNE_GRID_SIZE;
+    cl_int next_slice_offset = TUNE_GRID_SIZE * TUNE_GRID_SIZE;
+    cl_uint zero = 0;
+
+    if (!err) err = &_err;
+
+    *err = clGetKernelWorkGroupInfo(kernel, plugin->selected_device,
+                                    CL_KERNEL_WORK_GROUP_SIZE,
+                                    sizeof(max_local_size), &max_local_size,
+                                    NULL);
+    CHECK_CL_ERROR(*err);
+    *err = clGetKernelWorkGroupInfo(kernel, plugin->selected_device,
+                                    CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                    sizeof(multiple), &multiple, NULL);
+    CHECK_CL_ERROR(*err);
+    if (multiple == 0 || multiple > max_local_size)
+        multiple = max_local_size;
+
+    /* Powers of two multiples of the preferred multiple, and the maximum */
+    for (c = 1; (size_t)c * multiple < max_local_size &&
+             num_candidates < MAX_TUNE_CANDIDATES - 1; c *= 2)
+        candidates[num_candidates++] = (size_t)c * multiple;
+    candidates[num_candidates++] = max_local_size;
+
+    vertices = malloc(sizeof(*vertices) * 9 * (size_t)max_triangles);
+    CHECK_ALLOCATION(vertices);
+    triangles = malloc(sizeof(*triangles) * 3 * (size_t)max_triangles);
+    CHECK_ALLOCATION(triangles);
+    generate_tuning_mesh(max_triangles, vertices, triangles);
+
+    queue = clCreateCommandQueue(plugin->context, plugin->selected_device,
+                                 CL_QUEUE_PROFILING_ENABLE, err);
+    CHECK_CL_ERROR(*err);
+
+    vertex_buffer = clCreateBuffer(plugin->context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(*vertices) * 9 * (size_t)max_triangles,
+                                   vertices, err);
+    CHECK_CL_ERROR(*err);
+    triangle_buffer = clCreateBuffer(plugin->context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     sizeof(*triangles) * 3 * (size_t)max_triangles,
+                                     triangles, err);
+    CHECK_CL_ERROR(*err);
+    grid_buffer = clCreateBuffer(plugin->context, CL_MEM_READ_WRITE,
+                                 (size_t)next_slice_offset * TUNE_GRID_SIZE,
+                                 NULL, err);
+    CHECK_CL_ERROR(*err);
+
+    *err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &grid_buffer);
+    *err |= clSetKernelArg(kernel, 1, sizeof(float),  &inv_element_size);
+    *err |= clSetKernelArg(kernel, 2, sizeof(float),  &corner);
+    *err |= clSetKernelArg(kernel, 3, sizeof(float),  &corner);
+    *err |= clSetKernelArg(kernel, 4, sizeof(float),  &corner);
+    *err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &next_row_offset);
+    *err |= clSetKernelArg(kernel, 6, sizeof(cl_int), &next_slice_offset);
+    *err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &cell_length);
+    *err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &cell_length);
+    *err |= clSetKernelArg(kernel, 9, sizeof(cl_int), &cell_length);
+    *err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &vertex_buffer);
+    *err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &triangle_buffer);
+    *err |= clSetKernelArg(kernel, 13, sizeof(cl_uint), &zero);
+    *err |= clSetKernelArg(kernel, 14, sizeof(cl_uint), &zero);
+    CHECK_CL_ERROR(*err);
+
+    for (b = 0; b < NUM_TUNE_BUCKETS; b++) {
+        cl_int num_triangles = tune_bucket_sizes[b];
+        cl_ulong best_ns = 0;
+
+        *err = clSetKernelArg(kernel, 12, sizeof(cl_int), &num_triangles);
+        CHECK_CL_ERROR(*err);
+
+        local_sizes_out[b] = max_local_size;
+        for (c = 0; c < num_candidates; c++) {
+            size_t local_work_size = candidates[c];
+            size_t global_work_size = ((size_t)num_triangles + local_work_size - 1) /
+                local_work_size * local_work_size;
+            cl_ulong candidate_ns = 0;
+
+            /* First run is a warm-up */
+            for (r = 0; r <= TUNE_REPEATS; r++) {
+                cl_ulong start, end;
+
+                *err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+                                              &global_work_size,
+                                              &local_work_size, 0, NULL,
+                                              &event);
+                CHECK_CL_ERROR(*err);
+                *err = clWaitForEvents(1, &event);
+                CHECK_CL_ERROR(*err);
+                *err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                                               sizeof(start), &start, NULL);
+                CHECK_CL_ERROR(*err);
+                *err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                                               sizeof(end), &end, NULL);
+                CHECK_CL_ERROR(*err);
+                clReleaseEvent(event);
+                event = NULL;
+
+                if (r > 0 && (candidate_ns == 0 || end - start < candidate_ns))
+                    candidate_ns = end - start;
+            }
+
+            if (best_ns == 0 || candidate_ns < best_ns) {
+                best_ns = candidate_ns;
+                local_sizes_out[b] = local_work_size;
+            }
+        }
+
+        TRACE("Tuned local size for %d triangles: %lu (%.3f ms)",
+              num_triangles, (unsigned long)local_sizes_out[b],
+              (double)best_ns * 1e-6);
+    }
+
+    clReleaseMemObject(grid_buffer);
+    clReleaseMemObject(triangle_buffer);
+    clReleaseMemObject(vertex_buffer);
+    clReleaseCommandQueue(queue);
+    free(triangles);
+    free(vertices);
+    return 0;
+error:
+    if (event)
+        clReleaseEvent(event);
+    if (grid_buffer)
+        clReleaseMemObject(grid_buffer);
+    if (triangle_buffer)
+        clReleaseMemObject(triangle_buffer);
+    if (vertex_buffer)
+        clReleaseMemObject(vertex_buffer);
+    if (queue)
+        clReleaseCommandQueue(queue);
+    free(triangles);
+    free(vertices);
+    return -1;
+}
+
+/* Pick local sizes for the plugin's current voxelize kernel, from the
+ * tuning file if there is one for this build and device, otherwise by
+ * benchmarking and saving the result. Failing just leaves the plugin on the
+ * kernel's maximum work-group size. */
+static void opencl_plugin_autotune(opencl_plugin plugin)
+{
+    const char *filename;
+    cl_ulong key;
+    char tuning_filename[4096];
+
+    plugin->tuned = 0;
+
+    if (plugin->mode_voxelize_kernel) {
+        filename = "voxelize_modes.cl";
+        key = plugin->mode_program_key;
+    } else {
+        filename = "program.cl";
+        key = plugin->program_key;
+    }
+    get_tuning_filename(filename, key, tuning_filename, sizeof(tuning_filename));
+
+    if (!load_tuning(tuning_filename, key, plugin->tuned_local_sizes)) {
+        TRACE("Loaded local sizes from \"%s\"", tuning_filename);
+        plugin->tuned = 1;
+        return;
+    }
+
+    if (benchmark_local_sizes(plugin, opencl_plugin_voxelize_kernel(plugin),
+                              plugin->tuned_local_sizes, NULL)) {
+        WARNING("Autotuning failed, using the maximum work-group size", 0);
+        /* Don't retry on every job */
+        plugin->autotune = 0;
+        return;
+    }
+
+    save_tuning(tuning_filename, key, plugin->tuned_local_sizes);
+    plugin->tuned = 1;
+}
+
+/* Second pass of OPENCL_PLUGIN_VOXELIZE_SOLID, on plugin->queue after the
+ * voxelize kernels have been joined */
+static cl_int opencl_plugin_enqueue_fill_parity(opencl_plugin plugin,
+                                                cl_mem grid_buffer,
+                                                const voxel_grid_params *grid)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int next_row_offset = grid->x_cell_length;
+    cl_int next_slice_offset = grid->x_cell_length * grid->y_cell_length;
+    size_t global_work_size[2];
+
+    if (next_slice_offset == 0 || grid->z_cell_length == 0)
+        return 0;
+
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 0, sizeof(cl_mem), &grid_buffer);
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 1, sizeof(cl_int), &next_row_offset);
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 2, sizeof(cl_int), &next_slice_offset);
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 3, sizeof(cl_int), &grid->x_cell_length);
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 4, sizeof(cl_int), &grid->y_cell_length);
+    err |= clSetKernelArg(plugin->fill_parity_kernel, 5, sizeof(cl_int), &grid->z_cell_length);
+    CHECK_CL_ERROR(err);
+
+    global_work_size[0] = (size_t)grid->x_cell_length;
+    global_work_size[1] = (size_t)grid->y_cell_length;
+    err = clEnqueueNDRangeKernel(plugin->queue, plugin->fill_parity_kernel, 2,
+                                 NULL, global_work_size, NULL, 0, NULL,
+                                 opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Enqueue the kernels for a job without blocking. Everything the launches
+ * need must already be enqueued on plugin->queue. The kernels are spread
+ * over plugin->queues and only depend on that, and are joined back onto
+ * plugin->queue, so anything enqueued there afterwards sees the finished
+ * grid. kernel is the current voxelize kernel, voxelize_labels which
+ * takes each launch's label_key as an extra argument, or mark_crossings
+ * whose axis argument the caller sets. */
+static cl_int opencl_plugin_enqueue_kernel_launches(opencl_plugin plugin,
+                                                    cl_kernel kernel,
+                                                    cl_mem grid_buffer,
+                                                    const voxel_grid_params *grid,
+                                                    cl_int num_launches,
+                                                    const mesh_launch *launches)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i;
+    cl_int next_row_offset, next_slice_offset;
+    size_t local_work_size;
+    cl_int num_used_queues = 0;
+    cl_event upload_event = NULL;
+    cl_event *join_events = NULL;
+    cl_int labels = kernel == plugin->voxelize_labels_kernel;
+    cl_int voxelize = kernel == opencl_plugin_voxelize_kernel(plugin);
+    cl_int tuned;
+
+    assert(plugin != NULL);
+    assert(grid != NULL);
+    assert(num_launches >= 0);
+    assert(launches != NULL || num_launches == 0);
+
+    /* Tuning is for the voxelize kernel */
+    if (voxelize && plugin->autotune && !plugin->tuned)
+        opencl_plugin_autotune(plugin);
+    tuned = voxelize && plugin->tuned;
+
+    err = clGetKernelWorkGroupInfo(
+        kernel, plugin->selected_device,
+        CL_KERNEL_WORK_GROUP_SIZE, sizeof(local_work_size), &local_work_size,
+        NULL);
+    CHECK_CL_ERROR(err);
+
+    /* Everything the kernels need is on plugin->queue up to this point */
+    err = clEnqueueMarkerWithWaitList(plugin->queue, 0, NULL, &upload_event);
+    CHECK_CL_ERROR(err);
+
+    num_used_queues = num_launches < plugin->num_queues ?
+        num_launches : plugin->num_queues;
+    join_events = calloc(num_used_queues > 0 ? num_used_queues : 1,
+                         sizeof(*join_events));
+    CHECK_ALLOCATION(join_events);
+
+    next_row_offset = grid->x_cell_length;
+    next_slice_offset = grid->x_cell_length * grid->y_cell_length;
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &grid_buffer);
+    err |= clSetKernelArg(kernel, 1, sizeof(float),  &grid->inv_element_size);
+    err |= clSetKernelArg(kernel, 2, sizeof(float),  &grid->corner_x);
+    err |= clSetKernelArg(kernel, 3, sizeof(float),  &grid->corner_y);
+    err |= clSetKernelArg(kernel, 4, sizeof(float),  &grid->corner_z);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &next_row_offset);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_int), &next_slice_offset);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &grid->x_cell_length);
+    err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &grid->y_cell_length);
+    err |= clSetKernelArg(kernel, 9, sizeof(cl_int), &grid->z_cell_length);
+    CHECK_CL_ERROR(err);
+
+    for (i = 0; i < num_launches; i++) {
+        const mesh_launch *launch = &launches[i];
+        size_t global_work_size;
+        size_t launch_local_work_size = launch->local_work_size;
+
+        /* Empty meshes, an empty NDRange isn't allowed */
+        if (launch->num_triangles == 0)
+            continue;
+
+        if (!launch_local_work_size) {
+            launch_local_work_size = tuned ?
+                plugin->tuned_local_sizes[tune_bucket(launch->num_triangles)] :
+                local_work_size;
+        }
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &launch->vertex_buffer);
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &launch->triangle_buffer);
+        err |= clSetKernelArg(kernel, 12, sizeof(cl_int), &launch->num_triangles);
+        err |= clSetKernelArg(kernel, 13, sizeof(cl_uint), &launch->vertex_buffer_base_idx);
+        err |= clSetKernelArg(kernel, 14, sizeof(cl_uint), &launch->triangle_buffer_base_idx);
+        if (labels)
+            err |= clSetKernelArg(kernel, 15, sizeof(cl_uint), &launch->label_key);
+        CHECK_CL_ERROR(err);
+
+        /* As per the OpenCL spec, global_work_size must divide evenly by
+         * local_work_size */
+        global_work_size = launch->num_triangles / launch_local_work_size;
+        global_work_size *= launch_local_work_size;
+        if (global_work_size < (size_t)launch->num_triangles)
+            global_work_size += launch_local_work_size;
+
+        /* Kernel arguments are captured at enqueue time, so the next
+         * iteration is free to change them. Meshes only ever set voxels, so
+         * kernels on different queues can safely overlap. */
+        err = clEnqueueNDRangeKernel(
+            plugin->queues[i % plugin->num_queues], kernel, 1,
+            NULL, &global_work_size, &launch_local_work_size, 1, &upload_event,
+            opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+        CHECK_CL_ERROR_MSG(err, "clEnqueueNDRangeKernel failed on mesh %d/%d",
+                           i + 1, num_launches);
+    }
+
+    /* One marker per used queue is enough to join, the pool queues are
+     * in-order */
+    for (i = 0; i < num_used_queues; i++) {
+        err = clEnqueueMarkerWithWaitList(plugin->queues[i], 0, NULL,
+                                          &join_events[i]);
+        CHECK_CL_ERROR(err);
+
+        err = clFlush(plugin->queues[i]);
+        CHECK_CL_ERROR(err);
+    }
+
+    if (num_used_queues > 0) {
+        err = clEnqueueBarrierWithWaitList(plugin->queue,
+                                           (cl_uint)num_used_queues,
+                                           join_events, NULL);
+        CHECK_CL_ERROR(err);
+    }
+
+    for (i = 0; i < num_used_queues; i++)
+        clReleaseEvent(join_events[i]);
+    free(join_events);
+    join_events = NULL;
+    clReleaseEvent(upload_event);
+    upload_event = NULL;
+
+    if (voxelize && plugin->fill_parity_kernel &&
+        opencl_plugin_enqueue_fill_parity(plugin, grid_buffer, grid))
+        goto error;
+
+    return 0;
+error:
+    if (join_events) {
+        for (i = 0; i < num_used_queues; i++) {
+            if (join_events[i])
+                clReleaseEvent(join_events[i]);
+        }
+    }
+    free(join_events);
+    if (upload_event)
+        clReleaseEvent(upload_event);
+    return -1;
+}
+
+static cl_int opencl_plugin_enqueue_launches(opencl_plugin plugin,
+                                             cl_mem grid_buffer,
+                                             const voxel_grid_params *grid,
+                                             cl_int num_launches,
+                                             const mesh_launch *launches)
+{
+    return opencl_plugin_enqueue_kernel_launches(
+        plugin, opencl_plugin_voxelize_kernel(plugin), grid_buffer, grid,
+        num_launches, launches);
+}
+
+/* Set the line layout arguments of the grid_ops.cl solid fill kernels for
+ * lines along axis (0 = x, 1 = y, 2 = z), and the matching 2D work size of
+ * one work-item per line */
+static cl_int set_line_kernel_args(cl_kernel kernel,
+                                   cl_mem grid_buffer,
+                                   const voxel_grid_params *grid,
+                                   cl_int axis,
+                                   size_t global_work_size[2])
+{
+    cl_int err = CL_SUCCESS;
+    cl_int lengths[3], strides[3];
+    cl_int u = (axis + 1) % 3, v = (axis + 2) % 3;
+
+    lengths[0] = grid->x_cell_length;
+    lengths[1] = grid->y_cell_length;
+    lengths[2] = grid->z_cell_length;
+    strides[0] = 1;
+    strides[1] = grid->x_cell_length;
+    strides[2] = grid->x_cell_length * grid->y_cell_length;
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &grid_buffer);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_int), &lengths[axis]);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &strides[axis]);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &lengths[u]);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &strides[u]);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &lengths[v]);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_int), &strides[v]);
+
+    global_work_size[0] = (size_t)lengths[u];
+    global_work_size[1] = (size_t)lengths[v];
+
+    return err;
+}
+
+/* Enqueue the solid fill selected by opencl_plugin_set_solid_fill() on the
+ * finished grid, on plugin->queue. The parity fill goes over the job's
+ * launches again to count line crossings. The flood fill blocks until it
+ * has converged. */
+static cl_int opencl_plugin_enqueue_solid_fill(opencl_plugin plugin,
+                                               cl_mem grid_buffer,
+                                               const voxel_grid_params *grid,
+                                               cl_int num_launches,
+                                               const mesh_launch *launches)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int axis;
+    cl_int changed;
+    cl_int num_rounds = 0;
+    size_t global_work_size[2];
+    size_t num_voxels;
+    cl_uint num_voxels_arg;
+
+    /* Already solid */
+    if (plugin->voxelize_mode == OPENCL_PLUGIN_VOXELIZE_SOLID)
+        return 0;
+
+    num_voxels = (size_t)grid->x_cell_length * grid->y_cell_length *
+        grid->z_cell_length;
+    if (num_voxels == 0)
+        return 0;
+
+    switch (plugin->solid_fill) {
+    case OPENCL_PLUGIN_SOLID_FILL_NONE:
+        break;
+    case OPENCL_PLUGIN_SOLID_FILL_PARITY:
+        /* The surface voxels alone can't tell a wall crossed from a line
+         * running along it, so count the triangles */
+        if (opencl_plugin_init_voxel_buffer(plugin, &plugin->crossings_buffer,
+                                            (cl_int)num_voxels) ||
+            enqueue_zero_buffer(plugin->queue, plugin->crossings_buffer.mem, 0,
+                                (num_voxels + 3) & ~(size_t)3, 0, NULL,
+                                opencl_plugin_profile(plugin, PROFILE_FILL, 0),
+                                &err))
+            goto error;
+
+        axis = plugin->solid_fill_axis;
+        err = clSetKernelArg(plugin->mark_crossings_kernel, 15, sizeof(cl_int),
+                             &axis);
+        CHECK_CL_ERROR(err);
+
+        if (opencl_plugin_enqueue_kernel_launches(plugin,
+                                                  plugin->mark_crossings_kernel,
+                                                  plugin->crossings_buffer.mem,
+                                                  grid, num_launches, launches))
+            goto error;
+
+        err = set_line_kernel_args(plugin->fill_shell_parity_kernel,
+                                   grid_buffer, grid, axis, global_work_size);
+        err |= clSetKernelArg(plugin->fill_shell_parity_kernel, 7,
+                              sizeof(cl_mem), &plugin->crossings_buffer.mem);
+        CHECK_CL_ERROR(err);
+
+        err = clEnqueueNDRangeKernel(plugin->queue,
+                                     plugin->fill_shell_parity_kernel, 2, NULL,
+                                     global_work_size, NULL, 0, NULL,
+                                     opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+        CHECK_CL_ERROR(err);
+        break;
+    case OPENCL_PLUGIN_SOLID_FILL_FLOOD:
+        if (device_buffer_reserve(&plugin->pool, &plugin->flood_changed_buffer,
+                                  plugin->context, CL_MEM_READ_WRITE,
+                                  sizeof(cl_int)))
+            goto error;
+
+        /* Sweep along each axis in turn until a round marks nothing */
+        do {
+            changed = 0;
+            err = clEnqueueFillBuffer(plugin->queue,
+                                      plugin->flood_changed_buffer.mem,
+                                      &changed, sizeof(changed), 0,
+                                      sizeof(changed), 0, NULL, NULL);
+            CHECK_CL_ERROR(err);
+
+            for (axis = 0; axis < 3; axis++) {
+                err = set_line_kernel_args(plugin->flood_exterior_kernel,
+                                           grid_buffer, grid, axis,
+                                           global_work_size);
+                err |= clSetKernelArg(plugin->flood_exterior_kernel, 7,
+                                      sizeof(cl_mem),
+                                      &plugin->flood_changed_buffer.mem);
+                CHECK_CL_ERROR(err);
+
+                err = clEnqueueNDRangeKernel(plugin->queue,
+                                             plugin->flood_exterior_kernel, 2,
+                                             NULL, global_work_size, NULL, 0,
+                                             NULL,
+                                             opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+                CHECK_CL_ERROR(err);
+            }
+
+            err = clEnqueueReadBuffer(plugin->queue,
+                                      plugin->flood_changed_buffer.mem, CL_TRUE,
+                                      0, sizeof(changed), &changed, 0, NULL,
+                                      NULL);
+            CHECK_CL_ERROR(err);
+            num_rounds++;
+        } while (changed);
+
+        TRACE("Flood fill converged after %d rounds", num_rounds);
+
+        err |= clSetKernelArg(plugin->finish_flood_fill_kernel, 0, sizeof(cl_mem), &grid_buffer);
+        num_voxels_arg = (cl_uint)num_voxels;
+        err |= clSetKernelArg(plugin->finish_flood_fill_kernel, 1, sizeof(cl_uint), &num_voxels_arg);
+        CHECK_CL_ERROR(err);
+
+        err = clEnqueueNDRangeKernel(plugin->queue,
+                                     plugin->finish_flood_fill_kernel, 1, NULL,
+                                     &num_voxels, NULL, 0, NULL,
+                                     opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+        CHECK_CL_ERROR(err);
+        break;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Enqueue compacting the occupied bricks of the finished grid into the
+ * brick buffers, on plugin->queue */
+static cl_int opencl_plugin_enqueue_compact_bricks(opencl_plugin plugin,
+                                                   const voxel_grid_params *grid,
+                                                   cl_int max_bricks)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int zero = 0;
+    cl_int x_bricks, y_bricks, z_bricks;
+    size_t num_bricks;
+
+    assert(max_bricks >= 0);
+
+    x_bricks = (grid->x_cell_length + BRICK_SIZE - 1) / BRICK_SIZE;
+    y_bricks = (grid->y_cell_length + BRICK_SIZE - 1) / BRICK_SIZE;
+    z_bricks = (grid->z_cell_length + BRICK_SIZE - 1) / BRICK_SIZE;
+    num_bricks = (size_t)x_bricks * y_bricks * z_bricks;
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->brick_count_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int)))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->brick_coords_buffer,
+                              plugin->context, CL_MEM_WRITE_ONLY,
+                              sizeof(cl_int) * 3 * (size_t)max_bricks))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->brick_data_buffer,
+                              plugin->context, CL_MEM_WRITE_ONLY,
+                              BRICK_VOXELS * (size_t)max_bricks))
+        goto error;
+
+    err = clEnqueueFillBuffer(plugin->queue, plugin->brick_count_buffer.mem,
+                              &zero, sizeof(zero), 0, sizeof(zero), 0, NULL,
+                              NULL);
+    CHECK_CL_ERROR(err);
+
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 0, sizeof(cl_mem), &plugin->voxel_grid_buffer.mem);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 1, sizeof(cl_int), &grid->x_cell_length);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 2, sizeof(cl_int), &grid->y_cell_length);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 3, sizeof(cl_int), &grid->z_cell_length);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 4, sizeof(cl_int), &x_bricks);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 5, sizeof(cl_int), &y_bricks);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 6, sizeof(cl_int), &z_bricks);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 7, sizeof(cl_mem), &plugin->brick_count_buffer.mem);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 8, sizeof(cl_mem), &plugin->brick_coords_buffer.mem);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 9, sizeof(cl_mem), &plugin->brick_data_buffer.mem);
+    err |= clSetKernelArg(plugin->compact_bricks_kernel, 10, sizeof(cl_int), &max_bricks);
+    CHECK_CL_ERROR(err);
+
+    if (num_bricks > 0) {
+        err = clEnqueueNDRangeKernel(plugin->queue,
+                                     plugin->compact_bricks_kernel, 1, NULL,
+                                     &num_bricks, NULL, 0, NULL,
+                                     opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+        CHECK_CL_ERROR(err);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Enqueue converting the finished grid into the requested output format
+ * and reading it back, on plugin->queue. *event_out (if not NULL) is the
+ * event for the final readback. */
+static cl_int opencl_plugin_enqueue_output(opencl_plugin plugin,
+                                           const voxel_grid_params *grid,
+                                           const voxel_output *output,
+                                           cl_event *event_out)
+{
+    cl_int err = CL_SUCCESS;
+    cl_uint num_voxels;
+    size_t num_words;
+    size_t readback_size = 0;
+    cl_event readback_event = NULL;
+
+    assert(output != NULL);
+    /* event_out may be NULL */
+
+    num_voxels = (cl_uint)(grid->x_cell_length * grid->y_cell_length *
+                           grid->z_cell_length);
+
+    switch (output->format) {
+    case VOXEL_OUTPUT_DENSE:
+        readback_size = num_voxels;
+        if (output->row_pitch && num_voxels > 0) {
+            size_t origin[3] = { 0, 0, 0 };
+            size_t region[3];
+
+            region[0] = grid->x_cell_length;
+            region[1] = grid->y_cell_length;
+            region[2] = grid->z_cell_length;
+            err = clEnqueueReadBufferRect(
+                plugin->queue, plugin->voxel_grid_buffer.mem, CL_FALSE,
+                origin, origin, region, region[0], region[0] * region[1],
+                output->row_pitch, output->slice_pitch, output->dst, 0, NULL,
+                &readback_event);
+        } else {
+            err = enqueue_read_buffer(
+                plugin->queue, plugin->voxel_grid_buffer.mem, readback_size,
+                output->dst, &readback_event);
+        }
+        CHECK_CL_ERROR(err);
+        break;
+    case VOXEL_OUTPUT_PACKED:
+        num_words = ((size_t)num_voxels + 31) / 32;
+
+        if (device_buffer_reserve(&plugin->pool, &plugin->packed_grid_buffer,
+                                  plugin->context, CL_MEM_READ_WRITE,
+                                  sizeof(cl_uint) * num_words))
+            goto error;
+
+        err |= clSetKernelArg(plugin->pack_bits_kernel, 0, sizeof(cl_mem), &plugin->voxel_grid_buffer.mem);
+        err |= clSetKernelArg(plugin->pack_bits_kernel, 1, sizeof(cl_mem), &plugin->packed_grid_buffer.mem);
+        err |= clSetKernelArg(plugin->pack_bits_kernel, 2, sizeof(cl_uint), &num_voxels);
+        CHECK_CL_ERROR(err);
+
+        if (num_words > 0) {
+            err = clEnqueueNDRangeKernel(plugin->queue,
+                                         plugin->pack_bits_kernel, 1, NULL,
+                                         &num_words, NULL, 0, NULL,
+                                         opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+            CHECK_CL_ERROR(err);
+        }
+
+        readback_size = sizeof(cl_uint) * num_words;
+        err = enqueue_read_buffer(
+            plugin->queue, plugin->packed_grid_buffer.mem, readback_size,
+            output->dst, &readback_event);
+        CHECK_CL_ERROR(err);
+        break;
+    case VOXEL_OUTPUT_SPARSE:
+        if (opencl_plugin_enqueue_compact_bricks(plugin, grid,
+                                                 output->max_bricks))
+            goto error;
+
+        readback_size = sizeof(cl_int);
+        err = clEnqueueReadBuffer(
+            plugin->queue, plugin->brick_count_buffer.mem, CL_FALSE, 0,
+            readback_size, output->dst, 0, NULL, &readback_event);
+        CHECK_CL_ERROR(err);
+        break;
+    case VOXEL_OUTPUT_NONE:
+        err = clEnqueueMarkerWithWaitList(plugin->queue, 0, NULL,
+                                          &readback_event);
+        CHECK_CL_ERROR(err);
+        break;
+    }
+
+    opencl_plugin_profile_event(plugin, PROFILE_READBACK, readback_event,
+                                readback_size);
+    if (event_out)
+        *event_out = readback_event;
+    else
+        clReleaseEvent(readback_event);
+    readback_event = NULL;
+
+    /* Make sure the job actually starts, otherwise polling could spin
+     * forever on an unsubmitted command */
+    err = clFlush(plugin->queue);
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* For everything the CPU voxelizer doesn't cover */
+static cl_int opencl_plugin_check_device(opencl_plugin plugin)
+{
+    if (plugin->cpu) {
+        ERROR("Not supported by the CPU voxelizer", 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Run a whole job on the CPU voxelizer, blocking. Only dense and packed
+ * output are supported. */
+static cl_int opencl_plugin_cpu_voxelize(opencl_plugin plugin,
+                                         const voxel_grid_params *grid,
+                                         cl_int mesh_data_count,
+                                         const mesh_data *mesh_data_list,
+                                         const voxel_output *output)
+{
+    size_t i, num_voxels;
+    cl_uchar *voxels = NULL;
+    cl_uint *bits;
+    cl_int y, z;
+    size_t row_size = (size_t)grid->x_cell_length;
+    int own_voxels = output->format == VOXEL_OUTPUT_PACKED ||
+        output->row_pitch != 0;
+
+    num_voxels = (size_t)grid->x_cell_length * grid->y_cell_length *
+        grid->z_cell_length;
+
+    switch (output->format) {
+    case VOXEL_OUTPUT_DENSE:
+        if (!own_voxels) {
+            voxels = output->dst;
+            break;
+        }
+        /* Strided, voxelized in one piece and copied out below */
+        voxels = malloc(num_voxels > 0 ? num_voxels : 1);
+        CHECK_ALLOCATION(voxels);
+        break;
+    case VOXEL_OUTPUT_PACKED:
+        voxels = malloc(num_voxels > 0 ? num_voxels : 1);
+        CHECK_ALLOCATION(voxels);
+        break;
+    case VOXEL_OUTPUT_SPARSE:
+    case VOXEL_OUTPUT_NONE:
+        ERROR("Output format %d is not supported by the CPU voxelizer",
+              (int)output->format);
+        goto error;
+    }
+
+    if (cpu_voxelizer_voxelize(plugin->cpu, grid->inv_element_size,
+                               grid->corner_x, grid->corner_y, grid->corner_z,
+                               grid->x_cell_length, grid->y_cell_length,
+                               grid->z_cell_length, mesh_data_count,
+                               mesh_data_list, voxels)) {
+        ERROR("CPU voxelization failed", 0);
+        goto error;
+    }
+
+    if (output->format == VOXEL_OUTPUT_PACKED) {
+        bits = output->dst;
+        memset(bits, 0, sizeof(*bits) * ((num_voxels + 31) / 32));
+        for (i = 0; i < num_voxels; i++)
+            bits[i / 32] |= (cl_uint)(voxels[i] != 0) << (i % 32);
+    } else if (own_voxels) {
+        for (z = 0; z < grid->z_cell_length; z++) {
+            for (y = 0; y < grid->y_cell_length; y++) {
+                memcpy((cl_uchar *)output->dst + z * output->slice_pitch +
+                       y * output->row_pitch,
+                       voxels + ((size_t)z * grid->y_cell_length + y) * row_size,
+                       row_size);
+            }
+        }
+    }
+
+    if (own_voxels)
+        free(voxels);
+    return 0;
+error:
+    if (own_voxels)
+        free(voxels);
+    return -1;
+}
+
+/* Check up front that the plugin can produce the requested output, so we
+ * don't fail halfway through enqueueing a job */
+static cl_int opencl_plugin_check_output(opencl_plugin plugin,
+                                         const voxel_output *output)
+{
+    if (output->format == VOXEL_OUTPUT_PACKED && !plugin->pack_bits_kernel) {
+        ERROR("Packed output requires grid_ops.cl", 0);
+        return -1;
+    }
+    if (output->format == VOXEL_OUTPUT_SPARSE && !plugin->compact_bricks_kernel) {
+        ERROR("Sparse output requires grid_ops.cl", 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Cull the uploaded triangles of the given meshes against the grid and
+ * split the rest into plugin->small_triangle_buffer and
+ * plugin->large_triangle_buffer, see bin_triangles in grid_ops.cl. Blocks
+ * until the binned counts are known, as they size the voxelize launches. */
+static cl_int opencl_plugin_bin_triangles(opencl_plugin plugin,
+                                          const voxel_grid_params *grid,
+                                          cl_int mesh_data_count,
+                                          const mesh_data *mesh_data_list,
+                                          cl_int bin_counts_out[2])
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i;
+    cl_int zero = 0;
+    size_t total_num_triangles = 0;
+    cl_uint vertex_offset = 0, triangle_offset = 0;
+
+    for (i = 0; i < mesh_data_count; i++)
+        total_num_triangles += mesh_data_list[i].num_triangles;
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->bin_count_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int) * 2))
+        goto error;
+    /* Worst case every triangle ends up in the same bin */
+    if (device_buffer_reserve(&plugin->pool, &plugin->small_triangle_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int) * 3 * total_num_triangles))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->large_triangle_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int) * 3 * total_num_triangles))
+        goto error;
+
+    err = clEnqueueFillBuffer(plugin->queue, plugin->bin_count_buffer.mem,
+                              &zero, sizeof(zero), 0, sizeof(cl_int) * 2, 0,
+                              NULL, NULL);
+    CHECK_CL_ERROR(err);
+
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 0, sizeof(cl_mem), &plugin->vertex_buffer.mem);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 1, sizeof(cl_mem), &plugin->triangle_buffer.mem);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 5, sizeof(float),  &grid->inv_element_size);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 6, sizeof(float),  &grid->corner_x);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 7, sizeof(float),  &grid->corner_y);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 8, sizeof(float),  &grid->corner_z);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 9, sizeof(cl_int), &grid->x_cell_length);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 10, sizeof(cl_int), &grid->y_cell_length);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 11, sizeof(cl_int), &grid->z_cell_length);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 12, sizeof(float),  &plugin->large_triangle_extent);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 13, sizeof(cl_mem), &plugin->bin_count_buffer.mem);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 14, sizeof(cl_mem), &plugin->small_triangle_buffer.mem);
+    err |= clSetKernelArg(plugin->bin_triangles_kernel, 15, sizeof(cl_mem), &plugin->large_triangle_buffer.mem);
+    CHECK_CL_ERROR(err);
+
+    /* Offsets follow the layout opencl_plugin_init_mesh_buffers() uploads */
+    for (i = 0; i < mesh_data_count; i++) {
+        const mesh_data *mesh = &mesh_data_list[i];
+        size_t global_work_size = (size_t)mesh->num_triangles;
+
+        if (global_work_size > 0) {
+            err |= clSetKernelArg(plugin->bin_triangles_kernel, 2, sizeof(cl_int), &mesh->num_triangles);
+            err |= clSetKernelArg(plugin->bin_triangles_kernel, 3, sizeof(cl_uint), &vertex_offset);
+            err |= clSetKernelArg(plugin->bin_triangles_kernel, 4, sizeof(cl_uint), &triangle_offset);
+            CHECK_CL_ERROR(err);
+
+            err = clEnqueueNDRangeKernel(plugin->queue,
+                                         plugin->bin_triangles_kernel, 1, NULL,
+                                         &global_work_size, NULL, 0, NULL,
+                                         opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+            CHECK_CL_ERROR_MSG(err, "Binning failed on mesh %d/%d", i + 1,
+                               mesh_data_count);
+        }
+
+        vertex_offset += mesh->num_vertices;
+        triangle_offset += mesh->num_triangles;
+    }
+
+    err = clEnqueueReadBuffer(plugin->queue, plugin->bin_count_buffer.mem,
+                              CL_TRUE, 0, sizeof(cl_int) * 2, bin_counts_out,
+                              0, NULL, NULL);
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Enqueue gathering the uploaded triangles of the given meshes into
+ * plugin->batched_triangle_buffer with absolute vertex indices, see
+ * batch_triangles in grid_ops.cl. *num_triangles_out is the batch size. */
+static cl_int opencl_plugin_enqueue_batch_triangles(opencl_plugin plugin,
+                                                    cl_int mesh_data_count,
+                                                    const mesh_data *mesh_data_list,
+                                                    cl_int *num_triangles_out)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i;
+    cl_int *mesh_table = NULL;
+    cl_int num_triangles = 0, num_vertices = 0;
+    size_t global_work_size;
+    cl_event table_event = NULL;
+
+    mesh_table = malloc(sizeof(*mesh_table) * 3 *
+                        (mesh_data_count > 0 ? mesh_data_count : 1));
+    CHECK_ALLOCATION(mesh_table);
+
+    /* Bases follow the layout opencl_plugin_init_mesh_buffers() uploads */
+    for (i = 0; i < mesh_data_count; i++) {
+        mesh_table[3 * i + 0] = num_triangles;
+        mesh_table[3 * i + 1] = num_vertices;
+        mesh_table[3 * i + 2] = num_triangles;
+        num_triangles += mesh_data_list[i].num_triangles;
+        num_vertices += mesh_data_list[i].num_vertices;
+    }
+
+    *num_triangles_out = num_triangles;
+    if (num_triangles == 0) {
+        free(mesh_table);
+        return 0;
+    }
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->mesh_table_buffer,
+                              plugin->context, CL_MEM_READ_ONLY,
+                              sizeof(cl_int) * 3 * (size_t)mesh_data_count))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->batched_triangle_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_int) * 3 * (size_t)num_triangles))
+        goto error;
+
+    err = clEnqueueWriteBuffer(plugin->queue, plugin->mesh_table_buffer.mem,
+                               CL_FALSE, 0,
+                               sizeof(cl_int) * 3 * (size_t)mesh_data_count,
+                               mesh_table, 0, NULL, &table_event);
+    CHECK_CL_ERROR(err);
+
+    /* The table is freed once the write is done with it */
+    err = clSetEventCallback(table_event, CL_COMPLETE, free_event_data,
+                             mesh_table);
+    if (err != CL_SUCCESS) {
+        clWaitForEvents(1, &table_event);
+        CHECK_CL_ERROR(err);
+    }
+    mesh_table = NULL;
+    clReleaseEvent(table_event);
+    table_event = NULL;
+
+    err |= clSetKernelArg(plugin->batch_triangles_kernel, 0, sizeof(cl_mem), &plugin->triangle_buffer.mem);
+    err |= clSetKernelArg(plugin->batch_triangles_kernel, 1, sizeof(cl_mem), &plugin->mesh_table_buffer.mem);
+    err |= clSetKernelArg(plugin->batch_triangles_kernel, 2, sizeof(cl_int), &mesh_data_count);
+    err |= clSetKernelArg(plugin->batch_triangles_kernel, 3, sizeof(cl_int), &num_triangles);
+    err |= clSetKernelArg(plugin->batch_triangles_kernel, 4, sizeof(cl_mem), &plugin->batched_triangle_buffer.mem);
+    CHECK_CL_ERROR(err);
+
+    global_work_size = (size_t)num_triangles;
+    err = clEnqueueNDRangeKernel(plugin->queue, plugin->batch_triangles_kernel,
+                                 1, NULL, &global_work_size, NULL, 0, NULL,
+                                 opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    if (table_event)
+        clReleaseEvent(table_event);
+    free(mesh_table);
+    return -1;
+}
+
+/* Release the non-NULL objects of mems, which may itself be NULL */
+static void release_mem_objects(cl_int count, cl_mem *mems)
+{
+    cl_int i;
+
+    if (!mems)
+        return;
+
+    for (i = 0; i < count; i++) {
+        if (mems[i])
+            clReleaseMemObject(mems[i]);
+    }
+}
+
+/* Whether ptr can be wrapped with CL_MEM_USE_HOST_PTR without the driver
+ * making a copy of its own */
+static int is_zero_copy_ptr(opencl_plugin plugin, const void *ptr)
+{
+    return ptr && ((size_t)ptr & (plugin->host_ptr_alignment - 1)) == 0;
+}
+
+static int opencl_plugin_can_wrap_meshes(opencl_plugin plugin,
+                                         cl_int mesh_data_count,
+                                         const mesh_data *mesh_data_list)
+{
+    cl_int i;
+
+    for (i = 0; i < mesh_data_count; i++) {
+        const mesh_data *mesh_data = &mesh_data_list[i];
+
+        if (mesh_data->num_vertices <= 0 || mesh_data->num_triangles <= 0 ||
+            !is_zero_copy_ptr(plugin, mesh_data->vertices) ||
+            !is_zero_copy_ptr(plugin, mesh_data->triangles))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Wrap the meshes' own arrays as buffers, vertices and triangles of mesh i
+ * in mesh_buffers[2 * i] and [2 * i + 1] */
+static cl_int opencl_plugin_wrap_meshes(opencl_plugin plugin,
+                                        cl_int mesh_data_count,
+                                        const mesh_data *mesh_data_list,
+                                        cl_mem *mesh_buffers)
+{
+    cl_int err;
+    cl_int i;
+
+    for (i = 0; i < mesh_data_count; i++) {
+        const mesh_data *mesh_data = &mesh_data_list[i];
+
+        mesh_buffers[2 * i] = clCreateBuffer(
+            plugin->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+            sizeof(float) * 3 * mesh_data->num_vertices, mesh_data->vertices,
+            &err);
+        CHECK_CL_ERROR(err);
+
+        mesh_buffers[2 * i + 1] = clCreateBuffer(
+            plugin->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+            sizeof(cl_int) * 3 * mesh_data->num_triangles, mesh_data->triangles,
+            &err);
+        CHECK_CL_ERROR(err);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Zero-copy counterpart of opencl_plugin_enqueue_output() for dense output
+ * that the kernels wrote straight into: mapping the caller's grid makes it
+ * coherent, rather than reading it back. *event_out (if not NULL) completes
+ * once the grid is up to date. */
+static cl_int opencl_plugin_enqueue_map_output(opencl_plugin plugin,
+                                               cl_mem grid_buffer,
+                                               size_t size,
+                                               cl_event *event_out)
+{
+    cl_int err;
+    void *ptr;
+    cl_event map_event = NULL;
+
+    ptr = clEnqueueMapBuffer(plugin->queue, grid_buffer, CL_FALSE, CL_MAP_READ,
+                             0, size, 0, NULL, &map_event, &err);
+    CHECK_CL_ERROR(err);
+    opencl_plugin_profile_event(plugin, PROFILE_READBACK, map_event, 0);
+
+    /* Nothing writes the grid after this, so it can be unmapped right away
+     * and the buffer go with the job's commands */
+    err = clEnqueueUnmapMemObject(plugin->queue, grid_buffer, ptr, 0, NULL,
+                                  event_out);
+    CHECK_CL_ERROR(err);
+    clReleaseEvent(map_event);
+    map_event = NULL;
+
+    err = clFlush(plugin->queue);
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    if (map_event)
+        clReleaseEvent(map_event);
+    return -1;
+}
+
+/* Enqueue a full voxelization job (fill, upload, kernels, readback) of the
+ * given meshes without blocking, see opencl_plugin_enqueue_launches() and
+ * opencl_plugin_enqueue_output(). The mesh data and output must stay valid
+ * until *event_out completes. */
+static cl_int opencl_plugin_enqueue_voxelize(opencl_plugin plugin,
+                                             const voxel_grid_params *grid,
+                                             cl_int mesh_data_count,
+                                             mesh_data *mesh_data_list,
+                                             const voxel_output *output,
+                                             cl_event *event_out)
+{
+    cl_int err;
+    cl_int i;
+    cl_int num_launches;
+    size_t large_local_work_size;
+    mesh_launch *launches = NULL;
+    size_t num_voxels;
+    cl_mem grid_mem;
+    cl_mem zero_copy_grid = NULL;
+    cl_mem *mesh_buffers = NULL;
+    /* Culling would drop triangles below the grid, which still count
+     * towards the parity of the voxels above them (along z in solid mode,
+     * along the fill axis for the parity fill) */
+    cl_int binning = plugin->binning_enabled &&
+        plugin->voxelize_mode != OPENCL_PLUGIN_VOXELIZE_SOLID &&
+        plugin->solid_fill != OPENCL_PLUGIN_SOLID_FILL_PARITY;
+
+    assert(plugin != NULL);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+
+    if (opencl_plugin_check_output(plugin, output))
+        return -1;
+
+    if (binning && !plugin->bin_triangles_kernel) {
+        ERROR("Binning requires grid_ops.cl", 0);
+        return -1;
+    }
+    if (plugin->batching_enabled && !plugin->batch_triangles_kernel) {
+        ERROR("Batching requires grid_ops.cl", 0);
+        return -1;
+    }
+
+    opencl_plugin_profile_begin(plugin, count_triangles(mesh_data_count,
+                                                        mesh_data_list));
+
+    launches = malloc(sizeof(*launches) * (mesh_data_count > 2 ? mesh_data_count : 2));
+    CHECK_ALLOCATION(launches);
+
+    /* Zero-copy: the kernels write straight into the caller's grid, and
+     * read the meshes in place if they get a launch each. The solid mode
+     * kernel needs the grid in whole words. */
+    num_voxels = (size_t)grid->x_cell_length * grid->y_cell_length *
+        grid->z_cell_length;
+    if (plugin->zero_copy && output->format == VOXEL_OUTPUT_DENSE &&
+        output->row_pitch == 0 && num_voxels > 0 && is_zero_copy_ptr(plugin, output->dst) &&
+        (plugin->voxelize_mode != OPENCL_PLUGIN_VOXELIZE_SOLID ||
+         num_voxels % 4 == 0)) {
+        zero_copy_grid = clCreateBuffer(plugin->context,
+                                        CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                        num_voxels, output->dst, &err);
+        CHECK_CL_ERROR(err);
+
+        if (enqueue_zero_buffer(plugin->queue, zero_copy_grid, 0, num_voxels,
+                                0, NULL,
+                                opencl_plugin_profile(plugin, PROFILE_FILL, 0),
+                                &err))
+            goto error;
+    } else {
+        voxel_box box;
+
+        voxel_box_init(&box);
+        voxel_box_add_meshes(plugin, &box, grid, mesh_data_count, mesh_data_list);
+        if (opencl_plugin_enqueue_clear_grid(plugin, &plugin->voxel_grid_buffer,
+                                             grid, &box))
+            goto error;
+    }
+    grid_mem = zero_copy_grid ? zero_copy_grid : plugin->voxel_grid_buffer.mem;
+
+    if (plugin->zero_copy && !binning && !plugin->batching_enabled &&
+        opencl_plugin_can_wrap_meshes(plugin, mesh_data_count, mesh_data_list)) {
+        mesh_buffers = calloc(2 * (size_t)mesh_data_count + 1,
+                              sizeof(*mesh_buffers));
+        CHECK_ALLOCATION(mesh_buffers);
+
+        if (opencl_plugin_wrap_meshes(plugin, mesh_data_count, mesh_data_list,
+                                      mesh_buffers))
+            goto error;
+    } else if (opencl_plugin_init_mesh_buffers(plugin, mesh_data_count,
+                                               mesh_data_list)) {
+        /* (Re-)allocate buffers for mesh data */
+        goto error;
+    }
+
+    if (binning) {
+        cl_int bin_counts[2];
+
+        if (opencl_plugin_bin_triangles(plugin, grid, mesh_data_count,
+                                        mesh_data_list, bin_counts))
+            goto error;
+
+        err = clGetKernelWorkGroupInfo(
+            opencl_plugin_voxelize_kernel(plugin), plugin->selected_device,
+            CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+            sizeof(large_local_work_size), &large_local_work_size, NULL);
+        CHECK_CL_ERROR(err);
+
+        /* Binned indices are absolute. Large triangles get small work-groups,
+         * so one of them only holds up a warp's worth of others. */
+        num_launches = 0;
+        if (bin_counts[0] > 0) {
+            init_mesh_launch(&launches[num_launches++], plugin->vertex_buffer.mem,
+                             plugin->small_triangle_buffer.mem, bin_counts[0],
+                             0, 0);
+        }
+        if (bin_counts[1] > 0) {
+            init_mesh_launch(&launches[num_launches], plugin->vertex_buffer.mem,
+                             plugin->large_triangle_buffer.mem, bin_counts[1],
+                             0, 0);
+            launches[num_launches++].local_work_size = large_local_work_size;
+        }
+    } else if (plugin->batching_enabled) {
+        cl_int num_batched;
+
+        if (opencl_plugin_enqueue_batch_triangles(plugin, mesh_data_count,
+                                                  mesh_data_list, &num_batched))
+            goto error;
+
+        num_launches = 0;
+        if (num_batched > 0) {
+            init_mesh_launch(&launches[num_launches++], plugin->vertex_buffer.mem,
+                             plugin->batched_triangle_buffer.mem, num_batched,
+                             0, 0);
+        }
+    } else if (mesh_buffers) {
+        for (i = 0; i < mesh_data_count; i++) {
+            init_mesh_launch(&launches[i], mesh_buffers[2 * i],
+                             mesh_buffers[2 * i + 1],
+                             mesh_data_list[i].num_triangles, 0, 0);
+        }
+        num_launches = mesh_data_count;
+    } else {
+        for (i = 0; i < mesh_data_count; i++) {
+            init_mesh_launch(&launches[i], plugin->vertex_buffer.mem,
+                             plugin->triangle_buffer.mem,
+                             mesh_data_list[i].num_triangles,
+                             mesh_data_list[i].vertex_buffer_base_idx,
+                             mesh_data_list[i].triangle_buffer_base_idx);
+        }
+        num_launches = mesh_data_count;
+    }
+
+    if (opencl_plugin_enqueue_launches(plugin, grid_mem, grid, num_launches,
+                                       launches))
+        goto error;
+
+    if (opencl_plugin_enqueue_solid_fill(plugin, grid_mem, grid, num_launches,
+                                         launches))
+        goto error;
+
+    if (zero_copy_grid) {
+        if (opencl_plugin_enqueue_map_output(plugin, zero_copy_grid, num_voxels,
+                                             event_out))
+            goto error;
+    } else if (opencl_plugin_enqueue_output(plugin, grid, output, event_out)) {
+        goto error;
+    }
+
+    /* Enqueued commands keep the wrapped buffers alive until they're done */
+    release_mem_objects(2 * mesh_data_count, mesh_buffers);
+    free(mesh_buffers);
+    if (zero_copy_grid)
+        clReleaseMemObject(zero_copy_grid);
+    free(launches);
+    return 0;
+error:
+    /* Don't leave anything in flight that may still touch caller memory */
+    opencl_plugin_drain(plugin);
+    release_mem_objects(2 * mesh_data_count, mesh_buffers);
+    free(mesh_buffers);
+    if (zero_copy_grid)
+        clReleaseMemObject(zero_copy_grid);
+    free(launches);
+    return -1;
+}
+
+/* Like opencl_plugin_enqueue_voxelize(), but labelling each voxel with
+ * the part_idx of the meshes overlapping it, see
+ * opencl_plugin_voxelize_meshes_labels(). The label kernel keeps the
+ * largest key per voxel in plugin->label_key_buffer, 0 being empty, so
+ * keys are ordered by the conflict rule. finish_labels turns them into
+ * labels of label_bits bits in plugin->label_buffer. */
+static cl_int opencl_plugin_enqueue_voxelize_labels(opencl_plugin plugin,
+                                                    const voxel_grid_params *grid,
+                                                    cl_int mesh_data_count,
+                                                    mesh_data *mesh_data_list,
+                                                    cl_int label_bits,
+                                                    cl_int rule,
+                                                    void *labels_out,
+                                                    cl_event *event_out)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i;
+    cl_uint zero = 0;
+    size_t total_voxels;
+    cl_uint num_voxels;
+    size_t label_size = (size_t)label_bits / 8;
+    cl_int min_rule = rule == OPENCL_PLUGIN_LABEL_MIN;
+    mesh_launch *launches = NULL;
+
+    assert(plugin != NULL);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+    assert(event_out != NULL);
+
+    /* Checked against INT_MAX by the caller */
+    total_voxels = (size_t)grid->x_cell_length * grid->y_cell_length *
+        grid->z_cell_length;
+    assert(total_voxels <= (size_t)INT_MAX);
+    num_voxels = (cl_uint)total_voxels;
+
+    opencl_plugin_profile_begin(plugin, count_triangles(mesh_data_count,
+                                                        mesh_data_list));
+
+    launches = malloc(sizeof(*launches) * (mesh_data_count > 0 ? mesh_data_count : 1));
+    CHECK_ALLOCATION(launches);
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->label_key_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(cl_uint) * (size_t)num_voxels))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->label_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              label_size * num_voxels))
+        goto error;
+
+    if (num_voxels > 0) {
+        err = clEnqueueFillBuffer(plugin->queue, plugin->label_key_buffer.mem,
+                                  &zero, sizeof(zero), 0,
+                                  sizeof(cl_uint) * (size_t)num_voxels, 0, NULL,
+                                  opencl_plugin_profile(plugin, PROFILE_FILL, 0));
+        CHECK_CL_ERROR(err);
+    }
+
+    if (opencl_plugin_init_mesh_buffers(plugin, mesh_data_count, mesh_data_list))
+        goto error;
+
+    for (i = 0; i < mesh_data_count; i++) {
+        cl_uint part = (cl_uint)mesh_data_list[i].part_idx;
+
+        init_mesh_launch(&launches[i], plugin->vertex_buffer.mem,
+                         plugin->triangle_buffer.mem,
+                         mesh_data_list[i].num_triangles,
+                         mesh_data_list[i].vertex_buffer_base_idx,
+                         mesh_data_list[i].triangle_buffer_base_idx);
+        launches[i].label_key = min_rule ? UINT_MAX - part : part + 1;
+    }
+
+    if (opencl_plugin_enqueue_kernel_launches(plugin,
+                                              plugin->voxelize_labels_kernel,
+                                              plugin->label_key_buffer.mem,
+                                              grid, mesh_data_count, launches))
+        goto error;
+
+    err |= clSetKernelArg(plugin->finish_labels_kernel, 0, sizeof(cl_mem), &plugin->label_key_buffer.mem);
+    err |= clSetKernelArg(plugin->finish_labels_kernel, 1, sizeof(cl_mem), &plugin->label_buffer.mem);
+    err |= clSetKernelArg(plugin->finish_labels_kernel, 2, sizeof(cl_uint), &num_voxels);
+    err |= clSetKernelArg(plugin->finish_labels_kernel, 3, sizeof(cl_int), &min_rule);
+    err |= clSetKernelArg(plugin->finish_labels_kernel, 4, sizeof(cl_int), &label_bits);
+    CHECK_CL_ERROR(err);
+
+    if (num_voxels > 0) {
+        size_t global_work_size = num_voxels;
+
+        err = clEnqueueNDRangeKernel(plugin->queue, plugin->finish_labels_kernel,
+                                     1, NULL, &global_work_size, NULL, 0, NULL,
+                                     opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+        CHECK_CL_ERROR(err);
+    }
+
+    err = enqueue_read_buffer(plugin->queue, plugin->label_buffer.mem,
+                              label_size * num_voxels, labels_out, event_out);
+    CHECK_CL_ERROR(err);
+    opencl_plugin_profile_event(plugin, PROFILE_READBACK, *event_out,
+                                label_size * num_voxels);
+
+    err = clFlush(plugin->queue);
+    CHECK_CL_ERROR(err);
+
+    free(launches);
+    return 0;
+error:
+    opencl_plugin_drain(plugin);
+    free(launches);
+    return -1;
+}
+
+/* Jobs voxelized in z slabs fill each slab on its own. The parity fill
+ * still works (crossings below a slab are counted in its first layer, and
+ * lines along x or y stay within it), but the flood fill would take any
+ * interior cut by a slab boundary for exterior. */
+static int opencl_plugin_check_slab_fill(opencl_plugin plugin,
+                                         const char *job_type)
+{
+    if (plugin->solid_fill == OPENCL_PLUGIN_SOLID_FILL_FLOOD &&
+        plugin->voxelize_mode != OPENCL_PLUGIN_VOXELIZE_SOLID) {
+        ERROR("The flood fill isn't supported by %s jobs", job_type);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Number of z slices per slab when voxelizing a grid with the given slice
+ * size in slabs: a slab must fit in a single device buffer and be
+ * indexable with the cl_int kernel arguments */
+static cl_long opencl_plugin_max_slab_depth(opencl_plugin plugin,
+                                            cl_long slice_voxels)
+{
+    cl_ulong max_slab_voxels = plugin->max_mem_alloc_size;
+
+    if (max_slab_voxels > (cl_ulong)INT_MAX)
+        max_slab_voxels = (cl_ulong)INT_MAX;
+    /* Leave room for rounding up to whole words */
+    max_slab_voxels &= ~(cl_ulong)3;
+
+    return (cl_long)(max_slab_voxels / (cl_ulong)slice_voxels);
+}
+
+/*
+ * Like opencl_plugin_enqueue_voxelize() with dense output, for grids that
+ * may have more than INT_MAX voxels. The grid is processed as a sequence of
+ * z slabs through the same pooled grid buffer, each of which is a normal
+ * cl_int indexed job read straight into its part of voxel_grid_out. The
+ * meshes are only uploaded once. This relies on the voxelize kernel
+ * discarding voxels outside of the grid it is given, as it must anyway for
+ * triangles that leave the grid.
+ */
+static cl_int opencl_plugin_enqueue_voxelize64(opencl_plugin plugin,
+                                               float inv_element_size,
+                                               float corner_x,
+                                               float corner_y,
+                                               float corner_z,
+                                               cl_long x_cell_length,
+                                               cl_long y_cell_length,
+                                               cl_long z_cell_length,
+                                               cl_int mesh_data_count,
+                                               mesh_data *mesh_data_list,
+                                               cl_uchar *voxel_grid_out,
+                                               cl_event *event_out)
+{
+    cl_int i;
+    mesh_launch *launches = NULL;
+    cl_long slice_voxels, slab_depth, z0;
+    voxel_grid_params slab;
+    voxel_box box;
+    voxel_output output;
+    cl_event event = NULL;
+
+    assert(plugin != NULL);
+    assert(inv_element_size > 0);
+    assert(x_cell_length >= 0);
+    assert(y_cell_length >= 0);
+    assert(z_cell_length >= 0);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+    assert(event_out != NULL);
+
+    if (opencl_plugin_check_device(plugin))
+        return -1;
+    if (opencl_plugin_check_slab_fill(plugin, "64-bit"))
+        return -1;
+
+    slice_voxels = x_cell_length * y_cell_length;
+    if (x_cell_length > INT_MAX || y_cell_length > INT_MAX ||
+        z_cell_length > INT_MAX) {
+        ERROR("Grid of %ldx%ldx%ld voxels is too large", (long)x_cell_length,
+              (long)y_cell_length, (long)z_cell_length);
+        return -1;
+    }
+    if (slice_voxels > 0 &&
+        (cl_ulong)z_cell_length > (cl_ulong)((size_t)-1) / (cl_ulong)slice_voxels) {
+        ERROR("Grid of %ldx%ldx%ld voxels doesn't fit in the address space",
+              (long)x_cell_length, (long)y_cell_length, (long)z_cell_length);
+        return -1;
+    }
+
+    /* Degenerate grids have no voxels, any single slab will do */
+    slab_depth = slice_voxels > 0 ?
+        opencl_plugin_max_slab_depth(plugin, slice_voxels) : z_cell_length;
+    if (slab_depth < 1 && z_cell_length > 0) {
+        ERROR("A single %ldx%ld slice doesn't fit in a device buffer",
+              (long)x_cell_length, (long)y_cell_length);
+        return -1;
+    }
+    if (slab_depth > z_cell_length)
+        slab_depth = z_cell_length;
+
+    opencl_plugin_profile_begin(plugin, count_triangles(mesh_data_count,
+                                                        mesh_data_list));
+
+    launches = malloc(sizeof(*launches) * (mesh_data_count > 0 ? mesh_data_count : 1));
+    CHECK_ALLOCATION(launches);
+
+    if (opencl_plugin_init_mesh_buffers(plugin, mesh_data_count, mesh_data_list))
+        goto error;
+
+    for (i = 0; i < mesh_data_count; i++) {
+        init_mesh_launch(&launches[i], plugin->vertex_buffer.mem,
+                         plugin->triangle_buffer.mem,
+                         mesh_data_list[i].num_triangles,
+                         mesh_data_list[i].vertex_buffer_base_idx,
+                         mesh_data_list[i].triangle_buffer_base_idx);
+    }
+
+    z0 = 0;
+    do {
+        cl_long depth = z_cell_length - z0 < slab_depth ?
+            z_cell_length - z0 : slab_depth;
+
+        init_voxel_grid_params(&slab, inv_element_size, corner_x, corner_y,
+                               corner_z + (float)z0 / inv_element_size,
+                               (cl_int)x_cell_length, (cl_int)y_cell_length,
+                               (cl_int)depth);
+        init_voxel_output(&output, VOXEL_OUTPUT_DENSE,
+                          voxel_grid_out + (size_t)z0 * (size_t)slice_voxels);
+
+        voxel_box_init(&box);
+        voxel_box_add_meshes(plugin, &box, &slab, mesh_data_count, mesh_data_list);
+        if (opencl_plugin_enqueue_clear_grid(plugin, &plugin->voxel_grid_buffer,
+                                             &slab, &box))
+            goto error;
+
+        if (opencl_plugin_enqueue_launches(plugin, plugin->voxel_grid_buffer.mem,
+                                           &slab, mesh_data_count,
+                                           launches))
+            goto error;
+
+        if (opencl_plugin_enqueue_solid_fill(plugin,
+                                             plugin->voxel_grid_buffer.mem,
+                                             &slab, mesh_data_count, launches))
+            goto error;
+
+        /* Only the last readback's event is needed, the queue is in-order */
+        if (event) {
+            clReleaseEvent(event);
+            event = NULL;
+        }
+        if (opencl_plugin_enqueue_output(plugin, &slab, &output, &event))
+            goto error;
+
+        z0 += depth;
+    } while (z0 < z_cell_length);
+
+    free(launches);
+    *event_out = event;
+    return 0;
+error:
+    opencl_plugin_drain(plugin);
+    if (event)
+        clReleaseEvent(event);
+    free(launches);
+    return -1;
+}
+
+/* Upload a registered mesh if it changed since it was last uploaded */
+static cl_int opencl_plugin_mesh_sync(opencl_plugin_mesh mesh)
+{
+    cl_int err;
+    opencl_plugin plugin = mesh->plugin;
+    mesh_data *data = &mesh->data;
+
+    if (mesh->uploaded_generation == mesh->generation)
+        return 0;
+
+    if (device_buffer_reserve(&plugin->pool, &mesh->vertex_buffer,
+                              plugin->context, CL_MEM_READ_ONLY,
+                              sizeof(float) * 3 * (size_t)data->num_vertices))
+        goto error;
+
+    if (device_buffer_reserve(&plugin->pool, &mesh->triangle_buffer,
+                              plugin->context, CL_MEM_READ_ONLY,
+                              sizeof(cl_int) * 3 * (size_t)data->num_triangles))
+        goto error;
+
+    /* Any job still using the previous contents was enqueued on
+     * plugin->queue before this, and is joined before its readback. Empty
+     * writes aren't allowed. */
+    if (data->num_vertices > 0) {
+        err = clEnqueueWriteBuffer(
+            plugin->queue, mesh->vertex_buffer.mem, CL_FALSE, 0,
+            sizeof(float) * 3 * data->num_vertices, data->vertices,
+            0, NULL,
+            opencl_plugin_profile(plugin, PROFILE_UPLOAD,
+                                  sizeof(float) * 3 * data->num_vertices));
+        CHECK_CL_ERROR(err);
+    }
+
+    if (data->num_triangles > 0) {
+        err = clEnqueueWriteBuffer(
+            plugin->queue, mesh->triangle_buffer.mem, CL_FALSE, 0,
+            sizeof(cl_int) * 3 * data->num_triangles, data->triangles,
+            0, NULL,
+            opencl_plugin_profile(plugin, PROFILE_UPLOAD,
+                                  sizeof(cl_int) * 3 * data->num_triangles));
+        CHECK_CL_ERROR(err);
+    }
+
+    mesh->uploaded_generation = mesh->generation;
+    return 0;
+error:
+    return -1;
+}
+
+/* Element i of a row-major 3x4 transform m applied to p */
+static float transform_point(const float *m, cl_int i, const float *p)
+{
+    return m[4 * i] * p[0] + m[4 * i + 1] * p[1] + m[4 * i + 2] * p[2] +
+        m[4 * i + 3];
+}
+
+/* Like voxel_box_add_mesh() for a copy of mesh transformed by the row-major
+ * 3x4 matrix m, using the transformed box around the mesh's bounds */
+static void voxel_box_add_instance(opencl_plugin plugin,
+                                   voxel_box *box,
+                                   const voxel_grid_params *grid,
+                                   const mesh_data *mesh,
+                                   const float *m)
+{
+    mesh_data instance = *mesh;
+    float centre[3], half[3], c[3], h[3];
+    cl_int i;
+
+    if (!mesh_has_bounds(plugin, mesh)) {
+        voxel_box_add_mesh(plugin, box, grid, mesh);
+        return;
+    }
+
+    centre[0] = 0.5f * (mesh->bounds_min_x + mesh->bounds_max_x);
+    centre[1] = 0.5f * (mesh->bounds_min_y + mesh->bounds_max_y);
+    centre[2] = 0.5f * (mesh->bounds_min_z + mesh->bounds_max_z);
+    half[0] = 0.5f * (mesh->bounds_max_x - mesh->bounds_min_x);
+    half[1] = 0.5f * (mesh->bounds_max_y - mesh->bounds_min_y);
+    half[2] = 0.5f * (mesh->bounds_max_z - mesh->bounds_min_z);
+
+    for (i = 0; i < 3; i++) {
+        c[i] = transform_point(m, i, centre);
+        h[i] = fabsf(m[4 * i]) * half[0] + fabsf(m[4 * i + 1]) * half[1] +
+            fabsf(m[4 * i + 2]) * half[2];
+    }
+
+    instance.bounds_min_x = c[0] - h[0];
+    instance.bounds_min_y = c[1] - h[1];
+    instance.bounds_min_z = c[2] - h[2];
+    instance.bounds_max_x = c[0] + h[0];
+    instance.bounds_max_y = c[1] + h[1];
+    instance.bounds_max_z = c[2] + h[2];
+    voxel_box_add_mesh(plugin, box, grid, &instance);
+}
+
+/* Upload the transforms of all instances and enqueue transforming the
+ * (synced) meshes into plugin->instance_vertex_buffer on plugin->queue,
+ * instance j of mesh i getting num_vertices vertices at
+ * vertex_bases_out[i] + j * num_vertices */
+static cl_int opencl_plugin_enqueue_transform_instances(opencl_plugin plugin,
+                                                        cl_int mesh_count,
+                                                        opencl_plugin_mesh *meshes,
+                                                        const cl_int *instance_counts,
+                                                        const float *transforms,
+                                                        cl_uint *vertex_bases_out)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i;
+    size_t total_instances = 0, total_vertices = 0;
+    cl_uint transform_base = 0;
+
+    if (!plugin->transform_vertices_kernel) {
+        ERROR("Instancing requires grid_ops.cl", 0);
+        return -1;
+    }
+
+    for (i = 0; i < mesh_count; i++) {
+        vertex_bases_out[i] = (cl_uint)total_vertices;
+        total_instances += instance_counts[i];
+        total_vertices += (size_t)instance_counts[i] * meshes[i]->data.num_vertices;
+    }
+    if (total_vertices > (size_t)UINT_MAX) {
+        ERROR("Too many instanced vertices (%lu)", (unsigned long)total_vertices);
+        return -1;
+    }
+
+    if (device_buffer_reserve(&plugin->pool, &plugin->instance_transform_buffer,
+                              plugin->context, CL_MEM_READ_ONLY,
+                              sizeof(float) * 12 * total_instances))
+        goto error;
+    if (device_buffer_reserve(&plugin->pool, &plugin->instance_vertex_buffer,
+                              plugin->context, CL_MEM_READ_WRITE,
+                              sizeof(float) * 3 * total_vertices))
+        goto error;
+
+    if (total_instances > 0) {
+        err = clEnqueueWriteBuffer(
+            plugin->queue, plugin->instance_transform_buffer.mem, CL_FALSE, 0,
+            sizeof(float) * 12 * total_instances, transforms, 0, NULL,
+            opencl_plugin_profile(plugin, PROFILE_UPLOAD,
+                                  sizeof(float) * 12 * total_instances));
+        CHECK_CL_ERROR(err);
+    }
+
+    for (i = 0; i < mesh_count; i++) {
+        opencl_plugin_mesh mesh = meshes[i];
+        size_t global_work_size[2];
+
+        global_work_size[0] = mesh->data.num_vertices;
+        global_work_size[1] = instance_counts[i];
+
+        if (global_work_size[0] > 0 && global_work_size[1] > 0) {
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 0, sizeof(cl_mem), &mesh->vertex_buffer.mem);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 1, sizeof(cl_int), &mesh->data.num_vertices);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 2, sizeof(cl_mem), &plugin->instance_transform_buffer.mem);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 3, sizeof(cl_uint), &transform_base);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 4, sizeof(cl_int), &instance_counts[i]);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 5, sizeof(cl_mem), &plugin->instance_vertex_buffer.mem);
+            err |= clSetKernelArg(plugin->transform_vertices_kernel, 6, sizeof(cl_uint), &vertex_bases_out[i]);
+            CHECK_CL_ERROR(err);
+
+            err = clEnqueueNDRangeKernel(plugin->queue,
+                                         plugin->transform_vertices_kernel, 2,
+                                         NULL, global_work_size, NULL, 0, NULL,
+                                         opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+            CHECK_CL_ERROR(err);
+        }
+
+        transform_base += instance_counts[i];
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* Like opencl_plugin_enqueue_voxelize(), but only uploads registered meshes
+ * that are dirty. With transforms (NULL for none), mesh i is voxelized
+ * instance_counts[i] times instead, each with the next row-major 3x4
+ * matrix, applied on the device. */
+static cl_int opencl_plugin_enqueue_voxelize_registered(opencl_plugin plugin,
+                                                        const voxel_grid_params *grid,
+                                                        cl_int mesh_count,
+                                                        opencl_plugin_mesh *meshes,
+                                                        const cl_int *instance_counts,
+                                                        const float *transforms,
+                                                        const voxel_output *output,
+                                                        cl_event *event_out)
+{
+    cl_int i, j;
+    cl_int num_launches = mesh_count;
+    mesh_launch *launches = NULL;
+    cl_uint *vertex_bases = NULL;
+    const float *m;
+    voxel_box box;
+
+    assert(plugin != NULL);
+    assert(mesh_count >= 0);
+    assert(meshes != NULL);
+    assert(!transforms || instance_counts);
+
+    if (opencl_plugin_check_output(plugin, output))
+        return -1;
+
+    if (transforms) {
+        num_launches = 0;
+        for (i = 0; i < mesh_count; i++) {
+            if (instance_counts[i] < 0 ||
+                instance_counts[i] > INT_MAX - num_launches) {
+                ERROR("Invalid instance count %d", instance_counts[i]);
+                return -1;
+            }
+            num_launches += instance_counts[i];
+        }
+    }
+
+    opencl_plugin_profile_begin(plugin, 0);
+    for (i = 0; i < mesh_count; i++) {
+        plugin->profile_num_triangles += (cl_ulong)meshes[i]->data.num_triangles *
+            (transforms ? instance_counts[i] : 1);
+    }
+
+    launches = malloc(sizeof(*launches) * (num_launches > 0 ? num_launches : 1));
+    CHECK_ALLOCATION(launches);
+
+    voxel_box_init(&box);
+    for (i = 0, m = transforms; i < mesh_count; i++) {
+        if (!transforms) {
+            voxel_box_add_mesh(plugin, &box, grid, &meshes[i]->data);
+            continue;
+        }
+        for (j = 0; j < instance_counts[i]; j++, m += 12)
+            voxel_box_add_instance(plugin, &box, grid, &meshes[i]->data, m);
+    }
+    if (opencl_plugin_enqueue_clear_grid(plugin, &plugin->voxel_grid_buffer,
+                                         grid, &box))
+        goto error;
+
+    for (i = 0; i < mesh_count; i++) {
+        opencl_plugin_mesh mesh = meshes[i];
+
+        assert(mesh->plugin == plugin);
+
+        if (opencl_plugin_mesh_sync(mesh))
+            goto error;
+
+        if (!transforms) {
+            init_mesh_launch(&launches[i], mesh->vertex_buffer.mem,
+                             mesh->triangle_buffer.mem, mesh->data.num_triangles,
+                             0, 0);
+        }
+    }
+
+    if (transforms) {
+        vertex_bases = malloc(sizeof(*vertex_bases) * (mesh_count > 0 ? mesh_count : 1));
+        CHECK_ALLOCATION(vertex_bases);
+
+        if (opencl_plugin_enqueue_transform_instances(plugin, mesh_count, meshes,
+                                                      instance_counts, transforms,
+                                                      vertex_bases))
+            goto error;
+
+        /* Every instance shares its mesh's triangles */
+        num_launches = 0;
+        for (i = 0; i < mesh_count; i++) {
+            for (j = 0; j < instance_counts[i]; j++) {
+                init_mesh_launch(&launches[num_launches++],
+                                 plugin->instance_vertex_buffer.mem,
+                                 meshes[i]->triangle_buffer.mem,
+                                 meshes[i]->data.num_triangles,
+                                 vertex_bases[i] + (cl_uint)j * meshes[i]->data.num_vertices,
+                                 0);
+            }
+        }
+    }
+
+    if (opencl_plugin_enqueue_launches(plugin, plugin->voxel_grid_buffer.mem,
+                                       grid, num_launches, launches))
+        goto error;
+
+    if (opencl_plugin_enqueue_solid_fill(plugin, plugin->voxel_grid_buffer.mem,
+                                         grid, num_launches, launches))
+        goto error;
+
+    if (opencl_plugin_enqueue_output(plugin, grid, output, event_out))
+        goto error;
+
+    free(vertex_bases);
+    free(launches);
+    return 0;
+error:
+    opencl_plugin_drain(plugin);
+    free(vertex_bases);
+    free(launches);
+    return -1;
+}
+
+/* Either block until the job behind event is done (job_out == NULL), or
+ * hand the event over to a new job handle. The event is consumed either
+ * way. */
+static cl_int opencl_plugin_complete_job(opencl_plugin plugin,
+                                         cl_event event,
+                                         opencl_plugin_job *job_out)
+{
+    cl_int err;
+    opencl_plugin_job job;
+
+    /* Nothing to wait for if the job already ran on the CPU */
+    if (!job_out && !event)
+        return 0;
+
+    if (!job_out) {
+        err = clWaitForEvents(1, &event);
+        clReleaseEvent(event);
+        CHECK_CL_ERROR(err);
+        return 0;
+    }
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        /* Can't return a handle, so we have to wait here */
+        if (event) {
+            clWaitForEvents(1, &event);
+            clReleaseEvent(event);
+        }
+        CHECK_ALLOCATION(job);
+    }
+
+    job->plugin = plugin;
+    job->done_event = event;
+
+    *job_out = job;
+    return 0;
+error:
+    return -1;
+}
+
+static cl_int opencl_plugin_submit_meshes(opencl_plugin plugin,
+                                          const voxel_grid_params *grid,
+                                          cl_int mesh_data_count,
+                                          mesh_data *mesh_data_list,
+                                          const voxel_output *output,
+                                          opencl_plugin_job *job_out)
+{
+    cl_event event = NULL;
+
+    if (job_out)
+        *job_out = NULL;
+
+    /* CPU jobs are done on return, and get a job without an event */
+    if (plugin->cpu) {
+        if (opencl_plugin_cpu_voxelize(plugin, grid, mesh_data_count,
+                                       mesh_data_list, output))
+            return -1;
+    } else if (opencl_plugin_enqueue_voxelize(plugin, grid, mesh_data_count,
+                                              mesh_data_list, output, &event))
+        return -1;
+
+    return opencl_plugin_complete_job(plugin, event, job_out);
+}
+
+static cl_int opencl_plugin_submit_registered(opencl_plugin plugin,
+                                              const voxel_grid_params *grid,
+                                              cl_int mesh_count,
+                                              opencl_plugin_mesh *meshes,
+                                              const cl_int *instance_counts,
+                                              const float *transforms,
+                                              const voxel_output *output,
+                                              opencl_plugin_job *job_out)
+{
+    cl_event event;
+
+    if (job_out)
+        *job_out = NULL;
+
+    if (opencl_plugin_check_device(plugin))
+        return -1;
+
+    if (opencl_plugin_enqueue_voxelize_registered(plugin, grid, mesh_count,
+                                                  meshes, instance_counts,
+                                                  transforms, output, &event))
+        return -1;
+
+    return opencl_plugin_complete_job(plugin, event, job_out);
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes(opencl_plugin plugin,
+                                     float inv_element_size,
+                                     float corner_x,
                                      float corner_y,
                                      float corner_z,
                                      cl_int x_cell_length,
@@ -654,117 +4688,1570 @@ cl_int opencl_plugin_voxelize_meshes(opencl_plugin plugin,
                                      mesh_data *mesh_data_list,
                                      cl_uchar *voxel_grid_out)
 {
-    cl_int err = CL_SUCCESS;
+    voxel_grid_params grid;
+    voxel_output output;
+    clock_t t;
+
+    t = clock();
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_grid_out);
+
+    if (opencl_plugin_submit_meshes(plugin, &grid, mesh_data_count,
+                                    mesh_data_list, &output, NULL))
+        goto error;
+
+    t = clock() - t;
+
+    TRACE("Clock: %f", ((float)t * 1000.0f) / CLOCKS_PER_SEC);
+    return 0;
+error:
+    return -1;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_async(opencl_plugin plugin,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_int x_cell_length,
+                                           cl_int y_cell_length,
+                                           cl_int z_cell_length,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           cl_uchar *voxel_grid_out,
+                                           opencl_plugin_job *job_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    assert(job_out != NULL);
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_grid_out);
+
+    return opencl_plugin_submit_meshes(plugin, &grid, mesh_data_count,
+                                       mesh_data_list, &output, job_out);
+}
+
+/*
+ * Voxelize only the box of region_*_length voxels at region_x, region_y,
+ * region_z of the given grid, e.g. around a part that was edited. Meshes
+ * whose bounds miss the box are skipped, the rest are culled per triangle
+ * as usual. The box is written to voxel_region_out with the given pitches
+ * in bytes (0 for tightly packed), so it can be e.g. the box's place in a
+ * full grid. Voxels match those of the full grid up to the rounding of the
+ * box's corner. Solid fill only sees the box, so it needs the shells to be
+ * inside it.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_region(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int region_x,
+                                            cl_int region_y,
+                                            cl_int region_z,
+                                            cl_int region_x_length,
+                                            cl_int region_y_length,
+                                            cl_int region_z_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uchar *voxel_region_out,
+                                            cl_int row_pitch,
+                                            cl_int slice_pitch)
+{
+    voxel_grid_params region, cull;
+    voxel_output output;
+    mesh_data *meshes = NULL;
+    cl_int i, num_meshes = 0;
+    cl_int dropped_vertices = 0, dropped_triangles = 0;
+    cl_long min_slice_pitch;
+    cl_int ret;
+
+    assert(plugin != NULL);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+
+    if (region_x < 0 || region_y < 0 || region_z < 0 ||
+        region_x_length < 0 || region_y_length < 0 || region_z_length < 0 ||
+        region_x_length > x_cell_length - region_x ||
+        region_y_length > y_cell_length - region_y ||
+        region_z_length > z_cell_length - region_z) {
+        ERROR("Region is outside of the %dx%dx%d grid", x_cell_length,
+              y_cell_length, z_cell_length);
+        return -1;
+    }
+    if (row_pitch == 0)
+        row_pitch = region_x_length;
+    if (row_pitch < region_x_length) {
+        ERROR("Row pitch %d is too small for the region", row_pitch);
+        return -1;
+    }
+    min_slice_pitch = (cl_long)row_pitch * region_y_length;
+    if (min_slice_pitch > INT_MAX) {
+        ERROR("Region slices of %dx%d voxels are too large", row_pitch,
+              region_y_length);
+        return -1;
+    }
+    if (slice_pitch == 0)
+        slice_pitch = (cl_int)min_slice_pitch;
+    if ((cl_long)slice_pitch < min_slice_pitch) {
+        ERROR("Slice pitch %d is too small for the region", slice_pitch);
+        return -1;
+    }
+
+    init_voxel_grid_params(&region, inv_element_size,
+                           corner_x + (float)region_x / inv_element_size,
+                           corner_y + (float)region_y / inv_element_size,
+                           corner_z + (float)region_z / inv_element_size,
+                           region_x_length, region_y_length, region_z_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_region_out);
+    if (row_pitch != region_x_length ||
+        (cl_long)slice_pitch != min_slice_pitch) {
+        output.row_pitch = (size_t)row_pitch;
+        output.slice_pitch = (size_t)slice_pitch;
+    }
+
+    /* In solid mode (and for the parity fill along its axis) everything
+     * below the box still counts towards the parity inside it */
+    cull = region;
+    if (plugin->voxelize_mode == OPENCL_PLUGIN_VOXELIZE_SOLID) {
+        cull.corner_z = corner_z;
+        cull.z_cell_length = region_z + region_z_length;
+    } else if (plugin->solid_fill == OPENCL_PLUGIN_SOLID_FILL_PARITY) {
+        switch (plugin->solid_fill_axis) {
+        case 0:
+            cull.corner_x = corner_x;
+            cull.x_cell_length = region_x + region_x_length;
+            break;
+        case 1:
+            cull.corner_y = corner_y;
+            cull.y_cell_length = region_y + region_y_length;
+            break;
+        default:
+            cull.corner_z = corner_z;
+            cull.z_cell_length = region_z + region_z_length;
+            break;
+        }
+    }
+
+    meshes = malloc(sizeof(*meshes) * (mesh_data_count > 0 ? mesh_data_count : 1));
+    CHECK_ALLOCATION(meshes);
+
+    /* The kept meshes are uploaded consecutively, so their base indices
+     * move down by what was dropped before them */
+    for (i = 0; i < mesh_data_count; i++) {
+        if (!mesh_overlaps_grid(plugin, &mesh_data_list[i], &cull)) {
+            dropped_vertices += mesh_data_list[i].num_vertices;
+            dropped_triangles += mesh_data_list[i].num_triangles;
+            continue;
+        }
+        meshes[num_meshes] = mesh_data_list[i];
+        meshes[num_meshes].vertex_buffer_base_idx -= dropped_vertices;
+        meshes[num_meshes].triangle_buffer_base_idx -= dropped_triangles;
+        num_meshes++;
+    }
+
+    ret = opencl_plugin_submit_meshes(plugin, &region, num_meshes, meshes,
+                                      &output, NULL);
+    free(meshes);
+    return ret;
+error:
+    return -1;
+}
+
+/*
+ * Like opencl_plugin_voxelize_meshes(), but each voxel holds the part_idx
+ * of the meshes overlapping it, as label_bits (16 or 32) bit labels.
+ * Where meshes of different parts overlap a voxel, rule (one of enum
+ * opencl_plugin_label_rule) picks the label. Empty voxels are all ones, so
+ * part_idx must be in [0, 65535) for 16-bit labels and non-negative for
+ * 32-bit ones. Voxels are set by the triangle/box overlap test of
+ * OPENCL_PLUGIN_VOXELIZE_CONSERVATIVE, whatever the plugin's mode, and
+ * solid fill doesn't apply. Needs grid_ops.cl.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_labels(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_int label_bits,
+                                            cl_int rule,
+                                            void *labels_out)
+{
+    voxel_grid_params grid;
+    cl_event event = NULL;
+    cl_ulong num_voxels;
+    cl_int i;
+
+    assert(plugin != NULL);
+    assert(x_cell_length >= 0);
+    assert(y_cell_length >= 0);
+    assert(z_cell_length >= 0);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+    assert(labels_out != NULL);
+
+    if (opencl_plugin_check_device(plugin))
+        return -1;
+    if (!plugin->voxelize_labels_kernel) {
+        ERROR("Label output requires grid_ops.cl", 0);
+        return -1;
+    }
+
+    /* The keys take 4 bytes a voxel in a single buffer */
+    num_voxels = (cl_ulong)x_cell_length * (cl_ulong)y_cell_length *
+        (cl_ulong)z_cell_length;
+    if (num_voxels > (cl_ulong)INT_MAX ||
+        num_voxels * sizeof(cl_uint) > plugin->max_mem_alloc_size) {
+        ERROR("Grid of %dx%dx%d voxels is too large for labels",
+              x_cell_length, y_cell_length, z_cell_length);
+        return -1;
+    }
+    if (label_bits != 16 && label_bits != 32) {
+        ERROR("Labels must be 16 or 32 bits, not %d", label_bits);
+        return -1;
+    }
+    if (rule != OPENCL_PLUGIN_LABEL_MIN && rule != OPENCL_PLUGIN_LABEL_MAX) {
+        ERROR("Unknown label rule %d", rule);
+        return -1;
+    }
+    for (i = 0; i < mesh_data_count; i++) {
+        cl_int part = mesh_data_list[i].part_idx;
+
+        if (part < 0 || (label_bits == 16 && part >= 0xffff)) {
+            ERROR("part_idx %d of mesh %d doesn't fit a %d-bit label", part,
+                  i, label_bits);
+            return -1;
+        }
+    }
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+
+    if (opencl_plugin_enqueue_voxelize_labels(plugin, &grid, mesh_data_count,
+                                              mesh_data_list, label_bits, rule,
+                                              labels_out, &event))
+        return -1;
+
+    return opencl_plugin_complete_job(plugin, event, NULL);
+}
+
+/* Enqueue reducing a grid of src_lengths voxels into one of half the size
+ * (rounded up) with op, one of enum opencl_plugin_lod_reduce */
+static cl_int opencl_plugin_enqueue_reduce_grid(opencl_plugin plugin,
+                                                cl_mem src,
+                                                const cl_int src_lengths[3],
+                                                cl_mem dst,
+                                                const cl_int dst_lengths[3],
+                                                cl_int op)
+{
+    cl_int err = CL_SUCCESS;
+    cl_kernel kernel = plugin->reduce_grid_kernel;
+    size_t global_work_size[3];
+
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &src);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_int), &src_lengths[0]);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &src_lengths[1]);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &src_lengths[2]);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &dst);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &dst_lengths[0]);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_int), &dst_lengths[1]);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_int), &dst_lengths[2]);
+    err |= clSetKernelArg(kernel, 8, sizeof(cl_int), &op);
+    CHECK_CL_ERROR(err);
+
+    global_work_size[0] = (size_t)dst_lengths[0];
+    global_work_size[1] = (size_t)dst_lengths[1];
+    global_work_size[2] = (size_t)dst_lengths[2];
+    err = clEnqueueNDRangeKernel(plugin->queue, kernel, 3, NULL,
+                                 global_work_size, NULL, 0, NULL,
+                                 opencl_plugin_profile(plugin, PROFILE_KERNEL, 0));
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+/*
+ * Voxelize the meshes once at the given (finest) resolution and build
+ * num_levels - 1 coarser levels from it on the device, each halving the
+ * previous one's lengths (rounding up) by reducing 2x2x2 voxels with op,
+ * one of enum opencl_plugin_lod_reduce. Level l is written to
+ * levels_out[l], or not read back at all if that is NULL. The meshes are
+ * uploaded once, and only the finest level is voxelized.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_lod(opencl_plugin plugin,
+                                         float inv_element_size,
+                                         float corner_x,
+                                         float corner_y,
+                                         float corner_z,
+                                         cl_int x_cell_length,
+                                         cl_int y_cell_length,
+                                         cl_int z_cell_length,
+                                         cl_int mesh_data_count,
+                                         mesh_data *mesh_data_list,
+                                         cl_int num_levels,
+                                         cl_int op,
+                                         cl_uchar **levels_out)
+{
+    cl_int err;
+    cl_int l;
+    voxel_grid_params grid;
+    voxel_output output;
+    cl_mem src;
+    cl_int src_lengths[3], dst_lengths[3];
+    size_t num_voxels;
+    cl_event event = NULL;
+
+    assert(plugin != NULL);
+    assert(levels_out != NULL);
+
+    if (opencl_plugin_check_device(plugin))
+        return -1;
+    if (num_levels < 1) {
+        ERROR("Invalid number of levels %d", num_levels);
+        return -1;
+    }
+    if (num_levels > 1 && !plugin->reduce_grid_kernel) {
+        ERROR("LOD levels require grid_ops.cl", 0);
+        return -1;
+    }
+    if (op != OPENCL_PLUGIN_LOD_OR && op != OPENCL_PLUGIN_LOD_COUNT) {
+        ERROR("Unknown LOD reduction %d", op);
+        return -1;
+    }
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_NONE, NULL);
+
+    /* Only the last event is needed, everything runs on plugin->queue */
+    if (opencl_plugin_enqueue_voxelize(plugin, &grid, mesh_data_count,
+                                       mesh_data_list, &output, &event))
+        return -1;
+
+    src = plugin->voxel_grid_buffer.mem;
+    src_lengths[0] = x_cell_length;
+    src_lengths[1] = y_cell_length;
+    src_lengths[2] = z_cell_length;
+    for (l = 0; l < num_levels; l++) {
+        device_buffer *dst = &plugin->lod_buffers[l & 1];
+
+        if (l > 0) {
+            dst_lengths[0] = (src_lengths[0] + 1) / 2;
+            dst_lengths[1] = (src_lengths[1] + 1) / 2;
+            dst_lengths[2] = (src_lengths[2] + 1) / 2;
+            num_voxels = (size_t)dst_lengths[0] * dst_lengths[1] * dst_lengths[2];
+
+            if (device_buffer_reserve(&plugin->pool, dst, plugin->context,
+                                      CL_MEM_READ_WRITE, num_voxels))
+                goto error;
+            if (num_voxels > 0 &&
+                opencl_plugin_enqueue_reduce_grid(plugin, src, src_lengths,
+                                                  dst->mem, dst_lengths, op))
+                goto error;
+
+            src = dst->mem;
+            memcpy(src_lengths, dst_lengths, sizeof(src_lengths));
+        }
+
+        if (!levels_out[l])
+            continue;
+
+        /* The queue is in-order, so the buffer isn't reused for the level
+         * after next until this is done */
+        clReleaseEvent(event);
+        event = NULL;
+        num_voxels = (size_t)src_lengths[0] * src_lengths[1] * src_lengths[2];
+        err = enqueue_read_buffer(plugin->queue, src, num_voxels,
+                                  levels_out[l], &event);
+        CHECK_CL_ERROR(err);
+        opencl_plugin_profile_event(plugin, PROFILE_READBACK, event,
+                                    num_voxels);
+    }
+
+    err = clFlush(plugin->queue);
+    CHECK_CL_ERROR(err);
+
+    return opencl_plugin_complete_job(plugin, event, NULL);
+error:
+    opencl_plugin_drain(plugin);
+    if (event)
+        clReleaseEvent(event);
+    return -1;
+}
+
+/* Like opencl_plugin_voxelize_meshes(), but returns one bit per voxel, see
+ * opencl_plugin_unpack_bits(). voxel_bits_out must hold
+ * ceil(num_voxels / 32) words. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_packed(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uint *voxel_bits_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_PACKED, voxel_bits_out);
+
+    return opencl_plugin_submit_meshes(plugin, &grid, mesh_data_count,
+                                       mesh_data_list, &output, NULL);
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_packed_async(opencl_plugin plugin,
+                                                  float inv_element_size,
+                                                  float corner_x,
+                                                  float corner_y,
+                                                  float corner_z,
+                                                  cl_int x_cell_length,
+                                                  cl_int y_cell_length,
+                                                  cl_int z_cell_length,
+                                                  cl_int mesh_data_count,
+                                                  mesh_data *mesh_data_list,
+                                                  cl_uint *voxel_bits_out,
+                                                  opencl_plugin_job *job_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    assert(job_out != NULL);
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_PACKED, voxel_bits_out);
+
+    return opencl_plugin_submit_meshes(plugin, &grid, mesh_data_count,
+                                       mesh_data_list, &output, job_out);
+}
+
+/*
+ * Like opencl_plugin_voxelize_meshes(), but only returns the 8x8x8 bricks
+ * containing at least one occupied voxel. Up to max_bricks bricks are
+ * written, in no particular order: their brick coordinates (multiply by 8
+ * for the voxel coordinates of their first voxel) to brick_coords_out as 3
+ * cl_ints each, and their 512 voxels to brick_data_out, x fastest then y
+ * then z. *num_bricks_out is set to the total number of occupied bricks; if
+ * that is more than max_bricks the output is incomplete and the call should
+ * be repeated with bigger buffers.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_sparse(opencl_plugin plugin,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_int max_bricks,
+                                            cl_int *brick_coords_out,
+                                            cl_uchar *brick_data_out,
+                                            cl_int *num_bricks_out)
+{
+    cl_int err = CL_SUCCESS;
+    voxel_grid_params grid;
+    voxel_output output;
+    cl_int num_bricks;
+
+    assert(max_bricks >= 0);
+    assert(num_bricks_out != NULL);
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_SPARSE, num_bricks_out);
+    output.max_bricks = max_bricks;
+
+    if (opencl_plugin_submit_meshes(plugin, &grid, mesh_data_count,
+                                    mesh_data_list, &output, NULL))
+        goto error;
+
+    /* Now that we know how many bricks there are, only read those */
+    num_bricks = *num_bricks_out < max_bricks ? *num_bricks_out : max_bricks;
+    if (num_bricks > 0) {
+        err = clEnqueueReadBuffer(
+            plugin->queue, plugin->brick_coords_buffer.mem, CL_FALSE, 0,
+            sizeof(cl_int) * 3 * (size_t)num_bricks, brick_coords_out, 0,
+            NULL, NULL);
+        CHECK_CL_ERROR(err);
+
+        err = clEnqueueReadBuffer(
+            plugin->queue, plugin->brick_data_buffer.mem, CL_TRUE, 0,
+            BRICK_VOXELS * (size_t)num_bricks, brick_data_out, 0, NULL, NULL);
+        CHECK_CL_ERROR(err);
+    }
+
+    return 0;
+error:
+    opencl_plugin_drain(plugin);
+    return -1;
+}
+
+/* Like opencl_plugin_voxelize_meshes(), but for grids with more than
+ * INT_MAX voxels. Grids bigger than the device's maximum allocation or
+ * cl_int indexing are split into z slabs internally. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes64(opencl_plugin plugin,
+                                       float inv_element_size,
+                                       float corner_x,
+                                       float corner_y,
+                                       float corner_z,
+                                       cl_long x_cell_length,
+                                       cl_long y_cell_length,
+                                       cl_long z_cell_length,
+                                       cl_int mesh_data_count,
+                                       mesh_data *mesh_data_list,
+                                       cl_uchar *voxel_grid_out)
+{
+    cl_event event;
+
+    if (opencl_plugin_enqueue_voxelize64(plugin, inv_element_size,
+                                         corner_x, corner_y, corner_z,
+                                         x_cell_length, y_cell_length,
+                                         z_cell_length, mesh_data_count,
+                                         mesh_data_list, voxel_grid_out,
+                                         &event))
+        return -1;
+
+    return opencl_plugin_complete_job(plugin, event, NULL);
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes64_async(opencl_plugin plugin,
+                                             float inv_element_size,
+                                             float corner_x,
+                                             float corner_y,
+                                             float corner_z,
+                                             cl_long x_cell_length,
+                                             cl_long y_cell_length,
+                                             cl_long z_cell_length,
+                                             cl_int mesh_data_count,
+                                             mesh_data *mesh_data_list,
+                                             cl_uchar *voxel_grid_out,
+                                             opencl_plugin_job *job_out)
+{
+    cl_event event;
+
+    assert(job_out != NULL);
+
+    *job_out = NULL;
+
+    if (opencl_plugin_enqueue_voxelize64(plugin, inv_element_size,
+                                         corner_x, corner_y, corner_z,
+                                         x_cell_length, y_cell_length,
+                                         z_cell_length, mesh_data_count,
+                                         mesh_data_list, voxel_grid_out,
+                                         &event))
+        return -1;
+
+    return opencl_plugin_complete_job(plugin, event, job_out);
+}
+
+/* Expand a packed grid back into one cl_uchar (0 or 1) per voxel */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_unpack_bits(const cl_uint *voxel_bits,
+                               cl_int num_voxels,
+                               cl_uchar *voxel_grid_out)
+{
+    cl_int i;
+
+    assert(voxel_bits != NULL || num_voxels == 0);
+    assert(voxel_grid_out != NULL || num_voxels == 0);
+
+    for (i = 0; i < num_voxels; i++)
+        voxel_grid_out[i] = (voxel_bits[i / 32] >> (i % 32)) & 1;
+}
+
+/* Register a mesh to be kept resident on the device. Nothing is uploaded
+ * until the mesh is first used, so the arrays mesh_data points to must stay
+ * valid until a voxelization using this mesh has completed. The
+ * vertex/triangle_buffer_base_idx fields are ignored. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_mesh_register(opencl_plugin plugin,
+                                   const mesh_data *data,
+                                   opencl_plugin_mesh *mesh_out)
+{
+    opencl_plugin_mesh mesh;
+
+    assert(plugin != NULL);
+    assert(data != NULL);
+    assert(mesh_out != NULL);
+
+    if (opencl_plugin_check_device(plugin)) {
+        *mesh_out = NULL;
+        return -1;
+    }
+
+    mesh = calloc(1, sizeof(*mesh));
+    CHECK_ALLOCATION(mesh);
+
+    mesh->plugin = plugin;
+    mesh->data = *data;
+    mesh->generation = 1;
+    mesh->uploaded_generation = 0;
+
+    mesh->next = plugin->meshes;
+    if (plugin->meshes)
+        plugin->meshes->prev = mesh;
+    plugin->meshes = mesh;
+
+    *mesh_out = mesh;
+    return 0;
+error:
+    *mesh_out = NULL;
+    return -1;
+}
+
+/* Replace the geometry of a registered mesh, it is re-uploaded by the next
+ * voxelization that uses it. Same lifetime rules as
+ * opencl_plugin_mesh_register(). */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_mesh_update(opencl_plugin_mesh mesh, const mesh_data *data)
+{
+    assert(mesh != NULL);
+    assert(data != NULL);
+
+    mesh->data = *data;
+    mesh->generation++;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_mesh_release(opencl_plugin_mesh mesh)
+{
+    opencl_plugin plugin;
+
+    if (!mesh) return;
+
+    plugin = mesh->plugin;
+
+    if (mesh->prev)
+        mesh->prev->next = mesh->next;
+    else
+        plugin->meshes = mesh->next;
+    if (mesh->next)
+        mesh->next->prev = mesh->prev;
+
+    device_buffer_release(&plugin->pool, &mesh->vertex_buffer);
+    device_buffer_release(&plugin->pool, &mesh->triangle_buffer);
+
+    free(mesh);
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_registered_meshes(opencl_plugin plugin,
+                                                float inv_element_size,
+                                                float corner_x,
+                                                float corner_y,
+                                                float corner_z,
+                                                cl_int x_cell_length,
+                                                cl_int y_cell_length,
+                                                cl_int z_cell_length,
+                                                cl_int mesh_count,
+                                                opencl_plugin_mesh *meshes,
+                                                cl_uchar *voxel_grid_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_grid_out);
+
+    return opencl_plugin_submit_registered(plugin, &grid, mesh_count, meshes,
+                                           NULL, NULL, &output, NULL);
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_registered_meshes_async(opencl_plugin plugin,
+                                                      float inv_element_size,
+                                                      float corner_x,
+                                                      float corner_y,
+                                                      float corner_z,
+                                                      cl_int x_cell_length,
+                                                      cl_int y_cell_length,
+                                                      cl_int z_cell_length,
+                                                      cl_int mesh_count,
+                                                      opencl_plugin_mesh *meshes,
+                                                      cl_uchar *voxel_grid_out,
+                                                      opencl_plugin_job *job_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    assert(job_out != NULL);
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_grid_out);
+
+    return opencl_plugin_submit_registered(plugin, &grid, mesh_count, meshes,
+                                           NULL, NULL, &output, job_out);
+}
+
+/* Like opencl_plugin_voxelize_registered_meshes(), voxelizing
+ * instance_counts[i] copies of mesh i, e.g. a part reused throughout an
+ * assembly. transforms holds a row-major 3x4 matrix (12 floats) per
+ * instance, mesh by mesh, applied on the device: only the meshes and the
+ * matrices are uploaded. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_mesh_instances(opencl_plugin plugin,
+                                             float inv_element_size,
+                                             float corner_x,
+                                             float corner_y,
+                                             float corner_z,
+                                             cl_int x_cell_length,
+                                             cl_int y_cell_length,
+                                             cl_int z_cell_length,
+                                             cl_int mesh_count,
+                                             opencl_plugin_mesh *meshes,
+                                             const cl_int *instance_counts,
+                                             const float *transforms,
+                                             cl_uchar *voxel_grid_out)
+{
+    voxel_grid_params grid;
+    voxel_output output;
+
+    assert(instance_counts != NULL);
+    assert(transforms != NULL);
+
+    init_voxel_grid_params(&grid, inv_element_size, corner_x, corner_y,
+                           corner_z, x_cell_length, y_cell_length,
+                           z_cell_length);
+    init_voxel_output(&output, VOXEL_OUTPUT_DENSE, voxel_grid_out);
+
+    return opencl_plugin_submit_registered(plugin, &grid, mesh_count, meshes,
+                                           instance_counts, transforms,
+                                           &output, NULL);
+}
+
+/* Returns 1 if the job has completed, 0 if it is still running and -1 if it
+ * failed */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_poll(opencl_plugin_job job)
+{
+    cl_int err;
+    cl_int status;
+
+    assert(job != NULL);
+
+    if (!job->done_event)
+        return 1;
+
+    err = clGetEventInfo(job->done_event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                         sizeof(status), &status, NULL);
+    CHECK_CL_ERROR(err);
+
+    if (status < 0) {
+        ERROR("Voxelization job failed (OpenCL returned %s)",
+              get_cl_error_string(status));
+        goto error;
+    }
+
+    return status == CL_COMPLETE ? 1 : 0;
+error:
+    return -1;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_wait(opencl_plugin_job job)
+{
+    cl_int err;
+
+    assert(job != NULL);
+
+    if (!job->done_event)
+        return 0;
+
+    err = clWaitForEvents(1, &job->done_event);
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    return -1;
+}
+
+typedef struct _job_callback_data {
+    job_completion_handler func;
+    void                   *user_data;
+} job_callback_data;
+
+static void CL_CALLBACK job_callback_trampoline(cl_event event,
+                                                cl_int status,
+                                                void *user_data)
+{
+    job_callback_data *data = user_data;
+
+    (void)event;
+
+    data->func(status < 0 ? -1 : 0, data->user_data);
+    free(data);
+}
+
+/* func is called with 0 on success or -1 on failure once the job is done.
+ * It runs on an OpenCL driver thread, so it should be quick and must not
+ * call back into the plugin. The callback doesn't reference the job, so the
+ * job may be released before it fires. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_job_set_callback(opencl_plugin_job job,
+                                      job_completion_handler func,
+                                      void *user_data)
+{
+    cl_int err;
+    job_callback_data *data = NULL;
+
+    assert(job != NULL);
+    assert(func != NULL);
+
+    /* CPU jobs have already completed */
+    if (!job->done_event) {
+        func(0, user_data);
+        return 0;
+    }
+
+    data = malloc(sizeof(*data));
+    CHECK_ALLOCATION(data);
+
+    data->func = func;
+    data->user_data = user_data;
+
+    err = clSetEventCallback(job->done_event, CL_COMPLETE,
+                             job_callback_trampoline, data);
+    CHECK_CL_ERROR(err);
+
+    return 0;
+error:
+    free(data);
+    return -1;
+}
+
+/* Releasing a job doesn't cancel it, the caller's buffers must stay valid
+ * until it has completed */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_job_release(opencl_plugin_job job)
+{
+    if (!job) return;
+
+    if (job->done_event)
+        clReleaseEvent(job->done_event);
+
+    free(job);
+}
+
+/*
+ * Hand out size bytes of pinned (page-locked) host memory, allocated with
+ * CL_MEM_ALLOC_HOST_PTR and kept mapped until opencl_plugin_unmap_staging().
+ * Mesh data written straight into it, or a voxel grid read back into it,
+ * can be transferred by DMA without the driver bouncing through its own
+ * staging copy. Just pass pointers into it as mesh_data.vertices /
+ * triangles or as voxel_grid_out.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_map_staging(opencl_plugin plugin,
+                                 cl_long size,
+                                 opencl_plugin_staging *staging_out,
+                                 void **ptr_out)
+{
+    cl_int err;
+    opencl_plugin_staging staging;
+
+    assert(plugin != NULL);
+    assert(size > 0);
+    assert(staging_out != NULL);
+    assert(ptr_out != NULL);
+
+    if (opencl_plugin_check_device(plugin)) {
+        *staging_out = NULL;
+        return -1;
+    }
+
+    staging = calloc(1, sizeof(*staging));
+    CHECK_ALLOCATION(staging);
+
+    staging->plugin = plugin;
+
+    staging->buffer = clCreateBuffer(plugin->context,
+                                     CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                     (size_t)size, NULL, &err);
+    CHECK_CL_ERROR_MSG(err, "Failed to allocate %ld byte staging buffer",
+                       (long)size);
+
+    staging->ptr = clEnqueueMapBuffer(plugin->queue, staging->buffer, CL_TRUE,
+                                      CL_MAP_READ | CL_MAP_WRITE, 0,
+                                      (size_t)size, 0, NULL, NULL, &err);
+    CHECK_CL_ERROR(err);
+
+    staging->next = plugin->staging;
+    if (plugin->staging)
+        plugin->staging->prev = staging;
+    plugin->staging = staging;
+
+    *staging_out = staging;
+    *ptr_out = staging->ptr;
+    return 0;
+error:
+    if (staging) {
+        if (staging->buffer)
+            clReleaseMemObject(staging->buffer);
+        free(staging);
+    }
+    *staging_out = NULL;
+    *ptr_out = NULL;
+    return -1;
+}
+
+/* The unmap is ordered after every transfer already enqueued, so this may
+ * be called while a job using the memory is still in flight. The memory
+ * itself must not be touched afterwards. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_unmap_staging(opencl_plugin_staging staging)
+{
+    opencl_plugin plugin;
+
+    if (!staging) return;
+
+    plugin = staging->plugin;
+
+    if (staging->prev)
+        staging->prev->next = staging->next;
+    else
+        plugin->staging = staging->next;
+    if (staging->next)
+        staging->next->prev = staging->prev;
+
+    clEnqueueUnmapMemObject(plugin->queue, staging->buffer, staging->ptr,
+                            0, NULL, NULL);
+    clReleaseMemObject(staging->buffer);
+
+    free(staging);
+}
+
+/* Default slab size of tiled jobs. Both slabs in flight are staged in
+ * pinned host memory, which is scarce. */
+#define TILED_DEFAULT_SLAB_VOXELS (64 * 1024 * 1024)
+
+/*
+ * Voxelize a grid of any size in z slabs of at most slab_depth slices (0
+ * picks slabs of about 64 MiB, at least one slice), without ever
+ * holding the whole grid in device or host memory. Each slab only runs the
+ * meshes whose bounds overlap it. As soon as a slab has been read back,
+ * func(z_start, z_count, voxels, user_data) is called on this thread with
+ * its z_count * x_cell_length * y_cell_length voxels, in slab order; the
+ * voxels are only valid during the call. Meanwhile the next slab is being
+ * computed, so the handler can e.g. write the slab out to a memory mapped
+ * file without stalling the device.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_voxelize_meshes_tiled(opencl_plugin plugin,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_long x_cell_length,
+                                           cl_long y_cell_length,
+                                           cl_long z_cell_length,
+                                           cl_long slab_depth,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           voxel_slab_handler func,
+                                           void *user_data)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int i, n, num_launches;
+    mesh_launch *launches = NULL;
+    cl_long slice_voxels, max_depth, z0[2] = {0, 0}, depth[2] = {0, 0};
+    device_buffer *grid_buffers[2];
+    opencl_plugin_staging staging[2] = {NULL, NULL};
+    void *host_slabs[2] = {NULL, NULL};
+    cl_event compute_event = NULL, read_events[2] = {NULL, NULL};
+    cl_long z;
+    int prev_pending = 0;
+
+    assert(plugin != NULL);
+    assert(inv_element_size > 0);
+    assert(x_cell_length >= 0);
+    assert(y_cell_length >= 0);
+    assert(z_cell_length >= 0);
+    assert(slab_depth >= 0);
+    assert(mesh_data_count >= 0);
+    assert(mesh_data_list != NULL);
+    assert(func != NULL);
+
+    if (opencl_plugin_check_device(plugin))
+        return -1;
+    if (opencl_plugin_check_slab_fill(plugin, "tiled"))
+        return -1;
+
+    grid_buffers[0] = &plugin->voxel_grid_buffer;
+    grid_buffers[1] = &plugin->tile_grid_buffer;
+
+    slice_voxels = x_cell_length * y_cell_length;
+    if (x_cell_length > INT_MAX || y_cell_length > INT_MAX) {
+        ERROR("Grid of %ldx%ldx%ld voxels is too large", (long)x_cell_length,
+              (long)y_cell_length, (long)z_cell_length);
+        return -1;
+    }
+    if (slice_voxels == 0 || z_cell_length == 0)
+        return 0;
+
+    max_depth = opencl_plugin_max_slab_depth(plugin, slice_voxels);
+    if (max_depth < 1) {
+        ERROR("A single %ldx%ld slice doesn't fit in a device buffer",
+              (long)x_cell_length, (long)y_cell_length);
+        return -1;
+    }
+    if (slab_depth == 0) {
+        slab_depth = TILED_DEFAULT_SLAB_VOXELS / slice_voxels;
+        if (slab_depth < 1)
+            slab_depth = 1;
+    }
+    if (slab_depth > max_depth)
+        slab_depth = max_depth;
+    if (slab_depth > z_cell_length)
+        slab_depth = z_cell_length;
+
+    opencl_plugin_profile_begin(plugin, count_triangles(mesh_data_count,
+                                                        mesh_data_list));
+
+    /* Pinned, so the readbacks run at full speed */
+    for (i = 0; i < 2; i++) {
+        if (opencl_plugin_map_staging(plugin, slab_depth * slice_voxels,
+                                      &staging[i], &host_slabs[i]))
+            goto error;
+    }
+
+    launches = malloc(sizeof(*launches) * (mesh_data_count > 0 ? mesh_data_count : 1));
+    CHECK_ALLOCATION(launches);
+
+    if (opencl_plugin_init_mesh_buffers(plugin, mesh_data_count, mesh_data_list))
+        goto error;
+
+    for (n = 0, z = 0; z < z_cell_length; n++, z += slab_depth) {
+        int b = n & 1;
+        voxel_grid_params slab;
+        voxel_box box;
+
+        z0[b] = z;
+        depth[b] = z_cell_length - z < slab_depth ? z_cell_length - z : slab_depth;
+
+        init_voxel_grid_params(&slab, inv_element_size, corner_x, corner_y,
+                               corner_z + (float)z / inv_element_size,
+                               (cl_int)x_cell_length, (cl_int)y_cell_length,
+                               (cl_int)depth[b]);
+
+        /* The readback of this buffer two slabs ago was waited on below */
+        voxel_box_init(&box);
+        voxel_box_add_meshes(plugin, &box, &slab, mesh_data_count, mesh_data_list);
+        if (opencl_plugin_enqueue_clear_grid(plugin, grid_buffers[b], &slab,
+                                             &box))
+            goto error;
+
+        num_launches = 0;
+        for (i = 0; i < mesh_data_count; i++) {
+            mesh_launch *launch = &launches[num_launches];
+
+            if (!mesh_overlaps_grid(plugin, &mesh_data_list[i], &slab))
+                continue;
+
+            init_mesh_launch(launch, plugin->vertex_buffer.mem,
+                             plugin->triangle_buffer.mem,
+                             mesh_data_list[i].num_triangles,
+                             mesh_data_list[i].vertex_buffer_base_idx,
+                             mesh_data_list[i].triangle_buffer_base_idx);
+            num_launches++;
+        }
+
+        if (opencl_plugin_enqueue_launches(plugin, grid_buffers[b]->mem, &slab,
+                                           num_launches, launches))
+            goto error;
+
+        /* Meshes entirely below the slab were skipped, a closed one crosses
+         * every column an even number of times anyway */
+        if (opencl_plugin_enqueue_solid_fill(plugin, grid_buffers[b]->mem,
+                                             &slab, num_launches, launches))
+            goto error;
+
+        err = clEnqueueMarkerWithWaitList(plugin->queue, 0, NULL,
+                                          &compute_event);
+        CHECK_CL_ERROR(err);
+        err = clFlush(plugin->queue);
+        CHECK_CL_ERROR(err);
+
+        /* Read back on a separate queue, so the next slab computes
+         * meanwhile */
+        err = clEnqueueReadBuffer(
+            plugin->readback_queue, grid_buffers[b]->mem, CL_FALSE, 0,
+            (size_t)(depth[b] * slice_voxels), host_slabs[b], 1,
+            &compute_event, &read_events[b]);
+        CHECK_CL_ERROR(err);
+        opencl_plugin_profile_event(plugin, PROFILE_READBACK, read_events[b],
+                                    (cl_ulong)(depth[b] * slice_voxels));
+        err = clFlush(plugin->readback_queue);
+        CHECK_CL_ERROR(err);
+
+        clReleaseEvent(compute_event);
+        compute_event = NULL;
+
+        /* Hand over the previous slab while this one is in flight */
+        if (prev_pending) {
+            err = clWaitForEvents(1, &read_events[!b]);
+            CHECK_CL_ERROR(err);
+            clReleaseEvent(read_events[!b]);
+            read_events[!b] = NULL;
+
+            func(z0[!b], depth[!b], host_slabs[!b], user_data);
+        }
+        prev_pending = 1;
+    }
+
+    /* And the final slab */
+    n = (n - 1) & 1;
+    err = clWaitForEvents(1, &read_events[n]);
+    CHECK_CL_ERROR(err);
+    clReleaseEvent(read_events[n]);
+    read_events[n] = NULL;
+
+    func(z0[n], depth[n], host_slabs[n], user_data);
+
+    free(launches);
+    for (i = 0; i < 2; i++)
+        opencl_plugin_unmap_staging(staging[i]);
+
+    return 0;
+error:
+    opencl_plugin_drain(plugin);
+    if (compute_event)
+        clReleaseEvent(compute_event);
+    for (i = 0; i < 2; i++) {
+        if (read_events[i])
+            clReleaseEvent(read_events[i]);
+        opencl_plugin_unmap_staging(staging[i]);
+    }
+    free(launches);
+    return -1;
+}
+
+/* Collect an opencl_plugin_telemetry_event for every command of every
+ * job, for draining with opencl_plugin_drain_telemetry(), without any
+ * string formatting. Only plugins created with profiling enabled (see
+ * opencl_plugin_create_ex()) produce events, which show up as the
+ * commands complete. Process wide, off by default. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_telemetry(cl_int enable)
+{
+    g_telemetry_enabled = enable;
+}
+
+/* Move up to max_events of the oldest telemetry events to events_out,
+ * returning how many. Must not be called from several threads at once.
+ * *dropped_out (may be NULL) is the number of events lost so far because
+ * the ring was full. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_drain_telemetry(opencl_plugin_telemetry_event *events_out,
+                                     cl_int max_events,
+                                     cl_long *dropped_out)
+{
+    cl_int n = 0;
+    cl_long pos, idx;
+    telemetry_slot *slot;
+
+    assert(events_out != NULL || max_events == 0);
+
+    while (n < max_events) {
+        pos = g_telemetry_tail;
+        idx = pos & (TELEMETRY_RING_SIZE - 1);
+        slot = &g_telemetry_ring[idx];
+        if (slot->sequence + idx != pos + 1)
+            break;
+
+        /* Don't read the event before the producer published it */
+        memory_barrier();
+        events_out[n++] = slot->event;
+        memory_barrier();
+        /* Free for the producer one lap later */
+        slot->sequence = pos + TELEMETRY_RING_SIZE - idx;
+        g_telemetry_tail = pos + 1;
+    }
+
+    if (dropped_out)
+        *dropped_out = g_telemetry_dropped;
+    return n;
+}
+
+/* Device timings of the most recent job, waiting for it if it's still
+ * running. Requires a plugin created with profiling enabled, see
+ * opencl_plugin_create_ex(). */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_get_stats(opencl_plugin plugin,
+                               opencl_plugin_stats *stats_out)
+{
+    cl_int err;
     cl_int i;
-    cl_int next_row_offset, next_slice_offset;
-    size_t local_work_size;
-    cl_int num_voxels;
+    cl_ulong phase_ns[NUM_PROFILE_PHASES];
+    cl_ulong first_start = 0, last_end = 0;
+    int have_times = 0;
+
+    assert(plugin != NULL);
+    assert(stats_out != NULL);
+
+    memset(stats_out, 0, sizeof(*stats_out));
+    memset(phase_ns, 0, sizeof(phase_ns));
+
+    if (!plugin->profiling) {
+        ERROR("Stats require a plugin created with profiling enabled", 0);
+        return -1;
+    }
+
+    for (i = 0; i < plugin->num_profile_records; i++) {
+        const profile_record *record = &plugin->profile_records[i];
+        cl_ulong start, end;
+
+        if (!record->event)
+            continue;
+
+        err = clWaitForEvents(1, &record->event);
+        CHECK_CL_ERROR(err);
+
+        err = clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_START,
+                                      sizeof(start), &start, NULL);
+        CHECK_CL_ERROR(err);
+        err = clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_END,
+                                      sizeof(end), &end, NULL);
+        CHECK_CL_ERROR(err);
+
+        phase_ns[record->phase] += end - start;
+        if (!have_times || start < first_start)
+            first_start = start;
+        if (!have_times || end > last_end)
+            last_end = end;
+        have_times = 1;
+
+        if (record->phase == PROFILE_UPLOAD)
+            stats_out->bytes_uploaded += record->bytes;
+        else if (record->phase == PROFILE_READBACK)
+            stats_out->bytes_read += record->bytes;
+    }
+
+    stats_out->fill_ns = phase_ns[PROFILE_FILL];
+    stats_out->upload_ns = phase_ns[PROFILE_UPLOAD];
+    stats_out->kernel_ns = phase_ns[PROFILE_KERNEL];
+    stats_out->readback_ns = phase_ns[PROFILE_READBACK];
+    stats_out->total_ns = last_end - first_start;
+    stats_out->num_triangles = plugin->profile_num_triangles;
+    if (stats_out->total_ns > 0) {
+        stats_out->triangles_per_second = (double)stats_out->num_triangles *
+            1e9 / (double)stats_out->total_ns;
+    }
+
+    return 0;
+error:
+    return -1;
+}
 
-    clock_t t1;
-    clock_t t2;
-    clock_t t3;
+/* Enable culling triangles outside the grid before voxelizing, with
+ * triangles spanning more than large_triangle_extent voxels launched
+ * separately from the rest. Only applies to opencl_plugin_voxelize_meshes*()
+ * jobs, and is ignored where culling would lose crossings: in
+ * OPENCL_PLUGIN_VOXELIZE_SOLID mode and with OPENCL_PLUGIN_SOLID_FILL_PARITY.
+ * Needs grid_ops.cl. Off by default. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_binning(opencl_plugin plugin,
+                               cl_int enable,
+                               float large_triangle_extent)
+{
+    assert(plugin != NULL);
+    assert(large_triangle_extent >= 0);
+
+    plugin->binning_enabled = enable;
+    plugin->large_triangle_extent = large_triangle_extent;
+}
 
+/* Enable voxelizing all meshes of a job with a single kernel launch rather
+ * than one per mesh, which pays off for many small meshes. Binning, if
+ * enabled, already merges the meshes and takes precedence. Only applies to
+ * opencl_plugin_voxelize_meshes*() jobs, and needs grid_ops.cl. Off by
+ * default. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_batching(opencl_plugin plugin, cl_int enable)
+{
     assert(plugin != NULL);
-    assert(inv_element_size >= 0);
-    assert(x_cell_length >= 0);
-    assert(y_cell_length >= 0);
-    assert(z_cell_length >= 0);
-    assert(mesh_data_count >= 0);
-    assert(mesh_data_list != NULL);
 
-    t1 = clock();
+    plugin->batching_enabled = enable;
+}
 
-    /* (Re-)allocate buffer for voxel grid */
-    num_voxels = x_cell_length * y_cell_length * z_cell_length;
-    if (opencl_plugin_init_voxel_buffer(plugin, num_voxels))
-        goto error;
+/* Trust the bounds_* fields of mesh_data to contain each mesh's vertices,
+ * so that jobs only clear the voxels earlier jobs may have set, region and
+ * tiled jobs skip meshes outside their part of the grid and fixed point or
+ * half float vertices can be used (see opencl_plugin_set_mesh_compression()).
+ * Bounds that are inverted (min > max on any axis) or NaN still count as
+ * unknown. Off by default, every mesh is then assumed to cover the whole
+ * grid. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_mesh_bounds(opencl_plugin plugin, cl_int enable)
+{
+    assert(plugin != NULL);
 
-    /* (Re-)allocate buffers for mesh data */
-    if (opencl_plugin_init_mesh_buffers(plugin, mesh_data_count, mesh_data_list))
-        goto error;
+    plugin->mesh_bounds = enable;
+}
 
-    err = clGetKernelWorkGroupInfo(
-        plugin->voxelize_kernel, plugin->selected_device,
-        CL_KERNEL_WORK_GROUP_SIZE, sizeof(local_work_size), &local_work_size,
-        NULL);
-    CHECK_CL_ERROR(err);
+/* Upload the meshes of opencl_plugin_voxelize_meshes*() jobs in a compact
+ * form that is expanded on the device, one of enum
+ * opencl_plugin_vertex_format for the vertices and, if short_indices is
+ * set, 16-bit indices for meshes of at most 65536 vertices. Vertices of
+ * meshes that don't fit the format (no trusted bounds, see
+ * opencl_plugin_set_mesh_bounds(), or out of half float range) are uploaded
+ * as floats. Fixed point vertices are only as good as the
+ * mesh bounds are tight. Needs grid_ops.cl. Off by default. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_mesh_compression(opencl_plugin plugin,
+                                          cl_int vertex_format,
+                                          cl_int short_indices)
+{
+    assert(plugin != NULL);
 
-    if (enqueue_zero_buffer(plugin->queue, plugin->voxel_grid_buffer,
-                            plugin->voxel_grid_buffer_capacity, 0, NULL, NULL,
-                            &err))
-        goto error;
+    if (vertex_format < OPENCL_PLUGIN_VERTEX_FLOAT ||
+        vertex_format > OPENCL_PLUGIN_VERTEX_HALF) {
+        ERROR("Unknown vertex format %d", vertex_format);
+        return -1;
+    }
 
-    err = clFinish(plugin->queue);
-    CHECK_CL_ERROR(err);
+    plugin->vertex_format = vertex_format;
+    plugin->short_indices = short_indices;
+    return 0;
+}
 
-    t1 = clock() - t1;
-    t2 = clock();
+/* Fill the interior of closed surfaces on the device before the grid is
+ * read back, one of enum opencl_plugin_solid_fill. axis (0 = x, 1 = y,
+ * 2 = z) is the line direction of OPENCL_PLUGIN_SOLID_FILL_PARITY, which
+ * counts the triangles crossing each line like OPENCL_PLUGIN_VOXELIZE_SOLID
+ * (and likewise turns binning off). Applies to all jobs with voxel grid
+ * output. 64-bit, tiled and multi-device jobs fill each z slab on their
+ * own, which is fine for the parity fill, but they fail with the flood
+ * fill. No effect in OPENCL_PLUGIN_VOXELIZE_SOLID mode. Needs grid_ops.cl.
+ * Off by default. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_solid_fill(opencl_plugin plugin,
+                                    cl_int fill,
+                                    cl_int axis)
+{
+    assert(plugin != NULL);
 
-    next_row_offset = x_cell_length;
-    next_slice_offset = x_cell_length * y_cell_length;
+    if (fill < OPENCL_PLUGIN_SOLID_FILL_NONE ||
+        fill > OPENCL_PLUGIN_SOLID_FILL_FLOOD) {
+        ERROR("Invalid solid fill %d", fill);
+        return -1;
+    }
+    if (axis < 0 || axis > 2) {
+        ERROR("Invalid solid fill axis %d", axis);
+        return -1;
+    }
+    if (fill != OPENCL_PLUGIN_SOLID_FILL_NONE) {
+        if (opencl_plugin_check_device(plugin))
+            return -1;
+        if (!plugin->flood_exterior_kernel) {
+            ERROR("Solid fill requires grid_ops.cl", 0);
+            return -1;
+        }
+    }
 
-    err |= clSetKernelArg(plugin->voxelize_kernel, 0, sizeof(cl_mem), &plugin->voxel_grid_buffer);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 1, sizeof(float),  &inv_element_size);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 2, sizeof(float),  &corner_x);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 3, sizeof(float),  &corner_y);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 4, sizeof(float),  &corner_z);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 5, sizeof(cl_int), &next_row_offset);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 6, sizeof(cl_int), &next_slice_offset);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 7, sizeof(cl_int), &x_cell_length);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 8, sizeof(cl_int), &y_cell_length);
-    err |= clSetKernelArg(plugin->voxelize_kernel, 9, sizeof(cl_int), &z_cell_length);
-    CHECK_CL_ERROR(err);
+    plugin->solid_fill = fill;
+    plugin->solid_fill_axis = axis;
+    return 0;
+}
 
-    for (i = 0; i < mesh_data_count; i++) {
-        size_t global_work_size;
-        cl_uint vertex_buffer_base_idx = mesh_data_list[i].vertex_buffer_base_idx;
-        cl_uint triangle_buffer_base_idx = mesh_data_list[i].triangle_buffer_base_idx;
-        err |= clSetKernelArg(plugin->voxelize_kernel, 10, sizeof(cl_mem), &plugin->vertex_buffer);
-        err |= clSetKernelArg(plugin->voxelize_kernel, 11, sizeof(cl_mem), &plugin->triangle_buffer);
-        err |= clSetKernelArg(plugin->voxelize_kernel, 12, sizeof(cl_int), &mesh_data_list[i].num_triangles);
-        err |= clSetKernelArg(plugin->voxelize_kernel, 13, sizeof(cl_uint), &vertex_buffer_base_idx);
-        err |= clSetKernelArg(plugin->voxelize_kernel, 14, sizeof(cl_uint), &triangle_buffer_base_idx);
-        CHECK_CL_ERROR(err);
+/* Enable wrapping caller memory with CL_MEM_USE_HOST_PTR instead of
+ * copying it, for opencl_plugin_voxelize_meshes*() jobs with dense output.
+ * The kernels then write the grid in place, and read each mesh in place
+ * unless binning or batching is enabled. Arrays that aren't aligned to the
+ * device's base address alignment are copied as usual. Only possible on
+ * devices with memory shared with the host, where it is on by default. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_zero_copy(opencl_plugin plugin, cl_int enable)
+{
+    assert(plugin != NULL);
 
-        /* As per the OpenCL spec, global_work_size must divide evenly by
-         * local_work_size */
-        global_work_size = mesh_data_list[i].num_triangles / local_work_size;
-        global_work_size *= local_work_size;
-        if (global_work_size < (size_t)mesh_data_list[i].num_triangles)
-            global_work_size += local_work_size;
+    if (enable && !plugin->host_unified_memory) {
+        ERROR("Zero-copy requires a device sharing memory with the host", 0);
+        return -1;
+    }
 
-        err = clEnqueueNDRangeKernel(
-            plugin->queues[i % plugin->num_queues], plugin->voxelize_kernel, 1, NULL, &global_work_size,
-            &local_work_size, 0, NULL, NULL);
-        CHECK_CL_ERROR_MSG(err, "clEnqueueNDRangeKernel failed on mesh %d/%d",
-                           i + 1, mesh_data_count);
+    plugin->zero_copy = enable;
+    return 0;
+}
+
+/* Enable picking the voxelize kernel's local work size by triangle count,
+ * from benchmarks of the candidate sizes run on the device. The results
+ * are saved next to the program binary cache, so each device, driver and
+ * kernel build is only benchmarked once, on the first job after enabling
+ * (or after changing the voxelize mode). Off by default. */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_autotune(opencl_plugin plugin, cl_int enable)
+{
+    assert(plugin != NULL);
+
+    plugin->autotune = enable;
+    if (!enable)
+        plugin->tuned = 0;
+}
+
+/* Select how triangles are turned into voxels, one of enum
+ * opencl_plugin_voxelize_mode. Modes other than the default build their own
+ * specialised kernel from voxelize_modes.cl here. Applies to all job types.
+ * The CPU voxelizer is always conservative and has no solid mode. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_set_voxelize_mode(opencl_plugin plugin, cl_int mode)
+{
+    cl_int err = CL_SUCCESS;
+    char *options = NULL;
+    size_t options_size;
+
+    assert(plugin != NULL);
+
+    if (mode < OPENCL_PLUGIN_VOXELIZE_DEFAULT ||
+        mode > OPENCL_PLUGIN_VOXELIZE_SOLID) {
+        ERROR("Invalid voxelize mode %d", mode);
+        return -1;
+    }
 
-        err = clFinish(plugin->queue);
-        CHECK_CL_ERROR_MSG(err, "clFinish failed on mesh %d/%d",
-                           i + 1, mesh_data_count);
+    if (plugin->cpu) {
+        if (mode == OPENCL_PLUGIN_VOXELIZE_SOLID) {
+            ERROR("Solid voxelization is not supported by the CPU voxelizer", 0);
+            return -1;
+        }
+        plugin->voxelize_mode = mode;
+        return 0;
     }
 
+    if (mode == plugin->voxelize_mode)
+        return 0;
+
+    opencl_plugin_release_mode_kernels(plugin);
+    plugin->voxelize_mode = OPENCL_PLUGIN_VOXELIZE_DEFAULT;
+    /* Tuning is per kernel */
+    plugin->tuned = 0;
+
+    if (mode == OPENCL_PLUGIN_VOXELIZE_DEFAULT)
+        return 0;
+
+    options_size = (plugin->build_options ? strlen(plugin->build_options) : 0) + 64;
+    options = malloc(options_size);
+    CHECK_ALLOCATION(options);
+    snprintf(options, options_size, "%s -D VOXELIZE_MODE=%d",
+             plugin->build_options ? plugin->build_options : "", mode);
+
+    if (build_program_from_file("voxelize_modes.cl", "voxelize_common.cl",
+                                options, plugin->context,
+                                plugin->selected_device, &plugin->mode_program,
+                                &plugin->mode_program_key, &err))
+        goto error;
+
+    plugin->voxelize_mode = mode;
+    if (opencl_plugin_create_mode_kernels(plugin, &err))
+        goto error;
+
+    free(options);
+    return 0;
+error:
+    opencl_plugin_release_mode_kernels(plugin);
+    plugin->voxelize_mode = OPENCL_PLUGIN_VOXELIZE_DEFAULT;
+    free(options);
+    return -1;
+}
+
+/* Limit how far device buffers are grown in anticipation of future requests,
+ * in bytes. A negative value removes the limit (the default). */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_set_pool_high_water(opencl_plugin plugin, cl_long bytes)
+{
+    assert(plugin != NULL);
+
+    plugin->pool.high_water_cap = bytes < 0 ? (size_t)-1 : (size_t)bytes;
+}
+
+/* Release all cached device buffers, waiting for outstanding jobs first.
+ * They are reallocated on demand by the next voxelization. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_trim(opencl_plugin plugin)
+{
+    cl_int err;
+    cl_int i;
+
+    assert(plugin != NULL);
+
+    if (plugin->cpu)
+        return 0;
+
     err = clFinish(plugin->queue);
     CHECK_CL_ERROR(err);
-
+    err = clFinish(plugin->readback_queue);
+    CHECK_CL_ERROR(err);
     for (i = 0; i < plugin->num_queues; i++) {
         err = clFinish(plugin->queues[i]);
         CHECK_CL_ERROR(err);
     }
 
-    t2 = clock() - t2;
-    t3 = clock();
-
-    err = clEnqueueReadBuffer(
-        plugin->queue, plugin->voxel_grid_buffer, CL_TRUE, 0,
-        num_voxels, voxel_grid_out, 0, NULL, NULL);
-    CHECK_CL_ERROR(err);
-
-    t3 = clock() - t3;
+    /* Registered meshes are left alone, they can't be re-uploaded without
+     * the caller's data */
+    device_buffer_release(&plugin->pool, &plugin->voxel_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->tile_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->vertex_buffer);
+    device_buffer_release(&plugin->pool, &plugin->triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->packed_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_count_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_coords_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_data_buffer);
+    device_buffer_release(&plugin->pool, &plugin->bin_count_buffer);
+    device_buffer_release(&plugin->pool, &plugin->small_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->large_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->mesh_table_buffer);
+    device_buffer_release(&plugin->pool, &plugin->batched_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->flood_changed_buffer);
+    device_buffer_release(&plugin->pool, &plugin->crossings_buffer);
+    device_buffer_release(&plugin->pool, &plugin->instance_transform_buffer);
+    device_buffer_release(&plugin->pool, &plugin->instance_vertex_buffer);
+    device_buffer_release(&plugin->pool, &plugin->compact_mesh_buffer);
+    device_buffer_release(&plugin->pool, &plugin->label_key_buffer);
+    device_buffer_release(&plugin->pool, &plugin->label_buffer);
+    device_buffer_release(&plugin->pool, &plugin->lod_buffers[0]);
+    device_buffer_release(&plugin->pool, &plugin->lod_buffers[1]);
 
-    TRACE("Clock T1: %f", ((float)t1 * 1000.0f) / CLOCKS_PER_SEC);
-    TRACE("Clock T2: %f", ((float)t2 * 1000.0f) / CLOCKS_PER_SEC);
-    TRACE("Clock T3: %f", ((float)t3 * 1000.0f) / CLOCKS_PER_SEC);
     return 0;
 error:
     return -1;
@@ -776,10 +6263,59 @@ void opencl_plugin_destroy(opencl_plugin plugin)
     cl_int i = 0;
     if (!plugin) return;
 
+    while (plugin->meshes)
+        opencl_plugin_mesh_release(plugin->meshes);
+    while (plugin->staging)
+        opencl_plugin_unmap_staging(plugin->staging);
+    if (plugin->queue)
+        clFinish(plugin->queue);
+
+    opencl_plugin_profile_begin(plugin, 0);
+    free(plugin->profile_records);
+
+    if (!plugin->parent)
+        cpu_voxelizer_destroy(plugin->cpu);
+
+    if (plugin->pack_bits_kernel)
+        clReleaseKernel(plugin->pack_bits_kernel);
+    if (plugin->compact_bricks_kernel)
+        clReleaseKernel(plugin->compact_bricks_kernel);
+    if (plugin->bin_triangles_kernel)
+        clReleaseKernel(plugin->bin_triangles_kernel);
+    if (plugin->batch_triangles_kernel)
+        clReleaseKernel(plugin->batch_triangles_kernel);
+    if (plugin->mark_crossings_kernel)
+        clReleaseKernel(plugin->mark_crossings_kernel);
+    if (plugin->fill_shell_parity_kernel)
+        clReleaseKernel(plugin->fill_shell_parity_kernel);
+    if (plugin->flood_exterior_kernel)
+        clReleaseKernel(plugin->flood_exterior_kernel);
+    if (plugin->finish_flood_fill_kernel)
+        clReleaseKernel(plugin->finish_flood_fill_kernel);
+    if (plugin->transform_vertices_kernel)
+        clReleaseKernel(plugin->transform_vertices_kernel);
+    if (plugin->decode_vertices_kernel)
+        clReleaseKernel(plugin->decode_vertices_kernel);
+    if (plugin->widen_indices_kernel)
+        clReleaseKernel(plugin->widen_indices_kernel);
+    if (plugin->voxelize_labels_kernel)
+        clReleaseKernel(plugin->voxelize_labels_kernel);
+    if (plugin->finish_labels_kernel)
+        clReleaseKernel(plugin->finish_labels_kernel);
+    if (plugin->reduce_grid_kernel)
+        clReleaseKernel(plugin->reduce_grid_kernel);
+    if (plugin->grid_ops_program)
+        clReleaseProgram(plugin->grid_ops_program);
+    opencl_plugin_release_mode_kernels(plugin);
     if (plugin->voxelize_kernel)
         clReleaseKernel(plugin->voxelize_kernel);
+    if (plugin->program)
+        clReleaseProgram(plugin->program);
+    free(plugin->build_options);
     if (plugin->queue)
         clReleaseCommandQueue(plugin->queue);
+    if (plugin->readback_queue)
+        clReleaseCommandQueue(plugin->readback_queue);
     if (plugin->queues) {
         for (i = 0; i < plugin->num_queues; i++) {
             if (plugin->queues[i])
@@ -789,12 +6325,383 @@ void opencl_plugin_destroy(opencl_plugin plugin)
     }
     if (plugin->context)
         clReleaseContext(plugin->context);
-    if (plugin->voxel_grid_buffer)
-        clReleaseMemObject(plugin->voxel_grid_buffer);
-    if (plugin->vertex_buffer)
-        clReleaseMemObject(plugin->vertex_buffer);
-    if (plugin->triangle_buffer)
-        clReleaseMemObject(plugin->triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->voxel_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->tile_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->vertex_buffer);
+    device_buffer_release(&plugin->pool, &plugin->triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->packed_grid_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_count_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_coords_buffer);
+    device_buffer_release(&plugin->pool, &plugin->brick_data_buffer);
+    device_buffer_release(&plugin->pool, &plugin->bin_count_buffer);
+    device_buffer_release(&plugin->pool, &plugin->small_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->large_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->mesh_table_buffer);
+    device_buffer_release(&plugin->pool, &plugin->batched_triangle_buffer);
+    device_buffer_release(&plugin->pool, &plugin->flood_changed_buffer);
+    device_buffer_release(&plugin->pool, &plugin->crossings_buffer);
+    device_buffer_release(&plugin->pool, &plugin->instance_transform_buffer);
+    device_buffer_release(&plugin->pool, &plugin->instance_vertex_buffer);
+    device_buffer_release(&plugin->pool, &plugin->compact_mesh_buffer);
+    device_buffer_release(&plugin->pool, &plugin->label_key_buffer);
+    device_buffer_release(&plugin->pool, &plugin->label_buffer);
+    device_buffer_release(&plugin->pool, &plugin->lod_buffers[0]);
+    device_buffer_release(&plugin->pool, &plugin->lod_buffers[1]);
 
     free(plugin);
 }
+
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_multi_destroy(opencl_plugin_multi multi)
+{
+    cl_int i;
+    if (!multi) return;
+
+    if (multi->plugins) {
+        for (i = 0; i < multi->num_plugins; i++)
+            opencl_plugin_destroy(multi->plugins[i]);
+    }
+    free(multi->plugins);
+    free(multi->weights);
+    free(multi);
+}
+
+/* Create one plugin per selected device, each with its own context and
+ * queues. Devices are found and ranked as by opencl_plugin_create_ex(), and
+ * every plugin uses config's queue count, build options and profiling;
+ * cpu_mode is ignored. config may be NULL for the defaults limited to GPUs.
+ * device_indices picks devices by index among the matching ones, or all of
+ * them if NULL. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_create(const opencl_plugin_config *config,
+                                  const cl_int *device_indices,
+                                  cl_int num_device_indices,
+                                  opencl_plugin_multi *multi_out)
+{
+    cl_int err;
+    cl_int i;
+    opencl_plugin_config default_config;
+    device_candidate *candidates = NULL;
+    cl_uint num_candidates;
+    opencl_plugin_multi multi = NULL;
+
+    assert(multi_out != NULL);
+    assert(device_indices == NULL || num_device_indices > 0);
+
+    if (!config) {
+        opencl_plugin_config_init(&default_config);
+        default_config.device_types = CL_DEVICE_TYPE_GPU;
+        config = &default_config;
+    }
+
+    if (config->num_queues <= 0) {
+        ERROR("Invalid queue count %d", config->num_queues);
+        return -1;
+    }
+
+    if (find_devices(config, &candidates, &num_candidates, &err))
+        goto error;
+
+    multi = calloc(1, sizeof(*multi));
+    CHECK_ALLOCATION(multi);
+
+    multi->num_plugins = device_indices ? num_device_indices : (cl_int)num_candidates;
+    multi->plugins = calloc(multi->num_plugins, sizeof(*multi->plugins));
+    CHECK_ALLOCATION(multi->plugins);
+    multi->weights = calloc(multi->num_plugins, sizeof(*multi->weights));
+    CHECK_ALLOCATION(multi->weights);
+
+    for (i = 0; i < multi->num_plugins; i++) {
+        cl_int idx = device_indices ? device_indices[i] : i;
+
+        if (idx < 0 || (cl_uint)idx >= num_candidates) {
+            ERROR("No device %d, only %u match the plugin config",
+                  idx, num_candidates);
+            goto error;
+        }
+
+        multi->weights[i] = candidates[idx].rank.throughput;
+        if (multi->weights[i] == 0)
+            multi->weights[i] = 1;
+
+        if (opencl_plugin_create_on_device(candidates[idx].platform,
+                                           candidates[idx].device,
+                                           config->num_queues,
+                                           config->build_options,
+                                           config->profiling,
+                                           &multi->plugins[i]))
+            goto error;
+    }
+
+    free(candidates);
+    *multi_out = multi;
+    return 0;
+error:
+    opencl_plugin_multi_destroy(multi);
+    free(candidates);
+    return -1;
+}
+
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_get_device_count(opencl_plugin_multi multi)
+{
+    assert(multi != NULL);
+
+    return multi->num_plugins;
+}
+
+/* The plugin of a single device, for per-device settings. Owned by multi. */
+OPENCL_EXPERIMENTS_EXPORT
+opencl_plugin opencl_plugin_multi_get_plugin(opencl_plugin_multi multi,
+                                             cl_int device_idx)
+{
+    assert(multi != NULL);
+    assert(device_idx >= 0 && device_idx < multi->num_plugins);
+
+    return multi->plugins[device_idx];
+}
+
+/* As opencl_plugin_voxelize_meshes(), with the grid split into z-slabs
+ * sized by each device's compute units x clock. Every device voxelizes its
+ * slab from the full mesh list and reads it straight into its part of
+ * voxel_grid_out. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_multi_voxelize_meshes(opencl_plugin_multi multi,
+                                           float inv_element_size,
+                                           float corner_x,
+                                           float corner_y,
+                                           float corner_z,
+                                           cl_int x_cell_length,
+                                           cl_int y_cell_length,
+                                           cl_int z_cell_length,
+                                           cl_int mesh_data_count,
+                                           mesh_data *mesh_data_list,
+                                           cl_uchar *voxel_grid_out)
+{
+    cl_int err;
+    cl_int i;
+    cl_int z0 = 0;
+    cl_ulong total_weight = 0, weight_so_far = 0;
+    size_t slice_voxels;
+    cl_event *events = NULL;
+    int failed = 0;
+
+    assert(multi != NULL);
+    assert(z_cell_length >= 0);
+
+    events = calloc(multi->num_plugins, sizeof(*events));
+    CHECK_ALLOCATION(events);
+
+    for (i = 0; i < multi->num_plugins; i++) {
+        if (opencl_plugin_check_slab_fill(multi->plugins[i], "multi-device")) {
+            free(events);
+            return -1;
+        }
+    }
+
+    slice_voxels = (size_t)x_cell_length * (size_t)y_cell_length;
+    for (i = 0; i < multi->num_plugins; i++)
+        total_weight += multi->weights[i];
+
+    for (i = 0; i < multi->num_plugins; i++) {
+        voxel_grid_params slab;
+        voxel_output output;
+        cl_int z1;
+
+        weight_so_far += multi->weights[i];
+        z1 = (cl_int)((cl_ulong)z_cell_length * weight_so_far / total_weight);
+        if (z1 == z0)
+            continue;
+
+        init_voxel_grid_params(&slab, inv_element_size, corner_x, corner_y,
+                               corner_z + (float)z0 / inv_element_size,
+                               x_cell_length, y_cell_length, z1 - z0);
+        init_voxel_output(&output, VOXEL_OUTPUT_DENSE,
+                          voxel_grid_out + (size_t)z0 * slice_voxels);
+
+        /* Devices run concurrently, we only wait once all are enqueued */
+        if (opencl_plugin_enqueue_voxelize(multi->plugins[i], &slab,
+                                           mesh_data_count, mesh_data_list,
+                                           &output, &events[i])) {
+            failed = 1;
+            break;
+        }
+
+        z0 = z1;
+    }
+
+    /* Each device has its own context, so wait on the events one by one */
+    for (i = 0; i < multi->num_plugins; i++) {
+        if (!events[i])
+            continue;
+
+        err = clWaitForEvents(1, &events[i]);
+        if (err != CL_SUCCESS) {
+            ERROR("Voxelization failed on device %d: %s", i,
+                  get_cl_error_string(err));
+            failed = 1;
+        }
+        clReleaseEvent(events[i]);
+    }
+
+    free(events);
+    return failed ? -1 : 0;
+error:
+    return -1;
+}
+
+/*
+ * Create a stream of depth (2 or 3 is plenty) workers of plugin, see
+ * opencl_plugin_create_worker(), for voxelizing many parts back to back.
+ * Jobs are handed to the workers in turn, each with its own buffers and
+ * in-order queues, so the readback of one part, the kernels of the next and
+ * the upload of the one after that run at the same time. Each worker
+ * creates its own command queues, a pool of plugin's pool size divided by
+ * depth (at least one) besides its upload and readback queues, so the
+ * stream adds to the device's queues rather than reusing plugin's.
+ */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_create(opencl_plugin plugin,
+                                   cl_int depth,
+                                   opencl_plugin_stream *stream_out)
+{
+    opencl_plugin_stream stream;
+    cl_int i;
+    cl_int num_queues;
+
+    assert(plugin != NULL);
+    assert(stream_out != NULL);
+
+    *stream_out = NULL;
+
+    if (depth <= 0) {
+        ERROR("Invalid stream depth %d", depth);
+        return -1;
+    }
+
+    stream = calloc(1, sizeof(*stream));
+    CHECK_ALLOCATION(stream);
+
+    stream->depth = depth;
+    stream->workers = calloc(depth, sizeof(*stream->workers));
+    CHECK_ALLOCATION(stream->workers);
+    stream->jobs = calloc(depth, sizeof(*stream->jobs));
+    CHECK_ALLOCATION(stream->jobs);
+
+    num_queues = plugin->num_queues / depth > 0 ? plugin->num_queues / depth : 1;
+    for (i = 0; i < depth; i++) {
+        if (opencl_plugin_create_worker(plugin, num_queues, &stream->workers[i]))
+            goto error;
+    }
+
+    *stream_out = stream;
+    return 0;
+error:
+    opencl_plugin_stream_destroy(stream);
+    return -1;
+}
+
+/* Wait for the job last submitted to slot i, if any */
+static cl_int opencl_plugin_stream_wait_slot(opencl_plugin_stream stream,
+                                             cl_int i)
+{
+    cl_int ret;
+
+    if (!stream->jobs[i])
+        return 0;
+
+    ret = opencl_plugin_job_wait(stream->jobs[i]);
+    opencl_plugin_job_release(stream->jobs[i]);
+    stream->jobs[i] = NULL;
+
+    if (ret)
+        ERROR("Streamed job on worker %d failed", i);
+
+    return ret;
+}
+
+/* Like opencl_plugin_voxelize_meshes_async(), on the next worker of the
+ * stream. Only blocks if that worker's previous job hasn't finished yet,
+ * returning -1 if that job failed (in which case this one isn't
+ * submitted). func (may be NULL) is called once this job is done, as with
+ * opencl_plugin_job_set_callback(). The mesh data and voxel_grid_out must
+ * stay valid until then. */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_voxelize_meshes(opencl_plugin_stream stream,
+                                            float inv_element_size,
+                                            float corner_x,
+                                            float corner_y,
+                                            float corner_z,
+                                            cl_int x_cell_length,
+                                            cl_int y_cell_length,
+                                            cl_int z_cell_length,
+                                            cl_int mesh_data_count,
+                                            mesh_data *mesh_data_list,
+                                            cl_uchar *voxel_grid_out,
+                                            job_completion_handler func,
+                                            void *user_data)
+{
+    cl_int i;
+    opencl_plugin_job job;
+
+    assert(stream != NULL);
+
+    i = stream->next;
+    if (opencl_plugin_stream_wait_slot(stream, i))
+        return -1;
+
+    if (opencl_plugin_voxelize_meshes_async(stream->workers[i],
+                                            inv_element_size, corner_x,
+                                            corner_y, corner_z, x_cell_length,
+                                            y_cell_length, z_cell_length,
+                                            mesh_data_count, mesh_data_list,
+                                            voxel_grid_out, &job))
+        return -1;
+
+    if (func && opencl_plugin_job_set_callback(job, func, user_data)) {
+        /* Without the callback the caller can't tell when it's done */
+        opencl_plugin_job_wait(job);
+        opencl_plugin_job_release(job);
+        return -1;
+    }
+
+    stream->jobs[i] = job;
+    stream->next = (i + 1) % stream->depth;
+    return 0;
+}
+
+/* Wait for every job submitted to the stream, returns -1 if any failed */
+OPENCL_EXPERIMENTS_EXPORT
+cl_int opencl_plugin_stream_finish(opencl_plugin_stream stream)
+{
+    cl_int i;
+    cl_int ret = 0;
+
+    assert(stream != NULL);
+
+    /* Oldest first */
+    for (i = 0; i < stream->depth; i++) {
+        if (opencl_plugin_stream_wait_slot(stream, (stream->next + i) % stream->depth))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+/* Waits for outstanding jobs first */
+OPENCL_EXPERIMENTS_EXPORT
+void opencl_plugin_stream_destroy(opencl_plugin_stream stream)
+{
+    cl_int i;
+    if (!stream) return;
+
+    if (stream->jobs)
+        opencl_plugin_stream_finish(stream);
+    if (stream->workers) {
+        for (i = 0; i < stream->depth; i++)
+            opencl_plugin_destroy(stream->workers[i]);
+    }
+    free(stream->workers);
+    free(stream->jobs);
+    free(stream);
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Checks cpu_voxelizer_voxelize() against a brute-force scalar separating
+ * axis test of every triangle against every voxel, for a few scenes and
+ * thread counts. Doesn't use OpenCL, so it runs without any device.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_voxelizer.h"
+
+/* Voxels whose triangle / box distance is within this many voxels of 0 are
+ * too close to call in float and aren't compared */
+#define AMBIGUOUS_DISTANCE 1e-3
+
+/* Grid all scenes are voxelized into, deliberately not a multiple of 4
+ * along x and not at the origin */
+#define GRID_X 23
+#define GRID_Y 17
+#define GRID_Z 11
+#define INV_ELEMENT_SIZE 7.3f
+static const float grid_corner[3] = { -0.37f, 0.21f, -1.13f };
+
+#define MAX_MESHES 3
+
+typedef struct _test_scene {
+    const char *name;
+    mesh_data  meshes[MAX_MESHES];
+    cl_int     num_meshes;
+} test_scene;
+
+static unsigned int random_state = 12345;
+
+static float random_float(float lo, float hi)
+{
+    random_state = random_state * 1103515245u + 12345u;
+    return lo + (hi - lo) * (float)((random_state >> 8) & 0xffffff) / 16777216.0f;
+}
+
+/* Point given in voxel units relative to the grid corner */
+static void set_vertex(mesh_data *mesh, cl_int idx, float x, float y, float z)
+{
+    mesh->vertices[3 * idx + 0] = grid_corner[0] + x / INV_ELEMENT_SIZE;
+    mesh->vertices[3 * idx + 1] = grid_corner[1] + y / INV_ELEMENT_SIZE;
+    mesh->vertices[3 * idx + 2] = grid_corner[2] + z / INV_ELEMENT_SIZE;
+}
+
+static int alloc_mesh(mesh_data *mesh, cl_int num_vertices, cl_int num_triangles)
+{
+    memset(mesh, 0, sizeof(*mesh));
+    mesh->num_vertices = num_vertices;
+    mesh->num_triangles = num_triangles;
+    mesh->vertices = malloc(sizeof(*mesh->vertices) * 3 * (num_vertices > 0 ? num_vertices : 1));
+    mesh->triangles = malloc(sizeof(*mesh->triangles) * 3 * (num_triangles > 0 ? num_triangles : 1));
+    return mesh->vertices && mesh->triangles ? 0 : -1;
+}
+
+/* Independent triangles within [lo, hi) voxels along every axis, each at
+ * most size voxels across */
+static int make_soup(mesh_data *mesh, cl_int num_triangles, float lo, float hi,
+                     float size)
+{
+    cl_int t, i;
+
+    if (alloc_mesh(mesh, 3 * num_triangles, num_triangles))
+        return -1;
+
+    for (t = 0; t < num_triangles; t++) {
+        float cx = random_float(lo, hi);
+        float cy = random_float(lo, hi);
+        float cz = random_float(lo, hi);
+
+        for (i = 0; i < 3; i++) {
+            set_vertex(mesh, 3 * t + i, cx + random_float(-size, size),
+                       cy + random_float(-size, size),
+                       cz + random_float(-size, size));
+            mesh->triangles[3 * t + i] = 3 * t + i;
+        }
+    }
+
+    return 0;
+}
+
+/* Closed box, its faces between voxel centres and boundaries */
+static int make_box(mesh_data *mesh)
+{
+    static const cl_int faces[12][3] = {
+        {0, 2, 1}, {1, 2, 3}, {4, 5, 6}, {5, 7, 6},
+        {0, 1, 4}, {1, 5, 4}, {2, 6, 3}, {3, 6, 7},
+        {0, 4, 2}, {2, 4, 6}, {1, 3, 5}, {3, 7, 5}
+    };
+    static const float lo[3] = { 2.31f, 3.17f, 1.73f };
+    static const float hi[3] = { 19.62f, 12.29f, 8.41f };
+    cl_int i;
+
+    if (alloc_mesh(mesh, 8, 12))
+        return -1;
+
+    for (i = 0; i < 8; i++)
+        set_vertex(mesh, i, i & 1 ? hi[0] : lo[0], i & 2 ? hi[1] : lo[1],
+                   i & 4 ? hi[2] : lo[2]);
+    memcpy(mesh->triangles, faces, sizeof(faces));
+
+    return 0;
+}
+
+static void free_scene(test_scene *scene)
+{
+    cl_int i;
+
+    for (i = 0; i < scene->num_meshes; i++) {
+        free(scene->meshes[i].vertices);
+        free(scene->meshes[i].triangles);
+    }
+}
+
+static double dot(const double a[3], const double b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross(const double a[3], const double b[3], double out[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+/* Distance between the projections of the triangle u (relative to the voxel
+ * centre) and the unit voxel onto axis, positive if they are apart */
+static double axis_distance(const double u[3][3], const double axis[3])
+{
+    double len = sqrt(dot(axis, axis));
+    double p0, p1, p2, lo, hi, r;
+
+    if (len < 1e-9)
+        return -HUGE_VAL;
+
+    p0 = dot(u[0], axis);
+    p1 = dot(u[1], axis);
+    p2 = dot(u[2], axis);
+    lo = fmin(fmin(p0, p1), p2);
+    hi = fmax(fmax(p0, p1), p2);
+    r = 0.5 * (fabs(axis[0]) + fabs(axis[1]) + fabs(axis[2]));
+
+    return fmax(lo - r, -r - hi) / len;
+}
+
+/* Largest distance over all 13 separating axes of the triangle v (in voxel
+ * units) and voxel (x, y, z), positive if they don't overlap */
+static double triangle_voxel_distance(const double v[3][3], cl_int x, cl_int y,
+                                      cl_int z)
+{
+    double c[3], u[3][3], e[3][3], n[3], axis[3];
+    double box_axes[3][3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+    double dist = -HUGE_VAL;
+    int i, j;
+
+    c[0] = x + 0.5;
+    c[1] = y + 0.5;
+    c[2] = z + 0.5;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            u[i][j] = v[i][j] - c[j];
+            e[i][j] = v[(i + 1) % 3][j] - v[i][j];
+        }
+    }
+
+    for (i = 0; i < 3; i++)
+        dist = fmax(dist, axis_distance(u, box_axes[i]));
+
+    cross(e[0], e[1], n);
+    dist = fmax(dist, axis_distance(u, n));
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            cross(box_axes[i], e[j], axis);
+            dist = fmax(dist, axis_distance(u, axis));
+        }
+    }
+
+    return dist;
+}
+
+/* Compares grid against the reference, returns the number of mismatches */
+static long check_grid(const test_scene *scene, const cl_uchar *grid,
+                       long *num_set_out, long *num_ambiguous_out)
+{
+    long num_mismatches = 0, num_set = 0, num_ambiguous = 0;
+    cl_int x, y, z, m, t;
+    int i, j;
+
+    for (z = 0; z < GRID_Z; z++) {
+        for (y = 0; y < GRID_Y; y++) {
+            for (x = 0; x < GRID_X; x++) {
+                double dist = HUGE_VAL;
+                int expected;
+                cl_uchar actual = grid[((size_t)z * GRID_Y + y) * GRID_X + x];
+
+                for (m = 0; m < scene->num_meshes; m++) {
+                    const mesh_data *mesh = &scene->meshes[m];
+
+                    for (t = 0; t < mesh->num_triangles; t++) {
+                        double v[3][3];
+
+                        /* Same float transform as the voxelizer */
+                        for (i = 0; i < 3; i++) {
+                            const float *p = mesh->vertices + 3 * mesh->triangles[3 * t + i];
+                            for (j = 0; j < 3; j++)
+                                v[i][j] = (p[j] - grid_corner[j]) * INV_ELEMENT_SIZE;
+                        }
+                        dist = fmin(dist, triangle_voxel_distance(v, x, y, z));
+                    }
+                }
+
+                if (fabs(dist) < AMBIGUOUS_DISTANCE) {
+                    num_ambiguous++;
+                    continue;
+                }
+                expected = dist < 0;
+                num_set += expected;
+                if (actual != expected) {
+                    if (num_mismatches < 10)
+                        fprintf(stderr, "  voxel (%d, %d, %d): got %u, expected %d (distance %g)\n",
+                                x, y, z, actual, expected, dist);
+                    num_mismatches++;
+                }
+            }
+        }
+    }
+
+    *num_set_out = num_set;
+    *num_ambiguous_out = num_ambiguous;
+    return num_mismatches;
+}
+
+static int run_scene(const test_scene *scene, int num_threads, cl_uchar *grid)
+{
+    cpu_voxelizer voxelizer = NULL;
+    long num_mismatches, num_set, num_ambiguous;
+    int run;
+    int ret = -1;
+
+    if (cpu_voxelizer_create(num_threads, &voxelizer)) {
+        fprintf(stderr, "Failed to create a CPU voxelizer\n");
+        return -1;
+    }
+
+    /* Twice on one voxelizer, each over a dirty grid */
+    for (run = 0; run < 2; run++) {
+        memset(grid, 0xab, (size_t)GRID_X * GRID_Y * GRID_Z);
+
+        if (cpu_voxelizer_voxelize(voxelizer, INV_ELEMENT_SIZE, grid_corner[0],
+                                   grid_corner[1], grid_corner[2], GRID_X,
+                                   GRID_Y, GRID_Z, scene->num_meshes,
+                                   scene->meshes, grid)) {
+            fprintf(stderr, "%s, %d threads: voxelize failed\n", scene->name,
+                    cpu_voxelizer_num_threads(voxelizer));
+            goto error;
+        }
+
+        num_mismatches = check_grid(scene, grid, &num_set, &num_ambiguous);
+        printf("%-6s %2d threads, run %d: %ld set, %ld ambiguous, %ld mismatches\n",
+               scene->name, cpu_voxelizer_num_threads(voxelizer), run, num_set,
+               num_ambiguous, num_mismatches);
+        if (num_mismatches > 0 || num_set == 0)
+            goto error;
+    }
+
+    ret = 0;
+error:
+    cpu_voxelizer_destroy(voxelizer);
+    return ret;
+}
+
+int main(void)
+{
+    static const int thread_counts[] = { 1, 2, 7, 0 };
+    test_scene scenes[3];
+    cl_uchar *grid = NULL;
+    int s, k;
+    int ret = EXIT_FAILURE;
+
+    memset(scenes, 0, sizeof(scenes));
+
+    scenes[0].name = "box";
+    scenes[0].num_meshes = 1;
+    /* Small triangles, an empty mesh to skip, then large triangles poking
+     * out of the grid */
+    scenes[1].name = "soup";
+    scenes[1].num_meshes = 3;
+    scenes[2].name = "large";
+    scenes[2].num_meshes = 1;
+    if (make_box(&scenes[0].meshes[0]) ||
+        make_soup(&scenes[1].meshes[0], 150, -1.0f, 24.0f, 2.0f) ||
+        alloc_mesh(&scenes[1].meshes[1], 0, 0) ||
+        make_soup(&scenes[1].meshes[2], 20, 0.0f, 23.0f, 12.0f) ||
+        make_soup(&scenes[2].meshes[0], 4, 5.0f, 15.0f, 40.0f)) {
+        fprintf(stderr, "Failed to allocate the test meshes\n");
+        goto error;
+    }
+
+    grid = malloc((size_t)GRID_X * GRID_Y * GRID_Z);
+    if (!grid) {
+        fprintf(stderr, "Failed to allocate the grid\n");
+        goto error;
+    }
+
+    for (s = 0; s < 3; s++) {
+        for (k = 0; k < 4; k++) {
+            if (run_scene(&scenes[s], thread_counts[k], grid))
+                goto error;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+error:
+    free(grid);
+    for (s = 0; s < 3; s++)
+        free_scene(&scenes[s]);
+    return ret;
+}
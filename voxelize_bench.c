@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Throughput benchmark for the exported opencl_plugin_* API. Voxelizes
+ * synthetic scenes, or OBJ / STL files, over a sweep of grid resolutions and
+ * mesh counts and reports latency percentiles and triangle throughput. Run
+ * from a directory containing program.cl and grid_ops.cl.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "opencl_plugin.h"
+
+#define PI 3.14159265358979323846
+
+/* All scenes are normalized to this cube, the grid covers it plus a margin */
+#define SCENE_EXTENT 1.0f
+#define GRID_EXTENT 1.05f
+
+#define MAX_SWEEP 32
+
+typedef struct _bench_mesh {
+    float  *vertices;
+    cl_int num_vertices;
+    cl_int vertex_capacity;
+    cl_int *triangles;
+    cl_int num_triangles;
+    cl_int triangle_capacity;
+} bench_mesh;
+
+enum workload {
+    WORKLOAD_SPHERE,
+    WORKLOAD_SOUP,
+    WORKLOAD_MANY_SMALL,
+    WORKLOAD_FEW_LARGE,
+    WORKLOAD_FILES
+};
+
+static const char *workload_names[] = {
+    "sphere", "soup", "many-small", "few-large", "files"
+};
+
+typedef struct _bench_options {
+    enum workload workload;
+    cl_int        iterations;
+    cl_int        total_triangles;
+    cl_int        resolutions[MAX_SWEEP];
+    cl_int        num_resolutions;
+    cl_int        mesh_counts[MAX_SWEEP];
+    cl_int        num_mesh_counts;
+    cl_int        profiling;
+    cl_int        binning;
+    cl_int        batching;
+    const char    **files;
+    cl_int        num_files;
+} bench_options;
+
+static double now_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void print_handler(const char *filename,
+                          cl_int line,
+                          cl_int msg_type,
+                          const char *msg)
+{
+    /* Traces are per job and would swamp the results */
+    if (msg_type == LOGGING_MSG_TRACE)
+        return;
+
+    if (filename)
+        fprintf(stderr, "%s:%d: %s\n", filename, line, msg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+/* Deterministic, so runs are comparable */
+static unsigned int rng_state = 12345;
+
+static float random_float(float lo, float hi)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return lo + (hi - lo) * (float)((rng_state >> 8) & 0xFFFFFF) / (float)0xFFFFFF;
+}
+
+static void bench_mesh_free(bench_mesh *mesh)
+{
+    free(mesh->vertices);
+    free(mesh->triangles);
+    memset(mesh, 0, sizeof(*mesh));
+}
+
+static int bench_mesh_add_vertex(bench_mesh *mesh, float x, float y, float z)
+{
+    if (mesh->num_vertices == mesh->vertex_capacity) {
+        cl_int capacity = mesh->vertex_capacity ? mesh->vertex_capacity * 2 : 256;
+        float *vertices = realloc(mesh->vertices,
+                                  sizeof(*vertices) * 3 * capacity);
+        if (!vertices)
+            return -1;
+        mesh->vertices = vertices;
+        mesh->vertex_capacity = capacity;
+    }
+
+    mesh->vertices[3 * mesh->num_vertices + 0] = x;
+    mesh->vertices[3 * mesh->num_vertices + 1] = y;
+    mesh->vertices[3 * mesh->num_vertices + 2] = z;
+    mesh->num_vertices++;
+    return 0;
+}
+
+static int bench_mesh_add_triangle(bench_mesh *mesh, cl_int a, cl_int b, cl_int c)
+{
+    if (mesh->num_triangles == mesh->triangle_capacity) {
+        cl_int capacity = mesh->triangle_capacity ? mesh->triangle_capacity * 2 : 256;
+        cl_int *triangles = realloc(mesh->triangles,
+                                    sizeof(*triangles) * 3 * capacity);
+        if (!triangles)
+            return -1;
+        mesh->triangles = triangles;
+        mesh->triangle_capacity = capacity;
+    }
+
+    mesh->triangles[3 * mesh->num_triangles + 0] = a;
+    mesh->triangles[3 * mesh->num_triangles + 1] = b;
+    mesh->triangles[3 * mesh->num_triangles + 2] = c;
+    mesh->num_triangles++;
+    return 0;
+}
+
+/* UV sphere with about num_triangles triangles */
+static int make_sphere(bench_mesh *mesh,
+                       float cx, float cy, float cz,
+                       float radius,
+                       cl_int num_triangles)
+{
+    cl_int segments, rings, r, s;
+
+    /* 2 * segments * rings triangles, with rings = segments / 2 */
+    segments = (cl_int)sqrt((double)num_triangles);
+    if (segments < 4)
+        segments = 4;
+    rings = segments / 2;
+
+    for (r = 0; r <= rings; r++) {
+        double theta = PI * r / rings;
+        for (s = 0; s <= segments; s++) {
+            double phi = 2.0 * PI * s / segments;
+            if (bench_mesh_add_vertex(mesh,
+                                      cx + radius * (float)(sin(theta) * cos(phi)),
+                                      cy + radius * (float)(sin(theta) * sin(phi)),
+                                      cz + radius * (float)cos(theta)))
+                return -1;
+        }
+    }
+
+    for (r = 0; r < rings; r++) {
+        for (s = 0; s < segments; s++) {
+            cl_int i0 = r * (segments + 1) + s;
+            cl_int i1 = i0 + segments + 1;
+            if (bench_mesh_add_triangle(mesh, i0, i1, i0 + 1) ||
+                bench_mesh_add_triangle(mesh, i0 + 1, i1, i1 + 1))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Unconnected triangles with edges of up to size, inside the scene cube */
+static int make_soup(bench_mesh *mesh, float size, cl_int num_triangles)
+{
+    cl_int i, j;
+    float half = size / 2;
+
+    for (i = 0; i < num_triangles; i++) {
+        float cx = random_float(-SCENE_EXTENT + half, SCENE_EXTENT - half);
+        float cy = random_float(-SCENE_EXTENT + half, SCENE_EXTENT - half);
+        float cz = random_float(-SCENE_EXTENT + half, SCENE_EXTENT - half);
+
+        for (j = 0; j < 3; j++) {
+            if (bench_mesh_add_vertex(mesh,
+                                      cx + random_float(-half, half),
+                                      cy + random_float(-half, half),
+                                      cz + random_float(-half, half)))
+                return -1;
+        }
+        if (bench_mesh_add_triangle(mesh, 3 * i, 3 * i + 1, 3 * i + 2))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* OBJ vertices and faces only, polygons are fanned into triangles */
+static int load_obj(const char *filename, bench_mesh *mesh)
+{
+    FILE *file;
+    char line[4096];
+
+    file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Couldn't open \"%s\"\n", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == 'v' && line[1] == ' ') {
+            float x, y, z;
+            if (sscanf(line + 2, "%f %f %f", &x, &y, &z) == 3 &&
+                bench_mesh_add_vertex(mesh, x, y, z))
+                goto error;
+        } else if (line[0] == 'f' && line[1] == ' ') {
+            char *p = line + 2;
+            cl_int idx[3], n = 0;
+            long v;
+
+            /* Only the position index of each v/vt/vn entry matters */
+            while ((v = strtol(p, &p, 10)) != 0) {
+                cl_int i = v < 0 ? mesh->num_vertices + (cl_int)v : (cl_int)v - 1;
+                while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+                    p++;
+
+                if (n < 2) {
+                    idx[n++] = i;
+                    continue;
+                }
+                idx[2] = i;
+                if (bench_mesh_add_triangle(mesh, idx[0], idx[1], idx[2]))
+                    goto error;
+                idx[1] = idx[2];
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+error:
+    fclose(file);
+    return -1;
+}
+
+/* Binary or ASCII STL, without merging shared vertices */
+static int load_stl(const char *filename, bench_mesh *mesh)
+{
+    FILE *file;
+    unsigned char header[84];
+    unsigned int num_facets, i, j;
+    long file_size;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Couldn't open \"%s\"\n", filename);
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header))
+        goto ascii;
+
+    num_facets = header[80] | (header[81] << 8) | (header[82] << 16) |
+        ((unsigned int)header[83] << 24);
+    /* ASCII files start with "solid" too, so trust the size instead */
+    if ((long)(84 + 50 * (unsigned long)num_facets) != file_size)
+        goto ascii;
+
+    for (i = 0; i < num_facets; i++) {
+        float facet[12];
+        unsigned char attribute[2];
+
+        if (fread(facet, sizeof(float), 12, file) != 12 ||
+            fread(attribute, 1, 2, file) != 2)
+            goto error;
+
+        /* Skip the normal */
+        for (j = 1; j < 4; j++) {
+            if (bench_mesh_add_vertex(mesh, facet[3 * j], facet[3 * j + 1],
+                                      facet[3 * j + 2]))
+                goto error;
+        }
+        if (bench_mesh_add_triangle(mesh, mesh->num_vertices - 3,
+                                    mesh->num_vertices - 2,
+                                    mesh->num_vertices - 1))
+            goto error;
+    }
+
+    fclose(file);
+    return 0;
+ascii:
+    {
+        char line[4096];
+        cl_int n = 0;
+
+        fclose(file);
+        file = fopen(filename, "r");
+        if (!file)
+            return -1;
+
+        while (fgets(line, sizeof(line), file)) {
+            float x, y, z;
+            char *p = line;
+
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (strncmp(p, "vertex", 6) != 0 ||
+                sscanf(p + 6, "%f %f %f", &x, &y, &z) != 3)
+                continue;
+
+            if (bench_mesh_add_vertex(mesh, x, y, z))
+                goto error;
+            if (++n % 3 == 0 &&
+                bench_mesh_add_triangle(mesh, n - 3, n - 2, n - 1))
+                goto error;
+        }
+    }
+
+    fclose(file);
+    return 0;
+error:
+    fclose(file);
+    return -1;
+}
+
+static int load_mesh_file(const char *filename, bench_mesh *mesh)
+{
+    const char *ext = strrchr(filename, '.');
+
+    if (ext && (strcmp(ext, ".stl") == 0 || strcmp(ext, ".STL") == 0))
+        return load_stl(filename, mesh);
+
+    return load_obj(filename, mesh);
+}
+
+/* Uniformly scale and centre all meshes into the scene cube */
+static void normalize_meshes(bench_mesh *meshes, cl_int num_meshes)
+{
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    float centre[3], scale, extent = 0;
+    cl_int i, j, k;
+
+    for (i = 0; i < num_meshes; i++) {
+        for (j = 0; j < meshes[i].num_vertices; j++) {
+            for (k = 0; k < 3; k++) {
+                float v = meshes[i].vertices[3 * j + k];
+                lo[k] = v < lo[k] ? v : lo[k];
+                hi[k] = v > hi[k] ? v : hi[k];
+            }
+        }
+    }
+
+    for (k = 0; k < 3; k++) {
+        centre[k] = (lo[k] + hi[k]) / 2;
+        if (hi[k] - lo[k] > extent)
+            extent = hi[k] - lo[k];
+    }
+    if (!(extent > 0))
+        return;
+    scale = 2 * SCENE_EXTENT / extent;
+
+    for (i = 0; i < num_meshes; i++) {
+        for (j = 0; j < meshes[i].num_vertices; j++) {
+            for (k = 0; k < 3; k++) {
+                float *v = &meshes[i].vertices[3 * j + k];
+                *v = (*v - centre[k]) * scale;
+            }
+        }
+    }
+}
+
+static int make_scene(const bench_options *options,
+                      cl_int mesh_count,
+                      bench_mesh *meshes)
+{
+    cl_int i;
+    cl_int per_mesh = options->total_triangles / mesh_count;
+    cl_int side;
+
+    if (per_mesh < 1)
+        per_mesh = 1;
+
+    rng_state = 12345;
+
+    switch (options->workload) {
+    case WORKLOAD_SPHERE:
+        /* Spheres on a lattice filling the scene cube */
+        side = (cl_int)ceil(cbrt((double)mesh_count));
+        for (i = 0; i < mesh_count; i++) {
+            float cell = 2 * SCENE_EXTENT / side;
+            float cx = -SCENE_EXTENT + cell * (i % side + 0.5f);
+            float cy = -SCENE_EXTENT + cell * ((i / side) % side + 0.5f);
+            float cz = -SCENE_EXTENT + cell * (i / (side * side) + 0.5f);
+            if (make_sphere(&meshes[i], cx, cy, cz, 0.45f * cell, per_mesh))
+                return -1;
+        }
+        break;
+    case WORKLOAD_SOUP:
+        for (i = 0; i < mesh_count; i++) {
+            if (make_soup(&meshes[i], 0.05f, per_mesh))
+                return -1;
+        }
+        break;
+    case WORKLOAD_MANY_SMALL:
+        for (i = 0; i < mesh_count; i++) {
+            if (make_soup(&meshes[i], 0.005f, per_mesh))
+                return -1;
+        }
+        break;
+    case WORKLOAD_FEW_LARGE:
+        for (i = 0; i < mesh_count; i++) {
+            if (make_soup(&meshes[i], 1.0f, per_mesh))
+                return -1;
+        }
+        break;
+    case WORKLOAD_FILES:
+        for (i = 0; i < mesh_count; i++) {
+            if (load_mesh_file(options->files[i], &meshes[i]))
+                return -1;
+        }
+        normalize_meshes(meshes, mesh_count);
+        break;
+    }
+
+    return 0;
+}
+
+/* Describe the meshes as laid out consecutively by the plugin */
+static void init_mesh_data(const bench_mesh *meshes,
+                           cl_int mesh_count,
+                           mesh_data *mesh_data_list)
+{
+    cl_int i, j, k;
+    cl_int vertex_base = 0, triangle_base = 0;
+
+    for (i = 0; i < mesh_count; i++) {
+        mesh_data *data = &mesh_data_list[i];
+        float lo[3] = {INFINITY, INFINITY, INFINITY};
+        float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+        for (j = 0; j < meshes[i].num_vertices; j++) {
+            for (k = 0; k < 3; k++) {
+                float v = meshes[i].vertices[3 * j + k];
+                lo[k] = v < lo[k] ? v : lo[k];
+                hi[k] = v > hi[k] ? v : hi[k];
+            }
+        }
+
+        memset(data, 0, sizeof(*data));
+        data->vertices = meshes[i].vertices;
+        data->num_vertices = meshes[i].num_vertices;
+        data->triangles = meshes[i].triangles;
+        data->num_triangles = meshes[i].num_triangles;
+        data->vertex_buffer_base_idx = vertex_base;
+        data->triangle_buffer_base_idx = triangle_base;
+        data->part_idx = i;
+        data->bounds_min_x = lo[0];
+        data->bounds_min_y = lo[1];
+        data->bounds_min_z = lo[2];
+        data->bounds_max_x = hi[0];
+        data->bounds_max_y = hi[1];
+        data->bounds_max_z = hi[2];
+
+        vertex_base += meshes[i].num_vertices;
+        triangle_base += meshes[i].num_triangles;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, cl_int n, double p)
+{
+    return sorted[(cl_int)(p * (n - 1) + 0.5)];
+}
+
+static int run_config(opencl_plugin plugin,
+                      const bench_options *options,
+                      cl_int resolution,
+                      cl_int mesh_count)
+{
+    bench_mesh *meshes = NULL;
+    mesh_data *mesh_data_list = NULL;
+    cl_uchar *grid = NULL;
+    double *latencies = NULL;
+    cl_int i, num_triangles = 0;
+    float inv_element_size = resolution / (2 * GRID_EXTENT);
+    double p50;
+    int ret = -1;
+
+    meshes = calloc(mesh_count, sizeof(*meshes));
+    mesh_data_list = calloc(mesh_count, sizeof(*mesh_data_list));
+    grid = malloc((size_t)resolution * resolution * resolution);
+    latencies = malloc(sizeof(*latencies) * options->iterations);
+    if (!meshes || !mesh_data_list || !grid || !latencies) {
+        fprintf(stderr, "Out of memory for %d^3 grid with %d meshes\n",
+                resolution, mesh_count);
+        goto error;
+    }
+
+    if (make_scene(options, mesh_count, meshes))
+        goto error;
+    init_mesh_data(meshes, mesh_count, mesh_data_list);
+    for (i = 0; i < mesh_count; i++)
+        num_triangles += meshes[i].num_triangles;
+
+    /* Warm up, first use allocates the device buffers */
+    if (opencl_plugin_voxelize_meshes(plugin, inv_element_size, -GRID_EXTENT,
+                                      -GRID_EXTENT, -GRID_EXTENT, resolution,
+                                      resolution, resolution, mesh_count,
+                                      mesh_data_list, grid))
+        goto error;
+
+    for (i = 0; i < options->iterations; i++) {
+        double t = now_seconds();
+        if (opencl_plugin_voxelize_meshes(plugin, inv_element_size,
+                                          -GRID_EXTENT, -GRID_EXTENT,
+                                          -GRID_EXTENT, resolution, resolution,
+                                          resolution, mesh_count,
+                                          mesh_data_list, grid))
+            goto error;
+        latencies[i] = now_seconds() - t;
+    }
+
+    qsort(latencies, options->iterations, sizeof(*latencies), compare_doubles);
+    p50 = percentile(latencies, options->iterations, 0.5);
+
+    printf("%-10s %6d %7d %10d %9.3f %9.3f %9.3f %9.3f %9.3f %9.2f\n",
+           workload_names[options->workload], resolution, mesh_count,
+           num_triangles, 1e3 * latencies[0], 1e3 * p50,
+           1e3 * percentile(latencies, options->iterations, 0.9),
+           1e3 * percentile(latencies, options->iterations, 0.99),
+           1e3 * latencies[options->iterations - 1],
+           p50 > 0 ? num_triangles / p50 * 1e-6 : 0.0);
+
+    if (options->profiling) {
+        opencl_plugin_stats stats;
+        if (opencl_plugin_get_stats(plugin, &stats) == 0) {
+            printf("%-10s device: fill %.3f ms, upload %.3f ms (%llu B), "
+                   "kernels %.3f ms, readback %.3f ms (%llu B), "
+                   "total %.3f ms\n", "",
+                   stats.fill_ns * 1e-6, stats.upload_ns * 1e-6,
+                   (unsigned long long)stats.bytes_uploaded,
+                   stats.kernel_ns * 1e-6, stats.readback_ns * 1e-6,
+                   (unsigned long long)stats.bytes_read,
+                   stats.total_ns * 1e-6);
+        }
+    }
+
+    ret = 0;
+error:
+    if (meshes) {
+        for (i = 0; i < mesh_count; i++)
+            bench_mesh_free(&meshes[i]);
+    }
+    free(meshes);
+    free(mesh_data_list);
+    free(grid);
+    free(latencies);
+    return ret;
+}
+
+static cl_int parse_list(const char *str, cl_int *values, cl_int max_values)
+{
+    cl_int n = 0;
+    char *end;
+
+    while (*str && n < max_values) {
+        long v = strtol(str, &end, 10);
+        if (end == str || v <= 0)
+            return -1;
+        values[n++] = (cl_int)v;
+        str = *end == ',' ? end + 1 : end;
+    }
+
+    return n > 0 ? n : -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [mesh.obj|mesh.stl ...]\n"
+            "  -w, --workload NAME      sphere, soup, many-small or few-large\n"
+            "                           (default sphere, ignored with files)\n"
+            "  -r, --resolutions LIST   grid resolutions to sweep (default 64,128,256)\n"
+            "  -m, --mesh-counts LIST   mesh counts to sweep (default 1,16,256)\n"
+            "  -t, --triangles N        triangles per scene (default 100000)\n"
+            "  -n, --iterations N       timed runs per configuration (default 20)\n"
+            "  -p, --profile            report device timings\n"
+            "  -b, --binning            enable triangle binning\n"
+            "  -B, --batching           enable batched launches\n",
+            argv0);
+}
+
+static int parse_options(int argc, char **argv, bench_options *options)
+{
+    int i;
+    cl_int w;
+
+    memset(options, 0, sizeof(*options));
+    options->workload = WORKLOAD_SPHERE;
+    options->iterations = 20;
+    options->total_triangles = 100000;
+    options->num_resolutions = parse_list("64,128,256", options->resolutions,
+                                          MAX_SWEEP);
+    options->num_mesh_counts = parse_list("1,16,256", options->mesh_counts,
+                                          MAX_SWEEP);
+    options->files = malloc(sizeof(*options->files) * (argc > 0 ? argc : 1));
+    if (!options->files)
+        return -1;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(arg, "-p") || !strcmp(arg, "--profile")) {
+            options->profiling = 1;
+        } else if (!strcmp(arg, "-b") || !strcmp(arg, "--binning")) {
+            options->binning = 1;
+        } else if (!strcmp(arg, "-B") || !strcmp(arg, "--batching")) {
+            options->batching = 1;
+        } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            return -1;
+        } else if (arg[0] == '-') {
+            if (!value)
+                return -1;
+            i++;
+
+            if (!strcmp(arg, "-w") || !strcmp(arg, "--workload")) {
+                for (w = 0; w < WORKLOAD_FILES; w++) {
+                    if (!strcmp(value, workload_names[w]))
+                        break;
+                }
+                if (w == WORKLOAD_FILES)
+                    return -1;
+                options->workload = (enum workload)w;
+            } else if (!strcmp(arg, "-r") || !strcmp(arg, "--resolutions")) {
+                options->num_resolutions = parse_list(value, options->resolutions,
+                                                      MAX_SWEEP);
+                if (options->num_resolutions < 0)
+                    return -1;
+            } else if (!strcmp(arg, "-m") || !strcmp(arg, "--mesh-counts")) {
+                options->num_mesh_counts = parse_list(value, options->mesh_counts,
+                                                      MAX_SWEEP);
+                if (options->num_mesh_counts < 0)
+                    return -1;
+            } else if (!strcmp(arg, "-t") || !strcmp(arg, "--triangles")) {
+                if (parse_list(value, &options->total_triangles, 1) != 1)
+                    return -1;
+            } else if (!strcmp(arg, "-n") || !strcmp(arg, "--iterations")) {
+                if (parse_list(value, &options->iterations, 1) != 1)
+                    return -1;
+            } else {
+                return -1;
+            }
+        } else {
+            options->files[options->num_files++] = arg;
+        }
+    }
+
+    /* Files make up a single scene of one mesh each */
+    if (options->num_files > 0) {
+        options->workload = WORKLOAD_FILES;
+        options->mesh_counts[0] = options->num_files;
+        options->num_mesh_counts = 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    opencl_plugin_config config;
+    opencl_plugin plugin = NULL;
+    cl_int r, m;
+    int ret = EXIT_FAILURE;
+
+    if (parse_options(argc, argv, &options)) {
+        usage(argv[0]);
+        free((void *)options.files);
+        return EXIT_FAILURE;
+    }
+
+    init_debug_print_handler(print_handler);
+
+    opencl_plugin_config_init(&config);
+    config.profiling = options.profiling;
+    if (opencl_plugin_create_ex(&config, &plugin)) {
+        fprintf(stderr, "Failed to create plugin\n");
+        goto error;
+    }
+    opencl_plugin_set_binning(plugin, options.binning, 16.0f);
+    opencl_plugin_set_batching(plugin, options.batching);
+    /* init_mesh_data() computes real bounds */
+    opencl_plugin_set_mesh_bounds(plugin, 1);
+
+    printf("%-10s %6s %7s %10s %9s %9s %9s %9s %9s %9s\n", "workload", "res",
+           "meshes", "triangles", "min ms", "p50 ms", "p90 ms", "p99 ms",
+           "max ms", "Mtris/s");
+
+    for (r = 0; r < options.num_resolutions; r++) {
+        for (m = 0; m < options.num_mesh_counts; m++) {
+            if (run_config(plugin, &options, options.resolutions[r],
+                           options.mesh_counts[m]))
+                goto error;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+error:
+    opencl_plugin_destroy(plugin);
+    free((void *)options.files);
+    return ret;
+}
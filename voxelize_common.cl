@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Helpers shared by the kernels of voxelize_modes.cl and grid_ops.cl, which
+ * are built with this file prepended.
+ */
+
+/* Triangle i of a launch, in voxel space (a voxel spans [x, x + 1) etc.) */
+void load_triangle(__global const float *vertices,
+                   __global const int *triangles,
+                   uint vertex_buffer_base_idx,
+                   uint triangle_buffer_base_idx,
+                   int i,
+                   float3 corner,
+                   float inv_element_size,
+                   float3 *v0, float3 *v1, float3 *v2)
+{
+    int3 tri = vload3((size_t)triangle_buffer_base_idx + i, triangles) +
+        (int3)(vertex_buffer_base_idx);
+
+    *v0 = (vload3(tri.x, vertices) - corner) * inv_element_size;
+    *v1 = (vload3(tri.y, vertices) - corner) * inv_element_size;
+    *v2 = (vload3(tri.z, vertices) - corner) * inv_element_size;
+}
+
+/* Separating axes against unit voxels besides the grid axes, which the
+ * bounding box already covers: the triangle normal and the cross products
+ * of the edges with the grid axes */
+#define NUM_SAT_AXES 10
+
+/* A triangle projected once per separating axis, so each voxel only needs
+ * the projection of its centre, see triangle_sat_overlaps() */
+typedef struct {
+    float3 axis[NUM_SAT_AXES];
+    float  lo[NUM_SAT_AXES];
+    float  hi[NUM_SAT_AXES];
+    float  r[NUM_SAT_AXES];
+} triangle_sat;
+
+/* Voxels of a grid of size grid_max + 1 within the triangle's bounding
+ * box, false if there are none */
+bool triangle_voxel_bounds(float3 v0, float3 v1, float3 v2, int3 grid_max,
+                           int3 *lo, int3 *hi)
+{
+    *lo = max(convert_int3_rtn(fmin(fmin(v0, v1), v2)), (int3)(0));
+    *hi = min(convert_int3_rtn(fmax(fmax(v0, v1), v2)), grid_max);
+
+    return !any(*lo > *hi);
+}
+
+void triangle_sat_init(triangle_sat *sat, float3 v0, float3 v1, float3 v2)
+{
+    float3 e[3], grid_axis[3];
+    int j, k, n;
+
+    e[0] = v1 - v0;
+    e[1] = v2 - v1;
+    e[2] = v0 - v2;
+    grid_axis[0] = (float3)(1.0f, 0.0f, 0.0f);
+    grid_axis[1] = (float3)(0.0f, 1.0f, 0.0f);
+    grid_axis[2] = (float3)(0.0f, 0.0f, 1.0f);
+
+    n = 0;
+    sat->axis[n++] = cross(e[0], e[1]);
+    for (j = 0; j < 3; j++) {
+        for (k = 0; k < 3; k++)
+            sat->axis[n++] = cross(grid_axis[k], e[j]);
+    }
+    for (j = 0; j < NUM_SAT_AXES; j++) {
+        float p0 = dot(sat->axis[j], v0);
+        float p1 = dot(sat->axis[j], v1);
+        float p2 = dot(sat->axis[j], v2);
+        float3 a = fabs(sat->axis[j]);
+        sat->lo[j] = fmin(fmin(p0, p1), p2);
+        sat->hi[j] = fmax(fmax(p0, p1), p2);
+        sat->r[j] = 0.5f * (a.x + a.y + a.z);
+    }
+}
+
+/* Whether the triangle overlaps voxel (x, y, z), which must be within its
+ * bounding box: the separating axis test of Akenine-Möller. The voxels
+ * that pass are 6-separating, no 6-connected path of empty voxels crosses
+ * the surface. */
+bool triangle_sat_overlaps(const triangle_sat *sat, int x, int y, int z)
+{
+    float3 c = (float3)(x + 0.5f, y + 0.5f, z + 0.5f);
+    int j;
+
+    for (j = 0; j < NUM_SAT_AXES; j++) {
+        float pc = dot(sat->axis[j], c);
+        if (!(sat->lo[j] - pc <= sat->r[j] && sat->hi[j] - pc >= -sat->r[j]))
+            return false;
+    }
+
+    return true;
+}
+
+/* Whether p is inside edge a -> b of a triangle with the given orientation
+ * in the xy plane. Points on an edge count for exactly one of two triangles
+ * facing the same way that share it, so no crossing is counted twice. */
+bool edge_inside(float2 a, float2 b, float2 p, float orientation)
+{
+    float2 n = (float2)(a.y - b.y, b.x - a.x) * orientation;
+    float w = dot(n, p - a);
+
+    return w > 0.0f ||
+        (w == 0.0f && (n.x > 0.0f || (n.x == 0.0f && n.y > 0.0f)));
+}
+
+/* Flip voxel idx between 0 and 1. Triangles of concurrent launches can hit
+ * the same voxel, and there are no byte atomics, so this goes through the
+ * word containing it (voxel buffers are sized in whole words). */
+void toggle_voxel(__global uchar *grid, size_t idx)
+{
+    __global uint *word = (__global uint *)(grid + (idx & ~(size_t)3));
+#ifdef __ENDIAN_LITTLE__
+    uint shift = (uint)(idx & 3) * 8;
+#else
+    uint shift = (uint)(3 - (idx & 3)) * 8;
+#endif
+
+    atomic_xor(word, 1u << shift);
+}
+
+/* The triangle (v0, v1, v2) crosses the line of voxel centres through
+ * column (x, y) along z: toggle the first voxel whose centre lies above
+ * the crossing. Crossings below the grid toggle voxel 0, those above it
+ * are dropped. n is the triangle's normal, whose z must not be 0. */
+void toggle_column_crossings(__global uchar *grid,
+                             float3 v0, float3 v1, float3 v2, float3 n,
+                             int x_cell_length,
+                             int y_cell_length,
+                             int z_cell_length,
+                             size_t x_stride,
+                             size_t y_stride,
+                             size_t z_stride)
+{
+    float orientation = n.z > 0.0f ? 1.0f : -1.0f;
+    float2 a = v0.xy, b = v1.xy, c = v2.xy;
+    float2 lo, hi;
+    int x0, x1, y0, y1, x, y, z;
+
+    /* Columns whose centre is within the bounds */
+    lo = fmin(fmin(a, b), c);
+    hi = fmax(fmax(a, b), c);
+    x0 = max((int)ceil(lo.x - 0.5f), 0);
+    y0 = max((int)ceil(lo.y - 0.5f), 0);
+    x1 = min((int)floor(hi.x - 0.5f), x_cell_length - 1);
+    y1 = min((int)floor(hi.y - 0.5f), y_cell_length - 1);
+
+    for (y = y0; y <= y1; y++) {
+        for (x = x0; x <= x1; x++) {
+            float2 p = (float2)(x + 0.5f, y + 0.5f);
+            float zc;
+
+            if (!edge_inside(a, b, p, orientation) ||
+                !edge_inside(b, c, p, orientation) ||
+                !edge_inside(c, a, p, orientation))
+                continue;
+
+            /* Where the column crosses the triangle's plane */
+            zc = v0.z - (n.x * (p.x - v0.x) + n.y * (p.y - v0.y)) / n.z;
+            z = max((int)floor(zc - 0.5f) + 1, 0);
+            if (z >= z_cell_length)
+                continue;
+
+            toggle_voxel(grid, (size_t)z * z_stride + (size_t)y * y_stride +
+                         (size_t)x * x_stride);
+        }
+    }
+}
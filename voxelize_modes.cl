@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2015, Matthew J. Nicholls
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Specialised variants of the voxelize kernel in program.cl, taking the
+ * same arguments. The program is built once per mode with
+ * -D VOXELIZE_MODE=<mode>, so each variant only contains its own loop. The
+ * values match enum opencl_plugin_voxelize_mode in opencl_plugin.h. Built
+ * with voxelize_common.cl prepended.
+ */
+
+#define VOXELIZE_CONSERVATIVE 1
+#define VOXELIZE_SOLID        2
+
+#ifndef VOXELIZE_MODE
+#error "VOXELIZE_MODE must be defined"
+#endif
+
+#if VOXELIZE_MODE == VOXELIZE_CONSERVATIVE
+
+/* Every voxel that a triangle touches, see triangle_sat_overlaps() */
+__kernel void voxelize(__global uchar *grid,
+                       float inv_element_size,
+                       float corner_x,
+                       float corner_y,
+                       float corner_z,
+                       int next_row_offset,
+                       int next_slice_offset,
+                       int x_cell_length,
+                       int y_cell_length,
+                       int z_cell_length,
+                       __global const float *vertices,
+                       __global const int *triangles,
+                       int num_triangles,
+                       uint vertex_buffer_base_idx,
+                       uint triangle_buffer_base_idx)
+{
+    int i = get_global_id(0);
+    float3 v0, v1, v2;
+    triangle_sat sat;
+    int3 lo, hi;
+    int3 grid_max = (int3)(x_cell_length, y_cell_length, z_cell_length) - 1;
+    int x, y, z;
+
+    if (i >= num_triangles)
+        return;
+
+    load_triangle(vertices, triangles, vertex_buffer_base_idx,
+                  triangle_buffer_base_idx, i,
+                  (float3)(corner_x, corner_y, corner_z), inv_element_size,
+                  &v0, &v1, &v2);
+
+    if (!triangle_voxel_bounds(v0, v1, v2, grid_max, &lo, &hi))
+        return;
+    triangle_sat_init(&sat, v0, v1, v2);
+
+    for (z = lo.z; z <= hi.z; z++) {
+        for (y = lo.y; y <= hi.y; y++) {
+            __global uchar *row = grid + z * next_slice_offset + y * next_row_offset;
+            for (x = lo.x; x <= hi.x; x++) {
+                if (triangle_sat_overlaps(&sat, x, y, z))
+                    row[x] = 1;
+            }
+        }
+    }
+}
+
+#elif VOXELIZE_MODE == VOXELIZE_SOLID
+
+/* First pass of solid voxelization: for every column of voxel centres
+ * (along z) that a triangle crosses, toggle the first voxel whose centre
+ * lies above the crossing. Crossings below the grid toggle voxel 0, those
+ * above it are dropped. fill_parity then turns the toggles into the
+ * interior. Meshes must be closed, overlapping volumes cancel out. */
+__kernel void voxelize(__global uchar *grid,
+                       float inv_element_size,
+                       float corner_x,
+                       float corner_y,
+                       float corner_z,
+                       int next_row_offset,
+                       int next_slice_offset,
+                       int x_cell_length,
+                       int y_cell_length,
+                       int z_cell_length,
+                       __global const float *vertices,
+                       __global const int *triangles,
+                       int num_triangles,
+                       uint vertex_buffer_base_idx,
+                       uint triangle_buffer_base_idx)
+{
+    int i = get_global_id(0);
+    float3 v0, v1, v2, n;
+
+    if (i >= num_triangles)
+        return;
+
+    load_triangle(vertices, triangles, vertex_buffer_base_idx,
+                  triangle_buffer_base_idx, i,
+                  (float3)(corner_x, corner_y, corner_z), inv_element_size,
+                  &v0, &v1, &v2);
+
+    n = cross(v1 - v0, v2 - v0);
+    /* Parallel to z, no column crosses it */
+    if (n.z == 0.0f)
+        return;
+
+    toggle_column_crossings(grid, v0, v1, v2, n, x_cell_length,
+                            y_cell_length, z_cell_length, 1,
+                            (size_t)next_row_offset, (size_t)next_slice_offset);
+}
+
+/* Second pass of solid voxelization, one work-item per column: a running
+ * parity along z turns the toggles from voxelize into the voxels inside. */
+__kernel void fill_parity(__global uchar *grid,
+                          int next_row_offset,
+                          int next_slice_offset,
+                          int x_cell_length,
+                          int y_cell_length,
+                          int z_cell_length)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z;
+    uchar inside = 0;
+    __global uchar *column;
+
+    if (x >= x_cell_length || y >= y_cell_length)
+        return;
+
+    column = grid + y * next_row_offset + x;
+    for (z = 0; z < z_cell_length; z++) {
+        inside ^= column[(size_t)z * next_slice_offset];
+        column[(size_t)z * next_slice_offset] = inside;
+    }
+}
+
+#else
+#error "Unknown VOXELIZE_MODE"
+#endif